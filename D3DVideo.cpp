@@ -1,16 +1,32 @@
 
 #include "D3DVideo.h"
 #include "render_chain.hpp"
-#include "config_file.hpp"
+#include "trace.hpp"
+#include "preset_loader.hpp"
+#include "shader_preset.hpp"
+#include "shader_pack.hpp"
+#include "lut_cache.hpp"
+#include "readback.hpp"
+#include "recorder.hpp"
+#include "latency.hpp"
 
 #include <iostream>
 #include <exception>
 #include <stdexcept>
 #include <cstring>
+#include <cstdlib>
 #include <stdio.h>
 #include <stdint.h>
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <map>
+
+namespace Global
+{
+   static HWND hwnd = nullptr;
+   static std::map<UINT, D3DVideo::MessageHandler> message_handlers;
+}
 
 namespace Callback
 {
@@ -19,6 +35,10 @@ namespace Callback
    LRESULT CALLBACK WindowProc(HWND hWnd, UINT message, 
          WPARAM wParam, LPARAM lParam)
    {
+      auto handler = Global::message_handlers.find(message);
+      if (handler != Global::message_handlers.end())
+         handler->second(wParam, lParam);
+
       switch (message)
       {
          case WM_SYSKEYDOWN:
@@ -41,11 +61,6 @@ namespace Callback
    }
 }
 
-namespace Global
-{
-   static HWND hwnd = nullptr;
-}
-
 void D3DVideo::init_base(const rarch_video_info_t &info)
 {
    D3DPRESENT_PARAMETERS d3dpp;
@@ -88,6 +103,7 @@ void D3DVideo::make_d3dpp(const rarch_video_info_t &info, D3DPRESENT_PARAMETERS
 
 void D3DVideo::init(const rarch_video_info_t &info)
 {
+   font_failed = false;
    if (!g_pD3D)
       init_base(info);
    else if (needs_restore)
@@ -104,8 +120,6 @@ void D3DVideo::init(const rarch_video_info_t &info)
       throw std::runtime_error("Failed to init Cg");
    if (!init_chain(info))
       throw std::runtime_error("Failed to init render chain");
-   if (!init_font())
-      throw std::runtime_error("Failed to init Font");
 }
 
 void D3DVideo::set_viewport(unsigned x, unsigned y, unsigned width, unsigned height)
@@ -122,12 +136,7 @@ void D3DVideo::set_viewport(unsigned x, unsigned y, unsigned width, unsigned hei
    font_rect.right = x + width;
    font_rect.top = y + 0.85 * height; 
    font_rect.bottom = height;
-
-   font_rect_shifted = font_rect;
-   font_rect_shifted.left -= 2;
-   font_rect_shifted.right -= 2;
-   font_rect_shifted.top += 2;
-   font_rect_shifted.bottom += 2;
+   msg_text.clear();
 
    final_viewport = viewport;
 }
@@ -145,63 +154,45 @@ void D3DVideo::viewport_size(unsigned &width, unsigned &height)
 
 bool D3DVideo::read_viewport(uint8_t *buffer)
 {
-   bool ret = true;
-   IDirect3DSurface9 *target = nullptr;
-   IDirect3DSurface9 *dest   = nullptr;
+   return read_viewport(buffer, final_viewport.Width, final_viewport.Height,
+         RARCH_READBACK_BGR888);
+}
 
-   if (FAILED(dev->GetRenderTarget(0, &target)))
-   {
-      ret = false;
-      goto end;
-   }
+// Called every frame, captures are collected one frame late, so the GPU
+// has a frame's worth of time to finish the copy before we lock it.
+// Anything older is stale (e.g. left by an earlier screenshot),
+// so then we wait for the current frame instead.
+bool D3DVideo::read_viewport(uint8_t *buffer,
+      unsigned width, unsigned height, unsigned format)
+{
+   Readback::Format fmt = static_cast<Readback::Format>(format);
+   if (!Readback::supported(width, height, fmt))
+      return false;
 
-   if (FAILED(dev->CreateOffscreenPlainSurface(screen_width, screen_height,
-        D3DFMT_X8R8G8B8, D3DPOOL_SYSTEMMEM,
-        &dest, nullptr)))
-   {
-      ret = false;
-      goto end;
-   }
+   // Default pool surfaces created now would make Reset() fail.
+   if (needs_reset || needs_restore)
+      return false;
 
-   if (FAILED(dev->GetRenderTargetData(target, dest)))
-   {
-      ret = false;
-      goto end;
-   }
+   if (!readback)
+      readback = std::unique_ptr<Readback>(new Readback(dev, cgCtx));
 
-   D3DLOCKED_RECT rect;
-   if (SUCCEEDED(dest->LockRect(&rect, nullptr, D3DLOCK_READONLY)))
-   {
-      unsigned pitchpix = rect.Pitch / 4;
-      const uint32_t *pixels = (const uint32_t*)rect.pBits;
-      pixels += final_viewport.X;
-      pixels += (final_viewport.Height - 1) * pitchpix;
-      pixels -= final_viewport.Y * pitchpix;
+   IDirect3DSurface9 *target = nullptr;
+   if (FAILED(dev->GetRenderTarget(0, &target)))
+      return false;
 
-      for (unsigned y = 0; y < final_viewport.Height; y++, pixels -= pitchpix)
-      {
-         for (unsigned x = 0; x < final_viewport.Width; x++)
-         {
-            *buffer++ = (pixels[x] >>  0) & 0xff;
-            *buffer++ = (pixels[x] >>  8) & 0xff;
-            *buffer++ = (pixels[x] >> 16) & 0xff;
-         }
-      }
+   readback->drop_older(frame_count - 1);
+   bool captured = readback->capture(target, final_viewport, width, height, fmt, frame_count);
+   target->Release();
 
-      dest->UnlockRect();
-   }
-   else
+   while (readback->pending() > (captured ? 1u : 0u))
    {
-      ret = false;
-      goto end;
+      if (readback->collect(buffer, width, height, fmt, true))
+         return true;
    }
 
-end:
-   if (target)
-      target->Release();
-   if (dest)
-      dest->Release();
-   return ret;
+   // Nothing from the previous frame, so wait for this capture.
+   // Keep it queued, in case we're called again next frame.
+   return captured && readback->collect(buffer, width, height, fmt, true, true);
 }
 
 void D3DVideo::calculate_rect(unsigned width, unsigned height,
@@ -228,8 +219,18 @@ void D3DVideo::calculate_rect(unsigned width, unsigned height,
 }
 
 D3DVideo::D3DVideo(const rarch_video_info_t *info) : 
-   g_pD3D(nullptr), dev(nullptr), rotation(0), needs_restore(false), frames(0)
+   g_pD3D(nullptr), dev(nullptr), font(nullptr), sprite(nullptr), rotation(0), needs_restore(false), needs_reset(false),
+   preset_pending(false), font_failed(false), msg_tex(nullptr), msg_tex_width(0), msg_tex_height(0), frames(0), frame_count(0)
 {
+   last_reset_attempt.QuadPart = 0;
+
+   // Start reading the preset from disk while we set up the window and device.
+   // Packs are already compiled and mapped directly, nothing to wait for.
+   preset_pending = info->cg_shader && std::strstr(info->cg_shader, ".cgp") &&
+      !std::strstr(info->cg_shader, ".cgpack");
+   if (preset_pending)
+      preset_loader = std::unique_ptr<PresetLoader>(new PresetLoader(info->cg_shader));
+
    ZeroMemory(&windowClass, sizeof(windowClass));
    windowClass.cbSize = sizeof(windowClass);
    windowClass.style = CS_HREDRAW | CS_VREDRAW;
@@ -287,8 +288,12 @@ D3DVideo::D3DVideo(const rarch_video_info_t *info) :
    SetForegroundWindow(hWnd);
    SetFocus(hWnd);
 
+   Trace::init();
+   Latency::init();
+
    video_info = *info;
    init(video_info);
+   init_recorder();
 
    std::cerr << "[Direct3D]: Good to go!" << std::endl;
 
@@ -302,26 +307,47 @@ HWND D3DVideo::hwnd()
    return Global::hwnd;
 }
 
+void D3DVideo::set_message_handler(UINT message, const MessageHandler &handler)
+{
+   if (handler)
+      Global::message_handlers[message] = handler;
+   else
+      Global::message_handlers.erase(message);
+}
+
 void D3DVideo::deinit()
 {
+   readback.reset();
+   if (recorder)
+      recorder->release_device();
+   Latency::release_device();
    deinit_font();
    deinit_chain();
    deinit_cg();
 
    needs_restore = false;
+   needs_reset = false;
 }
 
 D3DVideo::~D3DVideo()
 {
+   preset_loader.reset();
+   recorder.reset();
    deinit();
    if (dev)
+   {
+      LutCache::release_device(dev);
       dev->Release();
+   }
    if (g_pD3D)
       g_pD3D->Release();
 
    DestroyWindow(hWnd);
    UnregisterClass(L"SSNESWindowClass", GetModuleHandle(nullptr));
    Global::hwnd = nullptr;
+
+   Latency::deinit();
+   Trace::deinit();
 }
 
 #define BLACK D3DCOLOR_XRGB(0, 0, 0)
@@ -344,53 +370,195 @@ bool D3DVideo::restore()
    return !needs_restore;
 }
 
+// Releases everything living in D3DPOOL_DEFAULT, which is what
+// Reset() requires. Called as soon as we notice the device is lost.
+void D3DVideo::lose_device()
+{
+   if (needs_reset)
+      return;
+
+   std::cerr << "[Direct3D]: Device lost, waiting for it to come back ..." << std::endl;
+
+   readback.reset();
+   if (recorder)
+      recorder->release_device();
+   Latency::release_device();
+   if (chain)
+      chain->on_lost_device();
+   release_msg();
+   if (font)
+      font->OnLostDevice();
+   if (sprite)
+      sprite->OnLostDevice();
+
+   needs_reset = true;
+}
+
+// While the device is lost (e.g. minimized fullscreen window), don't
+// hammer Reset() or a full restore every frame.
+// Only check TestCooperativeLevel() a few times per second, and only try
+// to bring the device back once it says it can be reset.
+bool D3DVideo::device_ready()
+{
+   LARGE_INTEGER current;
+   QueryPerformanceCounter(&current);
+   if (current.QuadPart - last_reset_attempt.QuadPart < freq.QuadPart / 10)
+      return false;
+   last_reset_attempt = current;
+
+   return dev->TestCooperativeLevel() != D3DERR_DEVICELOST;
+}
+
+// Reconfigures the swapchain (present interval, etc.) or recovers from
+// a lost device with a plain Reset(). Unlike restore(), this keeps the Cg
+// context, compiled programs and managed textures alive, and only
+// recreates D3DPOOL_DEFAULT objects.
+// Returns false if the device isn't ready to be reset yet.
+bool D3DVideo::reset()
+{
+   if (!chain || needs_restore)
+      return restore();
+
+   lose_device();
+
+   D3DPRESENT_PARAMETERS d3dpp;
+   make_d3dpp(video_info, d3dpp);
+   HRESULT ret = dev->Reset(&d3dpp);
+   if (ret == D3DERR_DEVICELOST)
+      return false;
+   else if (ret != D3D_OK)
+   {
+      std::cerr << "[Direct3D]: Reset failed, falling back to full restore." << std::endl;
+      return restore();
+   }
+
+   try
+   {
+      chain->on_reset_device();
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << "[Direct3D]: Reset error: " << e.what() << std::endl;
+      return restore();
+   }
+
+   if (font)
+      font->OnResetDevice();
+   if (sprite)
+      sprite->OnResetDevice();
+   font_failed = false;
+
+   needs_reset = false;
+   return true;
+}
+
 int D3DVideo::frame(const void *frame, 
       unsigned width, unsigned height, unsigned pitch,
       const char *msg)
 {
-   if (needs_restore && !restore())
+   Trace::Scope trace("Frame");
+   Latency::frame_begin();
+
+   if (needs_restore || needs_reset)
    {
-      std::cerr << "[Direct3D]: Restore failed!" << std::endl;
-      return RARCH_ERROR;
+      // Idle while the device is lost, drop the frame.
+      if (!device_ready())
+         return RARCH_OK;
+
+      if (needs_restore && !restore())
+      {
+         std::cerr << "[Direct3D]: Restore failed!" << std::endl;
+         return RARCH_ERROR;
+      }
+
+      if (needs_reset && !reset())
+         return RARCH_OK;
    }
 
+   poll_preset();
+
    if (!chain->render(frame, width, height, pitch, rotation))
       return RARCH_FALSE;
 
-   if (msg && SUCCEEDED(dev->BeginScene()))
+   // Recorded before the OSD is drawn.
+   if (recorder)
    {
-      font->DrawTextA(nullptr,
-            msg,
-            -1,
-            &font_rect_shifted,
-            DT_LEFT,
-            ((video_info.ttf_font_color >> 2) & 0x3f3f3f) | 0xff000000);
+      IDirect3DSurface9 *target;
+      if (SUCCEEDED(dev->GetRenderTarget(0, &target)))
+      {
+         recorder->capture(dev, cgCtx, target, final_viewport);
+         target->Release();
+      }
+   }
 
-      font->DrawTextA(nullptr,
-            msg,
-            -1,
-            &font_rect,
-            DT_LEFT,
-            video_info.ttf_font_color | 0xff000000);
+   if (msg)
+      render_msg(msg);
 
-      dev->EndScene();
-   }
+   Latency::present_begin(dev);
+   Trace::begin("Present");
+   HRESULT ret = dev->Present(nullptr, nullptr, nullptr, nullptr);
+   Trace::end("Present");
+   Latency::present_end();
 
-   if (dev->Present(nullptr, nullptr, nullptr, nullptr) != D3D_OK)
+   if (ret == D3DERR_DEVICELOST)
+   {
+      lose_device();
+      return RARCH_OK;
+   }
+   else if (ret != D3D_OK)
    {
       needs_restore = true;
       return RARCH_OK;
    }
 
+   frame_count++;
    update_title();
 
    return RARCH_OK;
 }
 
+// RARCH_D3D9_RECORD names the file to record to.
+// Size defaults to the initial viewport, RARCH_D3D9_RECORD_SIZE=WxH overrides it.
+void D3DVideo::init_recorder()
+{
+   const char *path = std::getenv("RARCH_D3D9_RECORD");
+   if (!path || !*path)
+      return;
+
+   unsigned width, height;
+   Recorder::viewport_size(path, final_viewport.Width, final_viewport.Height, width, height);
+   const char *size = std::getenv("RARCH_D3D9_RECORD_SIZE");
+   unsigned size_w, size_h;
+   if (size && *size)
+   {
+      if (std::sscanf(size, "%ux%u", &size_w, &size_h) == 2)
+      {
+         width = size_w;
+         height = size_h;
+      }
+      else
+         std::cerr << "[Direct3D]: Invalid RARCH_D3D9_RECORD_SIZE, using viewport size." << std::endl;
+   }
+
+   unsigned fps = 60;
+   const char *fps_env = std::getenv("RARCH_D3D9_RECORD_FPS");
+   if (fps_env && *fps_env)
+      fps = std::strtoul(fps_env, nullptr, 0);
+
+   try
+   {
+      recorder = std::unique_ptr<Recorder>(new Recorder(path, width, height, fps ? fps : 60));
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << "[Direct3D]: Recording disabled: " << e.what() << std::endl;
+   }
+}
+
 void D3DVideo::set_nonblock_state(int state)
 {
    video_info.vsync = !state;
-   restore();
+   reset();
 }
 
 int D3DVideo::alive()
@@ -440,13 +608,14 @@ void D3DVideo::deinit_cg()
    }
 }
 
-void D3DVideo::init_chain_singlepass(const rarch_video_info_t &video_info)
+void D3DVideo::init_chain_singlepass(const rarch_video_info_t &video_info,
+      const std::string &shader)
 {
    LinkInfo info = {0};
-   info.shader_path = video_info.cg_shader ? video_info.cg_shader : "";
+   info.shader_path = shader;
    info.scale_x = info.scale_y = 1.0f;
    info.filter_linear = video_info.smooth;
-   info.tex_w = info.tex_h = 256 * video_info.input_scale;
+   info.tex_w = info.tex_h = ChainPlan::input_size(video_info.input_scale);
    info.scale_type_x = info.scale_type_y = LinkInfo::Viewport;
 
    chain = std::unique_ptr<RenderChain>(new RenderChain(
@@ -458,309 +627,123 @@ void D3DVideo::init_chain_singlepass(const rarch_video_info_t &video_info)
                final_viewport));
 }
 
-static inline uint32_t next_pot(uint32_t v)
-{
-   v--;
-   v |= v >> 1;
-   v |= v >> 2;
-   v |= v >> 4;
-   v |= v >> 8;
-   v |= v >> 16;
-   v++;
-   return v;
-}
-
-static std::vector<std::string> tokenize(const std::string &str)
+void D3DVideo::init_imports(const ShaderPreset &preset)
 {
-   std::vector<std::string> list;
-   char *elem = strdup(str.c_str());
-   const char *tex = strtok(elem, ";");
-   while (tex)
-   {
-      list.push_back(tex);
-      tex = strtok(nullptr, ";");
-   }
-   free(elem);
+   if (preset.imports.empty())
+      return;
 
-   return list;
+   chain->add_state_tracker(preset.import_script, preset.import_script_class, preset.imports);
 }
 
-void D3DVideo::init_imports(ConfigFile &conf, const std::string &basedir)
+void D3DVideo::init_luts(const ShaderPreset &preset)
 {
-   std::string imports;
-   if (!conf.get("imports", imports))
-      return;
+   // Block compression can be requested for all LUTs through the environment,
+   // or per LUT in the preset with <id>_compress.
+   const char *env = std::getenv("RARCH_D3D9_LUT_COMPRESS");
+   bool compress_all = env && *env && std::strcmp(env, "0");
 
-   std::vector<std::string> list = tokenize(imports);
+   for (unsigned i = 0; i < preset.luts.size(); i++)
+   {
+      const ShaderPreset::Lut &lut = preset.luts[i];
+      if (pack)
+      {
+         // Packed LUTs are decoded (and compressed) by the packer.
+         IDirect3DTexture9 *tex = pack->create_texture(dev, i);
+         if (tex)
+         {
+            chain->add_lut(lut.id, tex, lut.filter_linear);
+            continue;
+         }
 
-   std::string path;
-   if (!conf.get("import_script", path))
-      throw std::runtime_error("Didn't find import_script!");
+         std::cerr << "[Direct3D]: Can't create packed LUT " << lut.id <<
+            ", loading " << lut.path << "." << std::endl;
+      }
 
-   std::string py_class;
-   if (!conf.get("import_script_class", py_class))
-      throw std::runtime_error("Didn't find import_script_class!");
+      bool compress = lut.compress == ShaderPreset::Default ?
+         compress_all : lut.compress == ShaderPreset::Enabled;
 
-   chain->add_state_tracker(basedir + path, py_class, list);
+      chain->add_lut(lut.id, lut.path, lut.filter_linear, compress);
+   }
 }
 
-void D3DVideo::init_luts(ConfigFile &conf, const std::string &basedir)
+void D3DVideo::init_pack(const std::string &path)
 {
-   std::string textures;
-   if (!conf.get("textures", textures))
-      return;
+   pack = std::unique_ptr<ShaderPack>(new ShaderPack(path));
+   preset = std::unique_ptr<ShaderPreset>(new ShaderPreset(pack->preset()));
 
-   std::vector<std::string> list = tokenize(textures);
-
-   for (unsigned i = 0; i < list.size(); i++)
+   ShaderCache::Profile fragment, vertex;
+   RenderChain::shader_profiles(fragment, vertex);
+   const char *want_vertex = cgGetProfileString(vertex.profile);
+   const char *want_fragment = cgGetProfileString(fragment.profile);
+   if (std::strcmp(want_vertex, pack->vertex_profile()) ||
+         std::strcmp(want_fragment, pack->fragment_profile()))
    {
-      const std::string &id = list[i];
-
-      bool smooth = true;
-      conf.get(id + "_filter", smooth);
-
-      std::string path;
-      if (!conf.get(id, path))
-         throw std::runtime_error("Failed to get LUT texture path!");
-
-      chain->add_lut(id, basedir + path, smooth);
+      std::cerr << "[Direct3D]: Shader pack was built for " <<
+         pack->vertex_profile() << "/" << pack->fragment_profile() <<
+         ", device wants " << want_vertex << "/" << want_fragment <<
+         ". Compiling from source." << std::endl;
    }
 }
 
 void D3DVideo::init_chain_multipass(const rarch_video_info_t &info)
 {
-   ConfigFile conf(info.cg_shader);
-
-   int shaders;
-   if (!conf.get("shaders", shaders))
-      throw std::runtime_error("Couldn't find \"shaders\" in meta-shader");
-
-   if (shaders < 1)
-      throw std::runtime_error("Must have at least one shader!");
-
-   std::cerr << "[Direct3D Meta-Cg] Found " << shaders << " shaders!" << std::endl;
-
-   std::string basedir = info.cg_shader;
-   size_t pos = basedir.rfind('/');
-   if (pos == std::string::npos)
-      pos = basedir.rfind('\\');
-   if (pos != std::string::npos)
-      basedir.replace(basedir.begin() + pos + 1, basedir.end(), "");
-
-   bool use_extra_pass = false;
-   bool use_first_pass_only = false;
-
-   std::vector<std::string> shader_paths;
-   std::vector<LinkInfo::ScaleType> scale_types_x;
-   std::vector<LinkInfo::ScaleType> scale_types_y;
-   std::vector<float> scales_x;
-   std::vector<float> scales_y;
-   std::vector<unsigned> abses_x;
-   std::vector<unsigned> abses_y;
-   std::vector<bool> filters;
-
-   // Shader paths.
-   for (int i = 0; i < shaders; i++)
-   {
-      char buf[256];
-      snprintf(buf, sizeof(buf), "shader%d", i);
-
-      std::string relpath;
-      if (!conf.get(buf, relpath))
-         throw std::runtime_error("Couldn't locate shader path in meta-shader");
-
-      shader_paths.push_back(basedir);
-      shader_paths.back() += relpath;
-   }
-
-   // Dimensions.
-   for (int i = 0; i < shaders; i++)
-   {
-      char attr_type[64];
-      char attr_type_x[64];
-      char attr_type_y[64];
-      char attr_scale[64];
-      char attr_scale_x[64];
-      char attr_scale_y[64];
-      int abs_x = 256 * info.input_scale;
-      int abs_y = 256 * info.input_scale;
-      double scale_x = 1.0f;
-      double scale_y = 1.0f;
-
-      std::string attr   = "source";
-      std::string attr_x = "source";
-      std::string attr_y = "source";
-      snprintf(attr_type,    sizeof(attr_type),    "scale_type%d", i);
-      snprintf(attr_type_x,  sizeof(attr_type_x),  "scale_type_x%d", i);
-      snprintf(attr_type_y,  sizeof(attr_type_x),  "scale_type_y%d", i);
-      snprintf(attr_scale,    sizeof(attr_scale),   "scale%d", i);
-      snprintf(attr_scale_x, sizeof(attr_scale_x), "scale_x%d", i);
-      snprintf(attr_scale_y, sizeof(attr_scale_y), "scale_y%d", i);
-
-      bool has_scale = false;
-
-      if (conf.get(attr_type, attr))
-      {
-         attr_x = attr_y = attr;
-         has_scale = true;
-      }
-      else
-      {
-         if (conf.get(attr_type_x, attr))
-            has_scale = true;
-         if (conf.get(attr_type_y, attr))
-            has_scale = true;
-      }
-
-      if (attr_x == "source")
-         scale_types_x.push_back(LinkInfo::Relative);
-      else if (attr_x == "viewport")
-         scale_types_x.push_back(LinkInfo::Viewport);
-      else if (attr_x == "absolute")
-         scale_types_x.push_back(LinkInfo::Absolute);
-      else
-         throw std::runtime_error("Invalid scale_type_x!");
-
-      if (attr_y == "source")
-         scale_types_y.push_back(LinkInfo::Relative);
-      else if (attr_y == "viewport")
-         scale_types_y.push_back(LinkInfo::Viewport);
-      else if (attr_y == "absolute")
-         scale_types_y.push_back(LinkInfo::Absolute);
-      else
-         throw std::runtime_error("Invalid scale_type_y!");
-      
-      double scale;
-      if (conf.get(attr_scale, scale))
-         scale_x = scale_y = scale;
-      else
-      {
-         conf.get(attr_scale_x, scale_x);
-         conf.get(attr_scale_y, scale_y);
-      }
-
-      int absolute;
-      if (conf.get(attr_scale, absolute))
-         abs_x = abs_y = absolute;
-      else
-      {
-         conf.get(attr_scale_x, abs_x);
-         conf.get(attr_scale_y, abs_y);
-      }
-
-      scales_x.push_back(scale_x);
-      scales_y.push_back(scale_y);
-      abses_x.push_back(abs_x);
-      abses_y.push_back(abs_y);
-
-      if (has_scale && i == shaders - 1)
-         use_extra_pass = true;
-      else if (!has_scale && i == 0)
-         use_first_pass_only = true;
-      else if (i > 0)
-         use_first_pass_only = false;
-   }
-
-   // Filter options.
-   for (int i = 0; i < shaders; i++)
+   // Parsed once, restores reuse it.
+   if (!preset)
    {
-      char attr_filter[64];
-      snprintf(attr_filter, sizeof(attr_filter), "filter_linear%d", i);
-      bool filter = info.smooth;
-      conf.get(attr_filter, filter);
-      filters.push_back(filter);
+      if (std::strstr(info.cg_shader, ".cgpack"))
+         init_pack(info.cg_shader);
+      else
+         preset = std::unique_ptr<ShaderPreset>(new ShaderPreset(info.cg_shader));
    }
 
-   // Setup information for first pass.
-   LinkInfo link_info = {0};
-   link_info.shader_path = shader_paths[0];
+   std::cerr << "[Direct3D Meta-Cg] Found " << preset->passes.size() << " shaders!" << std::endl;
 
-   if (use_first_pass_only)
-   {
-      link_info.scale_x = link_info.scale_y = 1.0f;
-      link_info.scale_type_x = link_info.scale_type_y = LinkInfo::Viewport;
-   }
-   else
-   {
-      link_info.scale_x = scales_x[0];
-      link_info.scale_y = scales_y[0];
-      link_info.abs_x = abses_x[0];
-      link_info.abs_y = abses_y[0];
-      link_info.scale_type_x = scale_types_x[0];
-      link_info.scale_type_y = scale_types_y[0];
-   }
+   ShaderCache::Profile fragment, vertex;
+   RenderChain::shader_profiles(fragment, vertex);
+   ShaderCache::precompile(preset->shader_paths(), fragment, vertex);
 
-   link_info.filter_linear = filters[0];
-   link_info.tex_w = link_info.tex_h = info.input_scale * 256;
+   std::vector<LinkInfo> links = ChainPlan::plan(*preset,
+         info.input_scale, info.smooth,
+         final_viewport.Width, final_viewport.Height);
 
    chain = std::unique_ptr<RenderChain>(
          new RenderChain(
             video_info,
             dev, cgCtx,
-            link_info,
+            links[0],
             info.color_format == RARCH_COLOR_FORMAT_XRGB1555 ?
             RenderChain::RGB15 : RenderChain::ARGB,
             final_viewport));
 
-   unsigned current_width = link_info.tex_w;
-   unsigned current_height = link_info.tex_h;
-   unsigned out_width = 0;
-   unsigned out_height = 0;
-
-   for (int i = 1; i < shaders; i++)
-   {
-      RenderChain::convert_geometry(link_info,
-            out_width, out_height,
-            current_width, current_height, final_viewport);
-
-      link_info.scale_x = scales_x[i];
-      link_info.scale_y = scales_y[i];
-      link_info.tex_w = next_pot(out_width);
-      link_info.tex_h = next_pot(out_height);
-      link_info.scale_type_x = scale_types_x[i];
-      link_info.scale_type_y = scale_types_y[i];
-      link_info.filter_linear = filters[i];
-      link_info.shader_path = shader_paths[i];
-
-      current_width = out_width;
-      current_height = out_height;
-
-      if (i == shaders - 1 && !use_extra_pass)
-      {
-         link_info.scale_x = link_info.scale_y = 1.0f;
-         link_info.scale_type_x = link_info.scale_type_y = LinkInfo::Viewport;
-      }
-
-      chain->add_pass(link_info);
-   }
-
-   if (use_extra_pass)
-   {
-      RenderChain::convert_geometry(link_info,
-            out_width, out_height,
-            current_width, current_height, final_viewport);
+   for (unsigned i = 1; i < links.size(); i++)
+      chain->add_pass(links[i]);
 
-      link_info.scale_x = link_info.scale_y = 1.0f;
-      link_info.scale_type_x = link_info.scale_type_y = LinkInfo::Viewport;
-      link_info.filter_linear = info.smooth;
-      link_info.tex_w = next_pot(out_width);
-      link_info.tex_h = next_pot(out_height);
-      link_info.shader_path = "";
-      chain->add_pass(link_info);
-   }
+   init_luts(*preset);
+   init_imports(*preset);
 
-   init_luts(conf, basedir);
-   init_imports(conf, basedir);
+   // LUTs of earlier presets aren't needed any more.
+   LutCache::trim();
 }
 
 bool D3DVideo::init_chain(const rarch_video_info_t &video_info)
 {
    try
    {
-      if (video_info.cg_shader && std::strstr(video_info.cg_shader, ".cgp"))
+      if (preset_pending)
+      {
+         // Show something right away while the preset compiles.
+         if (!preset_loader->compiling())
+         {
+            ShaderCache::Profile fragment, vertex;
+            RenderChain::shader_profiles(fragment, vertex);
+            preset_loader->compile(fragment, vertex);
+         }
+         init_chain_singlepass(video_info, "");
+      }
+      else if (video_info.cg_shader && std::strstr(video_info.cg_shader, ".cgp"))
          init_chain_multipass(video_info);
       else
-         init_chain_singlepass(video_info);
+         init_chain_singlepass(video_info, video_info.cg_shader ? video_info.cg_shader : "");
    }
    catch (const std::exception &e)
    {
@@ -776,6 +759,30 @@ void D3DVideo::deinit_chain()
    chain.reset();
 }
 
+// Swaps in the real preset chain once it has been compiled in the background.
+void D3DVideo::poll_preset()
+{
+   if (!preset_loader || !preset_loader->finished())
+      return;
+
+   preset_pending = false;
+   preset = preset_loader->take_preset();
+
+   std::unique_ptr<RenderChain> stock = std::move(chain);
+   if (!init_chain(video_info))
+   {
+      std::cerr << "[Direct3D]: Failed to load preset, keeping stock shader." << std::endl;
+      video_info.cg_shader = nullptr;
+      preset.reset();
+      chain = std::move(stock);
+   }
+
+   // Later restores should see changes on disk.
+   preset_loader.reset();
+   ShaderCache::drop_preloaded();
+   LutCache::drop_prefetched();
+}
+
 bool D3DVideo::init_font()
 {
    D3DXFONT_DESC desc = {
@@ -787,13 +794,143 @@ bool D3DVideo::init_font()
       L"Verdana" // Hardcode ftl :(
    };
 
-   return SUCCEEDED(D3DXCreateFontIndirect(dev, &desc, &font));
+   if (FAILED(D3DXCreateFontIndirect(dev, &desc, &font)) ||
+         FAILED(D3DXCreateSprite(dev, &sprite)))
+   {
+      std::cerr << "[Direct3D]: Failed to init font." << std::endl;
+      deinit_font();
+      font_failed = true;
+      return false;
+   }
+
+   return true;
 }
 
 void D3DVideo::deinit_font()
 {
+   release_msg();
+   if (sprite)
+      sprite->Release();
    if (font)
       font->Release();
+   sprite = nullptr;
+   font = nullptr;
+}
+
+void D3DVideo::release_msg()
+{
+   if (msg_tex)
+      msg_tex->Release();
+   msg_tex = nullptr;
+   msg_tex_width = msg_tex_height = 0;
+   msg_text.clear();
+}
+
+// Renders the message with its drop shadow into msg_tex.
+// The texture ends up with premultiplied alpha.
+bool D3DVideo::update_msg(const char *msg)
+{
+   Trace::Scope trace("Message update");
+
+   msg_text.clear();
+
+   LONG max_width = font_rect.right - font_rect.left;
+   RECT rect = { 0, 0, max_width, 0 };
+   font->DrawTextA(nullptr, msg, -1, &rect, DT_LEFT | DT_CALCRECT, 0);
+
+   // Room for the shadow, which is offset by 2 pixels.
+   unsigned width = std::min(rect.right, max_width) + 2;
+   unsigned height = rect.bottom + 2;
+
+   if (!msg_tex || width > msg_tex_width || height > msg_tex_height)
+   {
+      if (msg_tex)
+         msg_tex->Release();
+      msg_tex = nullptr;
+
+      // Leave some headroom so the next message likely fits.
+      msg_tex_width = (std::max(width, msg_tex_width) + 63) & ~63u;
+      msg_tex_height = (std::max(height, msg_tex_height) + 15) & ~15u;
+      if (FAILED(dev->CreateTexture(msg_tex_width, msg_tex_height, 1,
+                  D3DUSAGE_RENDERTARGET, D3DFMT_A8R8G8B8, D3DPOOL_DEFAULT,
+                  &msg_tex, nullptr)))
+      {
+         msg_tex_width = msg_tex_height = 0;
+         return false;
+      }
+   }
+
+   IDirect3DSurface9 *surf = nullptr;
+   IDirect3DSurface9 *old_target = nullptr;
+   if (FAILED(msg_tex->GetSurfaceLevel(0, &surf)) ||
+         FAILED(dev->GetRenderTarget(0, &old_target)))
+   {
+      if (surf)
+         surf->Release();
+      return false;
+   }
+
+   D3DVIEWPORT9 old_vp;
+   dev->GetViewport(&old_vp);
+
+   dev->SetRenderTarget(0, surf);
+   dev->Clear(0, nullptr, D3DCLEAR_TARGET, 0, 1, 0);
+
+   if (SUCCEEDED(dev->BeginScene()))
+   {
+      sprite->Begin(D3DXSPRITE_ALPHABLEND);
+      // Accumulate coverage in alpha as well, so the texture
+      // can be composited with premultiplied blending.
+      dev->SetRenderState(D3DRS_SEPARATEALPHABLENDENABLE, TRUE);
+      dev->SetRenderState(D3DRS_SRCBLENDALPHA, D3DBLEND_ONE);
+      dev->SetRenderState(D3DRS_DESTBLENDALPHA, D3DBLEND_INVSRCALPHA);
+
+      RECT shadow_rect = { 0, 2, (LONG)width, (LONG)height };
+      RECT text_rect = { 2, 0, (LONG)width, (LONG)height };
+      font->DrawTextA(sprite, msg, -1, &shadow_rect, DT_LEFT,
+            ((video_info.ttf_font_color >> 2) & 0x3f3f3f) | 0xff000000);
+      font->DrawTextA(sprite, msg, -1, &text_rect, DT_LEFT,
+            video_info.ttf_font_color | 0xff000000);
+
+      sprite->End();
+      dev->EndScene();
+   }
+
+   dev->SetRenderTarget(0, old_target);
+   dev->SetViewport(&old_vp);
+   old_target->Release();
+   surf->Release();
+
+   msg_rect.left = 0;
+   msg_rect.top = 0;
+   msg_rect.right = width;
+   msg_rect.bottom = height;
+   msg_text = msg;
+   return true;
+}
+
+void D3DVideo::render_msg(const char *msg)
+{
+   Trace::Scope trace("Message");
+
+   // Don't retry every frame, only after the device has been reset.
+   if (!font && (font_failed || !init_font()))
+      return;
+
+   if (msg_text != msg && !update_msg(msg))
+      return;
+
+   if (!SUCCEEDED(dev->BeginScene()))
+      return;
+
+   sprite->Begin(D3DXSPRITE_ALPHABLEND);
+   dev->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_ONE);
+
+   D3DXVECTOR3 pos(font_rect.left - 2, font_rect.top, 0.0f);
+   sprite->Draw(msg_tex, &msg_rect, nullptr, &pos, 0xffffffff);
+
+   sprite->End();
+   dev->EndScene();
 }
 
 void D3DVideo::update_title()
@@ -11,9 +11,14 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <functional>
 
-class ConfigFile;
 class RenderChain;
+class PresetLoader;
+struct ShaderPreset;
+class ShaderPack;
+class Readback;
+class Recorder;
 
 class D3DVideo
 {
@@ -30,9 +35,17 @@ class D3DVideo
       void set_rotation(unsigned rot);
       void viewport_size(unsigned &width, unsigned &height);
       bool read_viewport(uint8_t *buffer);
+      // Scaled and converted on the GPU, see rarch_video_ext.h.
+      bool read_viewport(uint8_t *buffer,
+            unsigned width, unsigned height, unsigned format);
 
       static HWND hwnd();
 
+      // Lets input drivers see messages sent to the window,
+      // on the thread which calls frame(). An empty handler removes it.
+      typedef std::function<void (WPARAM wParam, LPARAM lParam)> MessageHandler;
+      static void set_message_handler(UINT message, const MessageHandler &handler);
+
    private:
 
       WNDCLASSEX windowClass;
@@ -40,6 +53,7 @@ class D3DVideo
       IDirect3D9 *g_pD3D;
       IDirect3DDevice9 *dev;
       LPD3DXFONT font;
+      LPD3DXSPRITE sprite;
 
       void calculate_rect(unsigned width, unsigned height, bool keep, float aspect);
       void set_viewport(unsigned x, unsigned y, unsigned width, unsigned height);
@@ -59,26 +73,60 @@ class D3DVideo
       bool needs_restore;
       bool restore();
 
+      bool needs_reset;
+      void lose_device();
+      bool reset();
+
+      LARGE_INTEGER last_reset_attempt;
+      bool device_ready();
+
       CGcontext cgCtx;
       bool init_cg();
       void deinit_cg();
 
-      void init_imports(ConfigFile &conf, const std::string &basedir);
-      void init_luts(ConfigFile &conf, const std::string &basedir);
-      void init_chain_singlepass(const rarch_video_info_t &video_info);
+      void init_imports(const ShaderPreset &preset);
+      void init_luts(const ShaderPreset &preset);
+      void init_chain_singlepass(const rarch_video_info_t &video_info,
+            const std::string &shader);
       void init_chain_multipass(const rarch_video_info_t &video_info);
       bool init_chain(const rarch_video_info_t &video_info);
       std::unique_ptr<RenderChain> chain;
       void deinit_chain();
 
+      std::unique_ptr<Readback> readback;
+
+      std::unique_ptr<Recorder> recorder;
+      void init_recorder();
+
+      std::unique_ptr<ShaderPreset> preset;
+      // Set when the shader is a prebuilt .cgpack, kept mapped while in use.
+      std::unique_ptr<ShaderPack> pack;
+      void init_pack(const std::string &path);
+      bool preset_pending;
+      std::unique_ptr<PresetLoader> preset_loader;
+      void poll_preset();
+
+      // The font is only created once there is a message to show.
+      // Messages are rendered into msg_tex when they change,
+      // which is then drawn as a single sprite every frame.
       bool init_font();
       void deinit_font();
+      // Set when init_font() failed, cleared by init() and reset().
+      bool font_failed;
+      void release_msg();
+      bool update_msg(const char *msg);
+      void render_msg(const char *msg);
       RECT font_rect;
-      RECT font_rect_shifted;
+      IDirect3DTexture9 *msg_tex;
+      unsigned msg_tex_width, msg_tex_height;
+      RECT msg_rect;
+      std::string msg_text;
 
       void update_title();
       std::wstring title;
       unsigned frames;
+      // Frames presented, for matching readbacks to frames.
+      unsigned frame_count;
       LARGE_INTEGER last_time;
       LARGE_INTEGER freq;
 };
@@ -5,16 +5,23 @@
 #include <iostream>
 #include "keysym.h"
 #include "D3DVideo.h"
+#include "trace.hpp"
+#include "thread.hpp"
+#include "raw_keyboard.hpp"
+#include "latency.hpp"
 #include <assert.h>
 #include <stdexcept>
 #include <utility>
 #include <cstring>
+#include <cstdlib>
+#include <mmsystem.h>
 
 namespace Callback
 {
    static BOOL CALLBACK EnumJoypad(const DIDEVICEINSTANCE *instance, void *p)
    {
-      return reinterpret_cast<DirectInput*>(p)->init_joypad(instance);
+      reinterpret_cast<std::vector<DIDEVICEINSTANCE>*>(p)->push_back(*instance);
+      return DIENUM_CONTINUE;
    }
 
    static BOOL CALLBACK EnumAxes(const DIDEVICEOBJECTINSTANCE *instance, void *p)
@@ -35,6 +42,17 @@ namespace Callback
    }
 }
 
+static bool set_buffer_size(IDirectInputDevice8 *dev, DWORD size)
+{
+   DIPROPDWORD prop;
+   memset(&prop, 0, sizeof(prop));
+   prop.diph.dwSize = sizeof(DIPROPDWORD);
+   prop.diph.dwHeaderSize = sizeof(DIPROPHEADER);
+   prop.diph.dwHow = DIPH_DEVICE;
+   prop.dwData = size;
+   return SUCCEEDED(dev->SetProperty(DIPROP_BUFFERSIZE, &prop.diph));
+}
+
 namespace Map
 {
    struct Key 
@@ -125,12 +143,31 @@ namespace Map
    };
 }
 
-DirectInput::DirectInput(const int joypad_index[8], float threshold) :
-   ctx(nullptr), keyboard(nullptr), thres(threshold)
+DirectInput::DirectInput(const int joypad_index[8], float threshold, bool use_raw_keyboard) :
+   ctx(nullptr), keyboard(nullptr), present(0),
+   axis_min(static_cast<LONG>(-32678 * threshold)),
+   axis_max(static_cast<LONG>(32677 * threshold)),
+   keyboard_buffered(false), last_edge_count(0),
+   middle(1), back(0), front(2), running(false),
+   slots_lock(new Mutex), slots_changed(false), enumerating(false),
+   rescan(new Event)
 {
-   std::fill(di_state, di_state + 256, 0);
    std::copy(joypad_index, joypad_index + 8, joypad_indices);
-   std::memset(joy_state, 0, sizeof(joy_state));
+   std::fill(joypad, joypad + 8, nullptr);
+   std::fill(joypad_buffered, joypad_buffered + 8, false);
+   std::memset(slots, 0, sizeof(slots));
+   std::memset(keys, 0, sizeof(keys));
+   std::memset(pads, 0, sizeof(pads));
+   std::fill(mapped, mapped + 8, false);
+   for (unsigned i = 0; i < 8; i++)
+   {
+      if (joypad_indices[i] >= 0 && joypad_indices[i] < 8)
+         mapped[joypad_indices[i]] = true;
+   }
+   std::memset(&work, 0, sizeof(work));
+   std::memset(buffers, 0, sizeof(buffers));
+   std::memset(last_key_presses, 0, sizeof(last_key_presses));
+   std::memset(last_button_presses, 0, sizeof(last_button_presses));
 
    if (FAILED(DirectInput8Create(
                GetModuleHandle(nullptr), DIRECTINPUT_VERSION, IID_IDirectInput8, 
@@ -139,16 +176,31 @@ DirectInput::DirectInput(const int joypad_index[8], float threshold) :
       throw std::runtime_error("Failed to init DInput8");
    }
 
-   if (FAILED(ctx->CreateDevice(GUID_SysKeyboard, &keyboard, nullptr)))
+   if (use_raw_keyboard)
    {
-      throw std::runtime_error("Failed to init input device");
+      try
+      {
+         raw_keyboard = std::unique_ptr<RawKeyboard>(new RawKeyboard);
+         std::cerr << "[DirectInput]: Reading keyboard through Raw Input." << std::endl;
+      }
+      catch (const std::exception &e)
+      {
+         std::cerr << "[DirectInput]: " << e.what() << ", using DirectInput." << std::endl;
+      }
    }
 
-   keyboard->SetDataFormat(&c_dfDIKeyboard);
-   keyboard->SetCooperativeLevel(D3DVideo::hwnd(), DISCL_NONEXCLUSIVE | DISCL_FOREGROUND);
-   keyboard->Acquire();
+   if (!raw_keyboard)
+   {
+      if (FAILED(ctx->CreateDevice(GUID_SysKeyboard, &keyboard, nullptr)))
+      {
+         throw std::runtime_error("Failed to init input device");
+      }
 
-   ctx->EnumDevices(DI8DEVCLASS_GAMECTRL, Callback::EnumJoypad, reinterpret_cast<void*>(this), DIEDFL_ATTACHEDONLY);
+      keyboard->SetDataFormat(&c_dfDIKeyboard);
+      keyboard->SetCooperativeLevel(D3DVideo::hwnd(), DISCL_NONEXCLUSIVE | DISCL_FOREGROUND);
+      keyboard_buffered = set_buffer_size(keyboard, BufferSize);
+      keyboard->Acquire();
+   }
 
    assert(SK_LAST < (sizeof(Map::sdl_to_di_lut) / sizeof(Map::sdl_to_di_lut[0])));
    assert(DIK_Z < (sizeof(Map::sdl_to_di_lut) / sizeof(Map::sdl_to_di_lut[0])));
@@ -156,43 +208,163 @@ DirectInput::DirectInput(const int joypad_index[8], float threshold) :
    // Set up direct LUT.
    for (unsigned i = 0; i < sizeof(Map::sdl_to_di) / sizeof(Map::sdl_to_di[0]); i++)
       Map::sdl_to_di_lut[Map::sdl_to_di[i].sdl] = Map::sdl_to_di[i].di;
+
+   const char *hz = std::getenv("RARCH_DINPUT_POLL_HZ");
+   unsigned rate = hz ? std::strtoul(hz, nullptr, 0) : 0;
+   if (rate)
+   {
+      unsigned interval_ms = std::max(1u, 1000 / rate);
+      std::cerr << "[DirectInput]: Polling on a thread every " << interval_ms << " ms." << std::endl;
+      running = true;
+      thread = std::unique_ptr<Thread>(new Thread([this, interval_ms]() { poll_thread(interval_ms); }));
+   }
+
+   const char *rescan_env = std::getenv("RARCH_DINPUT_RESCAN_MS");
+   DWORD rescan_ms = rescan_env ? std::strtoul(rescan_env, nullptr, 0) : 0;
+   if (!rescan_ms)
+      rescan_ms = INFINITE;
+
+   enumerating = true;
+   enum_thread = std::unique_ptr<Thread>(new Thread([this, rescan_ms]() { enum_thread_loop(rescan_ms); }));
+   D3DVideo::set_message_handler(WM_DEVICECHANGE, [this](WPARAM, LPARAM) { rescan->signal(); });
 }
 
-BOOL DirectInput::init_joypad(const DIDEVICEINSTANCE *instance)
+IDirectInputDevice8 *DirectInput::create_joypad(const GUID &guid, bool &buffered)
 {
    IDirectInputDevice8 *dev = nullptr;
-   if (FAILED(ctx->CreateDevice(instance->guidInstance, &dev, nullptr)))
+   if (FAILED(ctx->CreateDevice(guid, &dev, nullptr)))
+      return nullptr;
+
+   dev->SetDataFormat(&c_dfDIJoystick2);
+   dev->SetCooperativeLevel(D3DVideo::hwnd(), 
+         DISCL_NONEXCLUSIVE | DISCL_BACKGROUND);
+
+   dev->EnumObjects(Callback::EnumAxes, dev, DIDFT_ABSAXIS);
+   buffered = set_buffer_size(dev, BufferSize);
+   return dev;
+}
+
+// Runs on the enumeration thread, which is the only writer of slots.
+void DirectInput::enumerate()
+{
+   std::vector<DIDEVICEINSTANCE> attached;
+   ctx->EnumDevices(DI8DEVCLASS_GAMECTRL, Callback::EnumJoypad, &attached, DIEDFL_ATTACHEDONLY);
+
+   bool changed = false;
+   for (unsigned i = 0; i < 8; i++)
    {
-      joypad.push_back(nullptr);
-      return DIENUM_CONTINUE;
+      if (!slots[i].dev)
+         continue;
+
+      bool found = false;
+      for (size_t j = 0; j < attached.size() && !found; j++)
+         found = IsEqualGUID(attached[j].guidInstance, slots[i].guid);
+      if (found)
+         continue;
+
+      std::cerr << "[DirectInput]: Joypad #" << i << " removed." << std::endl;
+      Lock lock(*slots_lock);
+      retired.push_back(slots[i].dev);
+      slots[i].dev = nullptr;
+      changed = true;
+   }
+
+   for (size_t j = 0; j < attached.size(); j++)
+   {
+      unsigned free_slot = 8;
+      bool known = false;
+      for (unsigned i = 0; i < 8; i++)
+      {
+         if (!slots[i].dev)
+            free_slot = std::min(free_slot, i);
+         else if (IsEqualGUID(attached[j].guidInstance, slots[i].guid))
+            known = true;
+      }
+
+      if (known)
+         continue;
+      if (free_slot >= 8)
+         break;
+
+      bool buffered = false;
+      IDirectInputDevice8 *dev = create_joypad(attached[j].guidInstance, buffered);
+      if (!dev)
+         continue;
+
+      std::cerr << "[DirectInput]: Joypad #" << free_slot << " attached." << std::endl;
+      Lock lock(*slots_lock);
+      slots[free_slot].guid = attached[j].guidInstance;
+      slots[free_slot].dev = dev;
+      slots[free_slot].buffered = buffered;
+      changed = true;
    }
 
-   joypad.push_back(dev);
+   if (changed)
+      slots_changed = true;
+}
 
-   if (dev)
+void DirectInput::enum_thread_loop(DWORD rescan_ms)
+{
+   while (enumerating)
    {
-      dev->SetDataFormat(&c_dfDIJoystick2);
-      dev->SetCooperativeLevel(D3DVideo::hwnd(), 
-            DISCL_NONEXCLUSIVE | DISCL_BACKGROUND);
+      enumerate();
+      rescan->wait(rescan_ms);
+   }
+}
 
-      dev->EnumObjects(Callback::EnumAxes, dev, DIDFT_ABSAXIS);
+// Called by whichever thread reads the devices.
+void DirectInput::update_joypads()
+{
+   if (!slots_changed.exchange(false))
+      return;
+
+   std::vector<IDirectInputDevice8*> released;
+   {
+      Lock lock(*slots_lock);
+      for (unsigned i = 0; i < 8; i++)
+      {
+         if (joypad[i] == slots[i].dev)
+            continue;
+
+         joypad[i] = slots[i].dev;
+         joypad_buffered[i] = slots[i].buffered;
+         std::memset(&work.joy[i], 0, sizeof(work.joy[i]));
+      }
+      released.swap(retired);
+   }
+
+   for (size_t i = 0; i < released.size(); i++)
+   {
+      released[i]->Unacquire();
+      released[i]->Release();
    }
-   return (joypad.size() < static_cast<size_t>(8)) ? DIENUM_CONTINUE : DIENUM_STOP;
 }
 
 DirectInput::~DirectInput()
 {
+   D3DVideo::set_message_handler(WM_DEVICECHANGE, D3DVideo::MessageHandler());
+
+   running = false;
+   thread.reset();
+
+   enumerating = false;
+   rescan->signal();
+   enum_thread.reset();
+
    if (keyboard)
    {
       keyboard->Unacquire();
       keyboard->Release();
    }
 
-   for (size_t i = 0; i < joypad.size(); i++)
+   // Every device is either in a slot or waiting to be released.
+   for (unsigned i = 0; i < 8; i++)
    {
-      if (joypad[i])
-         joypad[i]->Release();
+      if (slots[i].dev)
+         slots[i].dev->Release();
    }
+   for (size_t i = 0; i < retired.size(); i++)
+      retired[i]->Release();
 
    if (ctx)
       ctx->Release();
@@ -201,158 +373,343 @@ DirectInput::~DirectInput()
 int DirectInput::state_analog(unsigned joyaxis, unsigned player_)
 {
    int player = joypad_indices[player_ - 1];
-   if (player < 0 || player >= static_cast<int>(joypad.size()) || !joypad[player])
+   if (player < 0 || player >= 8 || !(present & (1 << player)))
       return 0;
 
-   int val = 0;
-   int axis = -1;
-   bool is_neg = false;
-   bool is_pos = false;
+   const Pad &pad = pads[player];
+   unsigned axis = RARCH_AXIS_NEG_GET(joyaxis);
+   if (axis <= 5)
+      return std::min<LONG>(pad.axes[axis], 0);
 
-   if (RARCH_AXIS_NEG_GET(joyaxis) <= 5)
-   {
-      axis = RARCH_AXIS_NEG_GET(joyaxis);
-      is_neg = true;
-   }
-   else if (RARCH_AXIS_POS_GET(joyaxis) <= 5)
-   {
-      axis = RARCH_AXIS_POS_GET(joyaxis);
-      is_pos = true;
-   }
-
-   switch (axis)
-   {
-      case 0: val = joy_state[player].lX; break;
-      case 1: val = joy_state[player].lY; break;
-      case 2: val = joy_state[player].lZ; break;
-      case 3: val = joy_state[player].lRx; break;
-      case 4: val = joy_state[player].lRy; break;
-      case 5: val = joy_state[player].lRz; break;
-   }
-
-   if (is_neg && val > 0)
-      val = 0;
-   else if (is_pos && val < 0)
-      val = 0;
+   axis = RARCH_AXIS_POS_GET(joyaxis);
+   if (axis <= 5)
+      return std::max<LONG>(pad.axes[axis], 0);
 
-   return val;
+   return 0;
 }
 
 int DirectInput::state(const struct rarch_keybind* bind, unsigned player_)
 {
    if (bind->key > 0 && bind->key < 1024)
    {
-      int ret = di_state[Map::sdl_to_di_lut[bind->key]] & 0x80 ? 1 : 0;
-      if (ret)
-         return ret;
+      unsigned key = Map::sdl_to_di_lut[bind->key];
+      if (keys[key >> 5] & (1u << (key & 31)))
+         return 1;
    }
 
    int player = joypad_indices[player_ - 1];
 
-   if (player < 0 || player >= static_cast<int>(joypad.size()) || !joypad[player])
+   if (player < 0 || player >= 8 || !(present & (1 << player)))
       return 0;
 
+   const Pad &pad = pads[player];
+
    if (bind->joykey != RARCH_NO_BTN)
    {
-      if (!RARCH_GET_HAT_DIR(bind->joykey))
+      unsigned dir = RARCH_GET_HAT_DIR(bind->joykey) >> 12;
+      if (!dir)
       {
-         int ret = joy_state[player].rgbButtons[bind->joykey] ? 1 : 0;
-         if (ret)
-            return ret;
+         if (bind->joykey < 128 && (pad.buttons[bind->joykey >> 5] & (1u << (bind->joykey & 31))))
+            return 1;
       }
       else
       {
+         // Only a single direction per bind.
          unsigned hat = RARCH_GET_HAT(bind->joykey);
-         unsigned pov = joy_state[player].rgdwPOV[hat];
-         if (pov < 36000)
-         {
-            bool retval = false;
-            switch (RARCH_GET_HAT_DIR(bind->joykey))
-            {
-               case RARCH_HAT_UP_MASK:
-                  retval = (pov >= 31500) || (pov <= 4500);
-                  break;
-               case RARCH_HAT_RIGHT_MASK:
-                  retval = (pov >= 4500) && (pov <= 13500);
-                  break;
-               case RARCH_HAT_DOWN_MASK:
-                  retval = (pov >= 13500) && (pov <= 22500);
-                  break;
-               case RARCH_HAT_LEFT_MASK:
-                  retval = (pov >= 22500) && (pov <= 31500);
-                  break;
-            }
-
-            if (retval)
-               return true;
-         }
+         if (hat < 4 && !(dir & (dir - 1)) && (pad.directions & (dir << (hat * 4))))
+            return 1;
       }
    }
+
    if (bind->joyaxis != RARCH_NO_AXIS)
    {
-      int min = static_cast<int>(-32678 * thres);
-      int max = static_cast<int>(32677 * thres);
+      unsigned axis = RARCH_AXIS_NEG_GET(bind->joyaxis);
+      if (axis <= 5)
+         return (pad.directions >> (16 + axis)) & 1;
+
+      axis = RARCH_AXIS_POS_GET(bind->joyaxis);
+      if (axis <= 5)
+         return (pad.directions >> (24 + axis)) & 1;
+   }
+
+   return 0; // Nothing is pressed :)
+}
+
+void DirectInput::add_edge(int device, DWORD offset, DWORD timestamp, bool pressed)
+{
+   Edge edge = { device, offset, timestamp, work.timestamp, pressed };
+   work.edges[work.edge_count++ & EdgeHistoryMask] = edge;
+}
 
-      switch (RARCH_AXIS_NEG_GET(bind->joyaxis))
+void DirectInput::read_raw_keyboard()
+{
+   std::vector<RawKeyboard::KeyEvent> events;
+   raw_keyboard->read(work.keys, work.key_presses, events);
+   for (size_t i = 0; i < events.size(); i++)
+      add_edge(-1, events[i].key, events[i].timestamp, events[i].pressed);
+}
+
+void DirectInput::read_keyboard()
+{
+   if (raw_keyboard)
+   {
+      read_raw_keyboard();
+      return;
+   }
+
+   uint8_t *keys = work.keys;
+
+   if (!keyboard_buffered)
+   {
+      if (FAILED(keyboard->GetDeviceState(sizeof(work.keys), keys)))
       {
-         case 0:
-            return joy_state[player].lX <= min;
-         case 1:
-            return joy_state[player].lY <= min;
-         case 2:
-            return joy_state[player].lZ <= min;
-         case 3:
-            return joy_state[player].lRx <= min;
-         case 4:
-            return joy_state[player].lRy <= min;
-         case 5:
-            return joy_state[player].lRz <= min;
+         keyboard->Acquire();
+         if (FAILED(keyboard->GetDeviceState(sizeof(work.keys), keys)))
+            ZeroMemory(keys, sizeof(work.keys));
+      }
+      return;
+   }
+
+   bool resync = false;
+
+   for (;;)
+   {
+      DIDEVICEOBJECTDATA data[BufferSize];
+      DWORD count = BufferSize;
+      HRESULT ret = keyboard->GetDeviceData(sizeof(data[0]), data, &count, 0);
+      if (FAILED(ret))
+      {
+         keyboard->Acquire();
+         resync = true;
+         break;
+      }
+
+      for (DWORD i = 0; i < count; i++)
+      {
+         uint8_t key = data[i].dwOfs & 0xff;
+         keys[key] = data[i].dwData & 0x80;
+         if (keys[key])
+            work.key_presses[key]++;
+
+         add_edge(-1, key, data[i].dwTimeStamp, keys[key] != 0);
       }
 
-      switch (RARCH_AXIS_POS_GET(bind->joyaxis))
+      // Events were lost, the snapshot below is all we can trust.
+      if (ret == DI_BUFFEROVERFLOW)
       {
-         case 0:
-            return joy_state[player].lX >= max;
-         case 1:
-            return joy_state[player].lY >= max;
-         case 2:
-            return joy_state[player].lZ >= max;
-         case 3:
-            return joy_state[player].lRx >= max;
-         case 4:
-            return joy_state[player].lRy >= max;
-         case 5:
-            return joy_state[player].lRz >= max;
+         resync = true;
+         break;
       }
+
+      if (count < BufferSize)
+         break;
    }
 
-   return 0; // Nothing is pressed :)
+   if (resync && FAILED(keyboard->GetDeviceState(sizeof(work.keys), keys)))
+      ZeroMemory(keys, sizeof(work.keys));
 }
 
-void DirectInput::poll()
+void DirectInput::read_joypad(unsigned index)
 {
-   std::fill(di_state, di_state + 256, 0);
-   if (FAILED(keyboard->GetDeviceState(sizeof(di_state), di_state)))
+   IDirectInputDevice8 *pad = joypad[index];
+   DIJOYSTATE2 &current = work.joy[index];
+
+   if (FAILED(pad->Poll()))
    {
-      keyboard->Acquire();
-      if (FAILED(keyboard->GetDeviceState(sizeof(di_state), di_state)))
-         ZeroMemory(di_state, sizeof(di_state));
+      // Events from while we weren't acquired are gone, start over from a snapshot.
+      if (!SUCCEEDED(pad->Acquire()) || !joypad_buffered[index] ||
+            FAILED(pad->GetDeviceState(sizeof(DIJOYSTATE2), &current)))
+         std::memset(&current, 0, sizeof(current));
+      return;
    }
 
-   ZeroMemory(&joy_state, sizeof(joy_state));
+   if (!joypad_buffered[index])
+   {
+      if (FAILED(pad->GetDeviceState(sizeof(DIJOYSTATE2), &current)))
+         std::memset(&current, 0, sizeof(current));
+      return;
+   }
+
+   uint8_t *fields = reinterpret_cast<uint8_t*>(&current);
+   bool resync = false;
 
-   size_t size = std::min(static_cast<size_t>(8), joypad.size());
-   for (size_t i = 0; i < size; i++)
+   for (;;)
    {
-      if (joypad[i])
+      DIDEVICEOBJECTDATA data[BufferSize];
+      DWORD count = BufferSize;
+      HRESULT ret = pad->GetDeviceData(sizeof(data[0]), data, &count, 0);
+      if (FAILED(ret))
       {
-         if (FAILED(joypad[i]->Poll()))
+         resync = true;
+         break;
+      }
+
+      // Offsets are into DIJOYSTATE2, as set up by c_dfDIJoystick2.
+      for (DWORD i = 0; i < count; i++)
+      {
+         DWORD ofs = data[i].dwOfs;
+         if (ofs >= DIJOFS_BUTTON0 && ofs <= DIJOFS_BUTTON127)
          {
-            joypad[i]->Acquire();
-            continue;
+            uint8_t state = data[i].dwData & 0x80;
+            current.rgbButtons[ofs - DIJOFS_BUTTON0] = state;
+            if (state)
+               work.button_presses[index][ofs - DIJOFS_BUTTON0]++;
+
+            add_edge(index, ofs, data[i].dwTimeStamp, state != 0);
          }
+         else if (ofs + sizeof(DWORD) <= sizeof(current) && !(ofs & 3))
+            std::memcpy(fields + ofs, &data[i].dwData, sizeof(DWORD));
+      }
+
+      if (ret == DI_BUFFEROVERFLOW)
+      {
+         resync = true;
+         break;
+      }
+
+      if (count < BufferSize)
+         break;
+   }
+
+   if (resync && FAILED(pad->GetDeviceState(sizeof(DIJOYSTATE2), &current)))
+      std::memset(&current, 0, sizeof(current));
+}
+
+void DirectInput::read_devices()
+{
+   update_joypads();
+   if (Latency::enabled())
+      work.timestamp = Latency::now();
+   read_keyboard();
+
+   work.present = 0;
+   for (unsigned i = 0; i < 8; i++)
+   {
+      if (!joypad[i])
+         continue;
+
+      work.present |= 1 << i;
+      if (mapped[i])
+         read_joypad(i);
+   }
+}
+
+void DirectInput::latch_pad(unsigned index, const DIJOYSTATE2 &joy, const uint8_t *presses)
+{
+   Pad &pad = pads[index];
+
+   std::memset(pad.buttons, 0, sizeof(pad.buttons));
+   for (unsigned i = 0; i < 128; i++)
+   {
+      if (joy.rgbButtons[i] || presses[i] != last_button_presses[index][i])
+         pad.buttons[i >> 5] |= 1u << (i & 31);
+      last_button_presses[index][i] = presses[i];
+   }
+
+   uint32_t directions = 0;
+   for (unsigned hat = 0; hat < 4; hat++)
+   {
+      unsigned pov = joy.rgdwPOV[hat];
+      if (pov >= 36000)
+         continue;
+
+      uint32_t bits = 0;
+      if (pov >= 31500 || pov <= 4500)
+         bits |= RARCH_HAT_UP_MASK >> 12;
+      if (pov >= 4500 && pov <= 13500)
+         bits |= RARCH_HAT_RIGHT_MASK >> 12;
+      if (pov >= 13500 && pov <= 22500)
+         bits |= RARCH_HAT_DOWN_MASK >> 12;
+      if (pov >= 22500 && pov <= 31500)
+         bits |= RARCH_HAT_LEFT_MASK >> 12;
+      directions |= bits << (hat * 4);
+   }
+
+   pad.axes[0] = joy.lX;
+   pad.axes[1] = joy.lY;
+   pad.axes[2] = joy.lZ;
+   pad.axes[3] = joy.lRx;
+   pad.axes[4] = joy.lRy;
+   pad.axes[5] = joy.lRz;
+   for (unsigned i = 0; i < 6; i++)
+   {
+      if (pad.axes[i] <= axis_min)
+         directions |= 1u << (16 + i);
+      if (pad.axes[i] >= axis_max)
+         directions |= 1u << (24 + i);
+   }
+
+   pad.directions = directions;
+}
+
+// Turns a snapshot into the state queried by the core,
+// latching everything which was pressed since the last call.
+void DirectInput::latch(const Snapshot &snap)
+{
+   std::memset(keys, 0, sizeof(keys));
+   for (unsigned i = 0; i < 256; i++)
+   {
+      if ((snap.keys[i] & 0x80) || snap.key_presses[i] != last_key_presses[i])
+         keys[i >> 5] |= 1u << (i & 31);
+      last_key_presses[i] = snap.key_presses[i];
+   }
+
+   present = snap.present;
+   for (unsigned p = 0; p < 8; p++)
+   {
+      if ((present & (1 << p)) && mapped[p])
+         latch_pad(p, snap.joy[p], snap.button_presses[p]);
+   }
+
+   edge_list.clear();
+   uint32_t first = last_edge_count;
+   if (snap.edge_count - first > EdgeHistory)
+      first = snap.edge_count - EdgeHistory;
+   for (uint32_t i = first; i != snap.edge_count; i++)
+      edge_list.push_back(snap.edges[i & EdgeHistoryMask]);
+   last_edge_count = snap.edge_count;
 
-         joypad[i]->GetDeviceState(sizeof(DIJOYSTATE2), &joy_state[i]);
+   if (Latency::enabled())
+   {
+      Latency::input_polled(snap.timestamp);
+      for (size_t i = 0; i < edge_list.size(); i++)
+      {
+         if (edge_list[i].pressed)
+            Latency::input_edge(edge_list[i].device, edge_list[i].offset, edge_list[i].time);
       }
    }
 }
+
+void DirectInput::poll_thread(unsigned interval_ms)
+{
+   timeBeginPeriod(1);
+
+   while (running)
+   {
+      read_devices();
+
+      buffers[back] = work;
+      back = middle.exchange(back | Fresh) & ~Fresh;
+
+      Sleep(interval_ms);
+   }
+
+   timeEndPeriod(1);
+}
+
+void DirectInput::poll()
+{
+   Trace::Scope trace("Input poll");
+
+   if (!thread)
+   {
+      read_devices();
+      latch(work);
+      return;
+   }
+
+   // Grab the newest snapshot, if there is one we haven't seen.
+   if (middle.load() & Fresh)
+      front = middle.exchange(front) & ~Fresh;
+   latch(buffers[front]);
+}
@@ -4,28 +4,135 @@
 #include <stdint.h>
 #include <dinput.h>
 #include <vector>
+#include <atomic>
+#include <memory>
+
+class Thread;
+class Mutex;
+class Event;
+class RawKeyboard;
 
 class DirectInput
 {
    public:
-      DirectInput(const int joypad_index[8], float axis_thres);
+      // If raw_keyboard is set, the keyboard is read through Raw Input
+      // (see raw_keyboard.hpp), falling back to DirectInput if that fails.
+      DirectInput(const int joypad_index[8], float axis_thres, bool raw_keyboard);
       ~DirectInput();
       int state(const struct rarch_keybind* bind, unsigned player);
       int state_analog(unsigned joyaxis, unsigned player);
       void poll();
 
-      BOOL init_joypad(const DIDEVICEINSTANCE *instance);
+      // Button and key edges seen by the last poll() on buffered devices,
+      // in the order they happened.
+      struct Edge
+      {
+         int device; // -1 for the keyboard, joypad index otherwise.
+         DWORD offset; // DIK_* or DIJOFS_BUTTON(n).
+         DWORD timestamp; // GetTickCount() time base.
+         int64_t time; // Latency::now() when it was read, if enabled.
+         bool pressed;
+      };
+      const std::vector<Edge> &edges() const { return edge_list; }
 
    private:
-      uint8_t di_state[256];
       IDirectInput8 *ctx;
       IDirectInputDevice8 *keyboard;
+      std::unique_ptr<RawKeyboard> raw_keyboard;
 
       int joypad_indices[8];
-      DIJOYSTATE2 joy_state[8];
+      IDirectInputDevice8 *joypad[8];
+      bool joypad_buffered[8];
+      // Joypads with a device, as of poll() time.
+      uint8_t present;
+
+      // State at poll() time, packed so that every state() query
+      // is a single bit test.
+      // directions holds, from the LSB, a nibble per hat (right, left, down, up),
+      // then a byte of axes past the negative threshold
+      // and a byte of axes past the positive one.
+      struct Pad
+      {
+         uint32_t buttons[4];
+         uint32_t directions;
+         LONG axes[6];
+      };
+      uint32_t keys[8];
+      Pad pads[8];
+      // Whether a player is bound to the joypad, only these are read.
+      bool mapped[8];
+      LONG axis_min, axis_max;
+      void latch_pad(unsigned index, const DIJOYSTATE2 &joy, const uint8_t *presses);
+
+      // Devices which support it are read through their event buffer,
+      // so presses shorter than a poll interval aren't lost.
+      // keys and pads hold the state at poll() time,
+      // with every button which went down since the previous poll latched.
+      enum { BufferSize = 64 };
+      bool keyboard_buffered;
+      std::vector<Edge> edge_list;
+
+      // Device state as of the last read, with running press counts,
+      // so a reader can tell which buttons went down in between
+      // no matter how many reads happened since it last looked.
+      enum { EdgeHistory = 128, EdgeHistoryMask = EdgeHistory - 1 };
+      struct Snapshot
+      {
+         uint8_t keys[256];
+         uint8_t key_presses[256];
+         DIJOYSTATE2 joy[8];
+         uint8_t button_presses[8][128];
+         uint8_t present;
+         int64_t timestamp; // Latency::now() at read, if enabled.
+         Edge edges[EdgeHistory];
+         uint32_t edge_count;
+      };
+      Snapshot work;
+
+      uint8_t last_key_presses[256];
+      uint8_t last_button_presses[8][128];
+      uint32_t last_edge_count;
+
+      void read_devices();
+      void read_keyboard();
+      void read_raw_keyboard();
+      void read_joypad(unsigned index);
+      void add_edge(int device, DWORD offset, DWORD timestamp, bool pressed);
+      void latch(const Snapshot &snap);
 
-      std::vector<IDirectInputDevice8*> joypad;
+      // Optional input thread, enabled with RARCH_DINPUT_POLL_HZ.
+      // It reads the devices at a fixed rate and publishes snapshots
+      // through a triple buffer, so poll() never waits on DirectInput.
+      enum { Fresh = 4 };
+      Snapshot buffers[3];
+      std::atomic<unsigned> middle;
+      unsigned back, front;
+      std::atomic<bool> running;
+      std::unique_ptr<Thread> thread;
+      void poll_thread(unsigned interval_ms);
 
-      float thres;
+      // Joypads are enumerated on a thread of their own, at startup
+      // and whenever the window sees WM_DEVICECHANGE
+      // (or every RARCH_DINPUT_RESCAN_MS milliseconds),
+      // so a slow USB stack doesn't hold up startup and pads can come and go.
+      // A pad keeps its slot for as long as it's attached.
+      // read_devices() picks changes up from slots and releases retired devices.
+      struct Slot
+      {
+         GUID guid;
+         IDirectInputDevice8 *dev;
+         bool buffered;
+      };
+      Slot slots[8];
+      std::vector<IDirectInputDevice8*> retired;
+      std::unique_ptr<Mutex> slots_lock;
+      std::atomic<bool> slots_changed;
+      std::atomic<bool> enumerating;
+      std::unique_ptr<Event> rescan;
+      std::unique_ptr<Thread> enum_thread;
+      void enum_thread_loop(DWORD rescan_ms);
+      void enumerate();
+      IDirectInputDevice8 *create_joypad(const GUID &guid, bool &buffered);
+      void update_joypads();
 };
 
@@ -0,0 +1,154 @@
+#include "chain_plan.hpp"
+
+namespace ChainPlan
+{
+   unsigned next_pot(unsigned v)
+   {
+      v--;
+      v |= v >> 1;
+      v |= v >> 2;
+      v |= v >> 4;
+      v |= v >> 8;
+      v |= v >> 16;
+      v++;
+      return v;
+   }
+
+   void convert_geometry(const LinkInfo &info,
+         unsigned &out_width, unsigned &out_height,
+         unsigned width, unsigned height,
+         unsigned vp_width, unsigned vp_height)
+   {
+      switch (info.scale_type_x)
+      {
+         case LinkInfo::Viewport:
+            out_width = info.scale_x * vp_width;
+            break;
+
+         case LinkInfo::Absolute:
+            out_width = info.abs_x;
+            break;
+
+         case LinkInfo::Relative:
+            out_width = info.scale_x * width;
+            break;
+      }
+
+      switch (info.scale_type_y)
+      {
+         case LinkInfo::Viewport:
+            out_height = info.scale_y * vp_height;
+            break;
+
+         case LinkInfo::Absolute:
+            out_height = info.abs_y;
+            break;
+
+         case LinkInfo::Relative:
+            out_height = info.scale_y * height;
+            break;
+      }
+   }
+
+   static LinkInfo::ScaleType link_scale_type(ShaderPreset::ScaleType type)
+   {
+      switch (type)
+      {
+         case ShaderPreset::Viewport:
+            return LinkInfo::Viewport;
+         case ShaderPreset::Absolute:
+            return LinkInfo::Absolute;
+         default:
+            return LinkInfo::Relative;
+      }
+   }
+
+   std::vector<LinkInfo> plan(const ShaderPreset &preset,
+         unsigned input_scale, bool smooth,
+         unsigned vp_width, unsigned vp_height)
+   {
+      const std::vector<ShaderPreset::Pass> &passes = preset.passes;
+      int shaders = passes.size();
+
+      bool use_extra_pass = false;
+      bool use_first_pass_only = false;
+
+      std::vector<LinkInfo> links;
+      for (int i = 0; i < shaders; i++)
+      {
+         const ShaderPreset::Pass &pass = passes[i];
+
+         LinkInfo link = {0};
+         link.shader_path = pass.shader;
+         link.scale_type_x = link_scale_type(pass.type_x);
+         link.scale_type_y = link_scale_type(pass.type_y);
+         link.scale_x = pass.scale_x;
+         link.scale_y = pass.scale_y;
+         link.abs_x = pass.abs_x ? pass.abs_x : input_size(input_scale);
+         link.abs_y = pass.abs_y ? pass.abs_y : input_size(input_scale);
+         link.filter_linear = pass.filter_linear == ShaderPreset::Default ?
+            smooth : pass.filter_linear == ShaderPreset::Enabled;
+         links.push_back(link);
+
+         if (pass.has_scale && i == shaders - 1)
+            use_extra_pass = true;
+         else if (!pass.has_scale && i == 0)
+            use_first_pass_only = true;
+         else if (i > 0)
+            use_first_pass_only = false;
+      }
+
+      // Setup information for first pass.
+      LinkInfo &first = links[0];
+      if (use_first_pass_only)
+      {
+         first.scale_x = first.scale_y = 1.0f;
+         first.scale_type_x = first.scale_type_y = LinkInfo::Viewport;
+      }
+      first.tex_w = first.tex_h = input_size(input_scale);
+
+      unsigned current_width = first.tex_w;
+      unsigned current_height = first.tex_h;
+      unsigned out_width = 0;
+      unsigned out_height = 0;
+
+      for (int i = 1; i < shaders; i++)
+      {
+         convert_geometry(links[i - 1],
+               out_width, out_height,
+               current_width, current_height, vp_width, vp_height);
+
+         LinkInfo &link = links[i];
+         link.tex_w = next_pot(out_width);
+         link.tex_h = next_pot(out_height);
+
+         current_width = out_width;
+         current_height = out_height;
+
+         if (i == shaders - 1 && !use_extra_pass)
+         {
+            link.scale_x = link.scale_y = 1.0f;
+            link.scale_type_x = link.scale_type_y = LinkInfo::Viewport;
+         }
+      }
+
+      if (use_extra_pass)
+      {
+         LinkInfo link = links.back();
+         convert_geometry(link,
+               out_width, out_height,
+               current_width, current_height, vp_width, vp_height);
+
+         link.scale_x = link.scale_y = 1.0f;
+         link.scale_type_x = link.scale_type_y = LinkInfo::Viewport;
+         link.filter_linear = smooth;
+         link.tex_w = next_pot(out_width);
+         link.tex_h = next_pot(out_height);
+         link.shader_path = "";
+         links.push_back(link);
+      }
+
+      return links;
+   }
+}
+
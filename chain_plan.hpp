@@ -0,0 +1,52 @@
+#ifndef CHAIN_PLAN_HPP__
+#define CHAIN_PLAN_HPP__
+
+#include "shader_preset.hpp"
+#include <string>
+#include <vector>
+
+struct LinkInfo
+{
+   enum ScaleType { Relative, Absolute, Viewport };
+
+   unsigned tex_w, tex_h;
+   
+   float scale_x, scale_y;
+   unsigned abs_x, abs_y;
+   bool filter_linear;
+   ScaleType scale_type_x, scale_type_y;
+
+   std::string shader_path;
+};
+
+// How a preset maps onto render chain passes and textures.
+//
+// RenderChain builds exactly what plan() returns, so this is also what
+// tools/preset_planner reports. Doesn't depend on Direct3D or Windows.
+namespace ChainPlan
+{
+   // Frames of input kept around for PREV textures, including the current one.
+   enum { HistoryTextures = 8 };
+
+   // Input textures are sized for the largest frame a core may send.
+   inline unsigned input_size(unsigned input_scale) { return 256 * input_scale; }
+
+   unsigned next_pot(unsigned v);
+
+   // Size a pass renders at, given the size of its input.
+   void convert_geometry(const LinkInfo &info,
+         unsigned &out_width, unsigned &out_height,
+         unsigned width, unsigned height,
+         unsigned vp_width, unsigned vp_height);
+
+   // One link per pass, in order, with texture sizes filled in.
+   // The first link describes the input texture. If the last pass of the
+   // preset has an explicit scale, a stock pass is appended (empty
+   // shader_path) to bring its output to the viewport.
+   std::vector<LinkInfo> plan(const ShaderPreset &preset,
+         unsigned input_scale, bool smooth,
+         unsigned vp_width, unsigned vp_height);
+}
+
+#endif
+
@@ -40,13 +40,37 @@
 #endif
 
 #define MAX_INCLUDE_DEPTH 16
+#define ENTRY_BLOCK_SIZE 64
+#define MIN_INDEX_SIZE 16
 
 struct entry_list
 {
    bool readonly; // If we got this from an #include, do not allow write.
+   // Parsed keys and values point into a data_block,
+   // only strings from config_set_* are allocated.
+   bool owns_key;
+   bool owns_value;
    char *key;
    char *value;
    struct entry_list *next;
+
+   uint32_t hash;
+   struct entry_list *dup; // Next entry with the same key, in list order.
+};
+
+// Entries are allocated from blocks, and freed all at once.
+struct entry_block
+{
+   struct entry_block *next;
+   size_t used;
+   struct entry_list entries[ENTRY_BLOCK_SIZE];
+};
+
+// Contents of a loaded file, tokenized in place.
+struct data_block
+{
+   struct data_block *next;
+   char data[];
 };
 
 struct include_list
@@ -63,32 +87,217 @@ struct config_file
    unsigned include_depth;
 
    struct include_list *includes;
+
+   struct entry_block *blocks;
+   struct data_block *data;
+
+   // Open addressing hash of the first entry for every key,
+   // later entries with the same key hang off its dup chain.
+   struct entry_list **index;
+   size_t index_size; // Power of two, or 0.
+   size_t index_count;
 };
 
 static config_file_t *config_file_new_internal(const char *path, unsigned depth);
 
-static char *getaline(FILE *file)
+// FNV-1a
+static uint32_t hash_key(const char *key)
 {
-   char *newline = malloc(9);
-   size_t cur_size = 8;
-   size_t index = 0;
+   uint32_t hash = 2166136261u;
+   while (*key)
+   {
+      hash ^= (uint8_t)*key++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+static struct entry_list *alloc_entry(config_file_t *conf)
+{
+   struct entry_block *block = conf->blocks;
+   if (!block || block->used == ENTRY_BLOCK_SIZE)
+   {
+      block = calloc(1, sizeof(*block));
+      if (!block)
+         return NULL;
+
+      block->next = conf->blocks;
+      conf->blocks = block;
+   }
+
+   return &block->entries[block->used++];
+}
 
-   int in = getc(file);
-   while (in != EOF && in != '\n')
+// Hands the entry and data blocks of child over to parent.
+static void move_blocks(config_file_t *parent, config_file_t *child)
+{
+   struct entry_block *last = child->blocks;
+   if (last)
    {
-      if (index == cur_size)
+      while (last->next)
+         last = last->next;
+
+      // Keep the parent's partially used block first.
+      if (parent->blocks)
       {
-         cur_size *= 2;
-         newline = realloc(newline, cur_size + 1);
+         last->next = parent->blocks->next;
+         parent->blocks->next = child->blocks;
       }
+      else
+         parent->blocks = child->blocks;
 
-      newline[index++] = in;
-      in = getc(file);
+      child->blocks = NULL;
    }
-   newline[index] = '\0';
-   return newline; 
+
+   struct data_block *data = child->data;
+   if (!data)
+      return;
+
+   while (data->next)
+      data = data->next;
+   data->next = parent->data;
+   parent->data = child->data;
+   child->data = NULL;
 }
 
+static struct entry_list *index_find(config_file_t *conf, const char *key, uint32_t hash)
+{
+   if (!conf->index_size)
+      return NULL;
+
+   size_t mask = conf->index_size - 1;
+   for (size_t i = hash & mask; conf->index[i]; i = (i + 1) & mask)
+   {
+      struct entry_list *entry = conf->index[i];
+      if (entry->hash == hash && strcmp(entry->key, key) == 0)
+         return entry;
+   }
+
+   return NULL;
+}
+
+static void index_place(struct entry_list **index, size_t size, struct entry_list *entry)
+{
+   size_t mask = size - 1;
+   size_t i = entry->hash & mask;
+   while (index[i])
+      i = (i + 1) & mask;
+   index[i] = entry;
+}
+
+static bool index_grow(config_file_t *conf)
+{
+   size_t size = conf->index_size ? conf->index_size * 2 : MIN_INDEX_SIZE;
+   struct entry_list **index = calloc(size, sizeof(*index));
+   if (!index)
+      return false;
+
+   for (size_t i = 0; i < conf->index_size; i++)
+   {
+      if (conf->index[i])
+         index_place(index, size, conf->index[i]);
+   }
+
+   free(conf->index);
+   conf->index = index;
+   conf->index_size = size;
+   return true;
+}
+
+// Makes room in the index for count more keys. Entries are only linked
+// into the list once this succeeded, so index_add() can't fail and the
+// getters see every entry the list has.
+static bool index_reserve(config_file_t *conf, size_t count)
+{
+   // Keep load below 3/4.
+   while ((conf->index_count + count) * 4 > conf->index_size * 3)
+   {
+      if (!index_grow(conf))
+         return false;
+   }
+   return true;
+}
+
+// Entries must be added in list order, so the first one for a key
+// is what the getters see.
+static void index_add(config_file_t *conf, struct entry_list *entry)
+{
+   entry->hash = hash_key(entry->key);
+   entry->dup = NULL;
+
+   struct entry_list *head = index_find(conf, entry->key, entry->hash);
+   if (head)
+   {
+      while (head->dup)
+         head = head->dup;
+      head->dup = entry;
+      return;
+   }
+
+   index_place(conf->index, conf->index_size, entry);
+   conf->index_count++;
+}
+
+static struct entry_list *find_entry(config_file_t *conf, const char *key)
+{
+   return index_find(conf, key, hash_key(key));
+}
+
+// Reads all of file. Text mode, so line endings come out
+// exactly like they would through getc().
+static struct data_block *read_data(FILE *file, size_t *len)
+{
+   size_t cap = 4096;
+   if (fseek(file, 0, SEEK_END) == 0)
+   {
+      // One byte of room past the end, so a short read tells us we hit EOF
+      // without growing the buffer and calling fread() again.
+      long size = ftell(file);
+      if (size > 0)
+         cap = (size_t)size + 1;
+      rewind(file);
+   }
+
+   struct data_block *block = malloc(sizeof(*block) + cap + 1);
+   if (!block)
+      return NULL;
+
+   size_t size = 0;
+   for (;;)
+   {
+      size += fread(block->data + size, 1, cap - size, file);
+      if (size < cap)
+         break;
+
+      cap *= 2;
+      struct data_block *new_block = realloc(block, sizeof(*block) + cap + 1);
+      if (!new_block)
+      {
+         free(block);
+         return NULL;
+      }
+      block = new_block;
+   }
+
+   block->next = NULL;
+   block->data[size] = '\0';
+   *len = size;
+   return block;
+}
+
+// Same as a first strtok() call, without hidden state.
+static char *next_token(char *str, const char *delim)
+{
+   str += strspn(str, delim);
+   if (*str == '\0')
+      return NULL;
+
+   char *end = str + strcspn(str, delim);
+   *end = '\0';
+   return str;
+}
+
+// Tokenizes in place, the returned string points into line.
 static char* extract_value(char *line, bool is_value)
 {
    if (is_value)
@@ -98,7 +307,7 @@ static char* extract_value(char *line, bool is_value)
 
       // If we don't have an equal sign here, we've got an invalid string...
       if (*line != '=')
-         return false;
+         return NULL;
 
       line++;
    }
@@ -108,23 +317,11 @@ static char* extract_value(char *line, bool is_value)
 
    // We have a full string. Read until next ".
    if (*line == '"')
-   {
-      line++;
-      char *tok = strtok(line, "\"");
-      if (!tok)
-         return false;
-      return strdup(tok);
-   }
+      return next_token(line + 1, "\"");
    else if (*line == '\0') // Nothing :(
       return NULL;
    else // We don't have that... Read till next space.
-   {
-      char *tok = strtok(line, " \n\t\f\r\v");
-      if (tok)
-         return strdup(tok);
-      else
-         return NULL;
-   }
+      return next_token(line, " \n\t\f\r\v");
 }
 
 static void set_list_readonly(struct entry_list *list)
@@ -139,33 +336,26 @@ static void set_list_readonly(struct entry_list *list)
 // Move semantics? :)
 static void add_child_list(config_file_t *parent, config_file_t *child)
 {
-   if (parent->entries)
-   {
-      struct entry_list *head = parent->entries;
-      while (head->next)
-         head = head->next;
+   // Without room for its keys, the include is dropped as a whole.
+   if (!index_reserve(parent, child->index_count))
+      return;
 
-      set_list_readonly(child->entries);
-      head->next = child->entries;
-   }
+   set_list_readonly(child->entries);
+
+   if (parent->entries)
+      parent->tail->next = child->entries;
    else
-   {
-      set_list_readonly(child->entries);
       parent->entries = child->entries;
-   }
 
-   child->entries = NULL;
-
-   // Rebase tail.
-   if (parent->entries)
+   for (struct entry_list *list = child->entries; list; list = list->next)
    {
-      struct entry_list *head = parent->entries;
-      while (head->next)
-         head = head->next;
-      parent->tail = head;
+      index_add(parent, list);
+      parent->tail = list;
    }
-   else
-      parent->tail = NULL;
+
+   move_blocks(parent, child);
+   child->entries = NULL;
+   child->tail = NULL;
 }
 
 static void add_include_list(config_file_t *conf, const char *path)
@@ -241,15 +431,11 @@ static void add_sub_conf(config_file_t *conf, char *line)
 
    config_file_t *sub_conf = config_file_new_internal(real_path, conf->include_depth + 1);
    if (!sub_conf)
-   {
-      free(path);
       return;
-   }
 
    // Pilfer internal list! :D
    add_child_list(conf, sub_conf);
    config_file_free(sub_conf);
-   free(path);
 }
 
 static bool parse_line(config_file_t *conf, struct entry_list *list, char *line)
@@ -276,31 +462,18 @@ static bool parse_line(config_file_t *conf, struct entry_list *list, char *line)
    while (isspace(*line))
       line++;
 
-   char *key = malloc(9);
-   size_t cur_size = 8;
-   size_t index = 0;
-
+   char *key = line;
    while (isgraph(*line))
-   {
-      if (index == cur_size)
-      {
-         cur_size *= 2;
-         key = realloc(key, cur_size + 1);
-      }
-
-      key[index++] = *line++;
-   }
-   key[index] = '\0';
-   list->key = key;
+      line++;
+   char *key_end = line;
 
    list->value = extract_value(line, true);
    if (!list->value)
-   {
-      list->key = NULL;
-      free(key);
       return false;
-   }
 
+   // Terminated last, as the value is parsed from what follows the key.
+   *key_end = '\0';
+   list->key = key;
    return true;
 }
 
@@ -330,34 +503,47 @@ static config_file_t *config_file_new_internal(const char *path, unsigned depth)
       return NULL;
    }
 
-   while (!feof(file))
+   size_t len = 0;
+   struct data_block *data = read_data(file, &len);
+   fclose(file);
+   if (!data)
    {
-      struct entry_list *list = calloc(1, sizeof(*list));
-      char *line = getaline(file);
+      free(conf->path);
+      free(conf);
+      return NULL;
+   }
+   conf->data = data;
 
-      if (line)
+   // A file has one line more than it has newlines,
+   // the last one possibly empty.
+   char *line = data->data;
+   char *end = data->data + len;
+   for (;;)
+   {
+      char *newline = memchr(line, '\n', end - line);
+      if (newline)
+         *newline = '\0';
+
+      struct entry_list list = {0};
+      if (parse_line(conf, &list, line))
       {
-         if (parse_line(conf, list, line))
+         struct entry_list *entry = index_reserve(conf, 1) ? alloc_entry(conf) : NULL;
+         if (entry)
          {
+            *entry = list;
             if (conf->entries)
-            {
-               conf->tail->next = list;
-               conf->tail = list;
-            }
+               conf->tail->next = entry;
             else
-            {
-               conf->entries = list;
-               conf->tail = list;
-            }
+               conf->entries = entry;
+            conf->tail = entry;
+            index_add(conf, entry);
          }
-
-         free(line);
       }
 
-      if (list != conf->tail)
-         free(list);
+      if (!newline)
+         break;
+      line = newline + 1;
    }
-   fclose(file);
 
    return conf;
 }
@@ -375,13 +561,31 @@ void config_file_free(config_file_t *conf)
    struct entry_list *tmp = conf->entries;
    while (tmp)
    {
-      free(tmp->key);
-      free(tmp->value);
-      struct entry_list *hold = tmp;
+      if (tmp->owns_key)
+         free(tmp->key);
+      if (tmp->owns_value)
+         free(tmp->value);
       tmp = tmp->next;
+   }
+
+   struct data_block *data = conf->data;
+   while (data)
+   {
+      struct data_block *hold = data;
+      data = data->next;
       free(hold);
    }
 
+   struct entry_block *block = conf->blocks;
+   while (block)
+   {
+      struct entry_block *hold = block;
+      block = block->next;
+      free(hold);
+   }
+
+   free(conf->index);
+
    struct include_list *inc_tmp = conf->includes;
    while (inc_tmp)
    {
@@ -397,167 +601,129 @@ void config_file_free(config_file_t *conf)
 
 bool config_get_double(config_file_t *conf, const char *key, double *in)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
-   {
-      if (strcmp(key, list->key) == 0)
-      {
-         *in = strtod(list->value, NULL);
-         return true;
-      }
-      list = list->next;
-   }
-   return false;
+   *in = strtod(list->value, NULL);
+   return true;
 }
 
 bool config_get_int(config_file_t *conf, const char *key, int *in)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
+   errno = 0;
+   int val = strtol(list->value, NULL, 0);
+   if (errno == 0)
    {
-      if (strcmp(key, list->key) == 0)
-      {
-         errno = 0;
-         int val = strtol(list->value, NULL, 0);
-         if (errno == 0)
-         {
-            *in = val;
-            return true;
-         }
-         return
-            false;
-      }
-      list = list->next;
+      *in = val;
+      return true;
    }
    return false;
 }
 
 bool config_get_hex(config_file_t *conf, const char *key, unsigned *in)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
+   errno = 0;
+   unsigned val = strtoul(list->value, NULL, 16);
+   if (errno == 0)
    {
-      if (strcmp(key, list->key) == 0)
-      {
-         errno = 0;
-         unsigned val = strtoul(list->value, NULL, 16);
-         if (errno == 0)
-         {
-            *in = val;
-            return true;
-         }
-         else
-            return false;
-      }
-      list = list->next;
+      *in = val;
+      return true;
    }
-   return false;
+   else
+      return false;
 }
 
 bool config_get_char(config_file_t *conf, const char *key, char *in)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
-   {
-      if (strcmp(key, list->key) == 0)
-      {
-         if (list->value[0] && list->value[1])
-            return false;
-         *in = *list->value;
-         return true;
-      }
-      list = list->next;
-   }
-   return false;
+   if (list->value[0] && list->value[1])
+      return false;
+   *in = *list->value;
+   return true;
 }
 
 bool config_get_string(config_file_t *conf, const char *key, char **str)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
-   {
-      if (strcmp(key, list->key) == 0)
-      {
-         *str = strdup(list->value);
-         return true;
-      }
-      list = list->next;
-   }
-   return false;
+   *str = strdup(list->value);
+   return true;
 }
 
 bool config_get_array(config_file_t *conf, const char *key, char *buf, size_t size)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
-   {
-      if (strcmp(key, list->key) == 0)
-      {
-         strlcpy(buf, list->value, size);
-         return true;
-      }
-      list = list->next;
-   }
-   return false;
+   strlcpy(buf, list->value, size);
+   return true;
 }
 
 bool config_get_bool(config_file_t *conf, const char *key, bool *in)
 {
-   struct entry_list *list = conf->entries;
+   struct entry_list *list = find_entry(conf, key);
+   if (!list)
+      return false;
 
-   while (list)
-   {
-      if (strcmp(key, list->key) == 0)
-      {
-         if (strcasecmp(list->value, "true") == 0)
-            *in = true;
-         else if (strcasecmp(list->value, "1") == 0)
-            *in = true;
-         else if (strcasecmp(list->value, "false") == 0)
-            *in = false;
-         else if (strcasecmp(list->value, "0") == 0)
-            *in = false;
-         else
-            return false;
-
-         return true;
-      }
-      list = list->next;
-   }
-   return false;
+   if (strcasecmp(list->value, "true") == 0)
+      *in = true;
+   else if (strcasecmp(list->value, "1") == 0)
+      *in = true;
+   else if (strcasecmp(list->value, "false") == 0)
+      *in = false;
+   else if (strcasecmp(list->value, "0") == 0)
+      *in = false;
+   else
+      return false;
+
+   return true;
 }
 
 void config_set_string(config_file_t *conf, const char *key, const char *val)
 {
-   struct entry_list *list = conf->entries;
-   struct entry_list *last = list;
-   while (list)
+   // Included entries can't be written, the first writable one is.
+   for (struct entry_list *list = find_entry(conf, key); list; list = list->dup)
    {
-      if (!list->readonly && (strcmp(key, list->key) == 0))
+      if (!list->readonly)
       {
-         free(list->value);
+         if (list->owns_value)
+            free(list->value);
          list->value = strdup(val);
+         list->owns_value = true;
          return;
       }
-
-      last = list;
-      list = list->next;
    }
 
-   struct entry_list *elem = calloc(1, sizeof(*elem));
+   struct entry_list *elem = index_reserve(conf, 1) ? alloc_entry(conf) : NULL;
+   if (!elem)
+      return;
+
    elem->key = strdup(key);
    elem->value = strdup(val);
+   elem->owns_key = true;
+   elem->owns_value = true;
 
-   if (last)
-      last->next = elem;
+   if (conf->entries)
+      conf->tail->next = elem;
    else
       conf->entries = elem;
+   conf->tail = elem;
+   index_add(conf, elem);
 }
 
 void config_set_double(config_file_t *conf, const char *key, double val)
@@ -644,15 +810,6 @@ void config_file_dump_all(config_file_t *conf, FILE *file)
 
 bool config_entry_exists(config_file_t *conf, const char *entry)
 {
-   struct entry_list *list = conf->entries;
-
-   while (list)
-   {
-      if (strcmp(entry, list->key) == 0)
-         return true;
-      list = list->next;
-   }
-
-   return false;
+   return find_entry(conf, entry) != NULL;
 }
 
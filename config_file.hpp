@@ -2,6 +2,7 @@
 #define __CONFIG_FILE_HPP
 
 #include "config_file.h"
+#include <string>
 #include <utility>
 #include <cstdlib>
 
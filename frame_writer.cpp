@@ -0,0 +1,96 @@
+#include "frame_writer.hpp"
+
+FrameWriter::FrameWriter(FILE *file, Format format,
+      unsigned width, unsigned height, unsigned fps)
+   : file(file), format(format), width(width), height(height),
+   head(0), tail(0), dropped_frames(0), written_frames(0),
+   write_failed(false), running(true)
+{
+   size = format == Y4M ? size_t(width) * height * 3 / 2 : size_t(width) * height * 3;
+
+   if (format == Y4M)
+      std::fprintf(file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", width, height, fps);
+
+   for (unsigned i = 0; i < Frames; i++)
+      frames[i].resize(size);
+
+   writer = std::unique_ptr<Thread>(new Thread([this]() { write_frames(); }));
+}
+
+FrameWriter::~FrameWriter()
+{
+   close();
+}
+
+void FrameWriter::close()
+{
+   if (!file)
+      return;
+
+   running = false;
+   wake.signal();
+   writer.reset();
+
+   std::fclose(file);
+   file = nullptr;
+}
+
+uint8_t *FrameWriter::acquire()
+{
+   unsigned pos = head.load(std::memory_order_relaxed);
+   if (pos - tail.load(std::memory_order_acquire) == Frames)
+      return nullptr;
+   return &frames[pos & FramesMask][0];
+}
+
+void FrameWriter::commit()
+{
+   head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+   wake.signal();
+}
+
+bool FrameWriter::write_frame(const uint8_t *frame)
+{
+   if (format == Y4M)
+   {
+      return std::fputs("FRAME\n", file) >= 0 &&
+         std::fwrite(frame, 1, size, file) == size;
+   }
+
+   // Bottom-up in, top-down out.
+   size_t pitch = width * 3;
+   for (unsigned y = height; y > 0; y--)
+   {
+      if (std::fwrite(frame + (y - 1) * pitch, 1, pitch, file) != pitch)
+         return false;
+   }
+   return true;
+}
+
+void FrameWriter::write_frames()
+{
+   for (;;)
+   {
+      unsigned pos = tail.load(std::memory_order_relaxed);
+      if (pos == head.load(std::memory_order_acquire))
+      {
+         if (!running)
+            break;
+         wake.wait(100);
+         continue;
+      }
+
+      if (!write_failed)
+      {
+         if (write_frame(&frames[pos & FramesMask][0]))
+            written_frames++;
+         else
+            write_failed = true;
+      }
+
+      tail.store(pos + 1, std::memory_order_release);
+   }
+
+   std::fflush(file);
+}
+
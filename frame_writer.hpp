@@ -0,0 +1,81 @@
+#ifndef FRAME_WRITER_HPP__
+#define FRAME_WRITER_HPP__
+
+#include "thread.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes frames to a file on a background thread.
+//
+// Frames are handed over through a bounded single-producer,
+// single-consumer ring. The producer fills a slot in place,
+// and never waits on the disk: if the ring is full, it drops the frame.
+// Doesn't depend on Direct3D, Recorder feeds it from a Readback.
+class FrameWriter
+{
+   public:
+      enum Format
+      {
+         // Input is bottom-up BGR888, written top-down without headers.
+         // Lossless.
+         BGR888,
+         // Input is planar I420, written as a YUV4MPEG2 stream.
+         // 4:2:0 limited range, so lossy.
+         Y4M
+      };
+
+      // Takes ownership of file.
+      FrameWriter(FILE *file, Format format, unsigned width, unsigned height, unsigned fps);
+      ~FrameWriter();
+
+      // Writes every committed frame, then closes the file.
+      // Counters are final afterwards. Called by the destructor if need be.
+      void close();
+
+      FrameWriter(const FrameWriter&) = delete;
+      void operator=(const FrameWriter&) = delete;
+
+      // Bytes in a frame of the input format.
+      size_t frame_size() const { return size; }
+
+      // Slot to fill with the next frame, nullptr if the ring is full.
+      uint8_t *acquire();
+      // Queues the acquired slot for writing.
+      void commit();
+      // Counts a frame the producer couldn't hand over.
+      void drop() { dropped_frames++; }
+
+      unsigned written() const { return written_frames; }
+      unsigned dropped() const { return dropped_frames; }
+      // Once writing fails, later frames are discarded.
+      bool failed() const { return write_failed; }
+
+   private:
+      FILE *file;
+      Format format;
+      unsigned width, height;
+      size_t size;
+
+      enum { Frames = 8, FramesMask = Frames - 1 };
+      std::vector<uint8_t> frames[Frames];
+      std::atomic<unsigned> head;
+      std::atomic<unsigned> tail;
+
+      unsigned dropped_frames;
+      std::atomic<unsigned> written_frames;
+      std::atomic<bool> write_failed;
+
+      Event wake;
+      std::atomic<bool> running;
+      std::unique_ptr<Thread> writer;
+
+      void write_frames();
+      bool write_frame(const uint8_t *frame);
+};
+
+#endif
+
@@ -0,0 +1,259 @@
+#include "latency.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+
+namespace Latency
+{
+   std::atomic<bool> active(false);
+
+   static LARGE_INTEGER freq;
+   static unsigned report_interval;
+   static unsigned frames;
+
+   static bool trigger_any;
+   static int trigger_key; // -1 if no edge measurement.
+   static bool edge_pending;
+   static int64_t edge_time;
+
+   static bool polled;
+   static int64_t poll_time;
+   static int64_t frame_time;
+   static int64_t present_time;
+
+   struct Series
+   {
+      const char *name;
+      std::vector<int64_t> samples;
+   };
+
+   enum { PollPresent, FramePresent, PresentCall, PollGpu, EdgePresent, SeriesCount };
+   static Series series[SeriesCount] = {
+      { "poll->present" },
+      { "frame->present" },
+      { "present" },
+      { "poll->gpu" },
+      { "edge->present" },
+   };
+
+   enum { Queries = 4 };
+   struct Query
+   {
+      IDirect3DQuery9 *query;
+      int64_t poll_time;
+      bool issued;
+   };
+   static Query queries[Queries];
+   static unsigned query_ptr;
+   static bool queries_supported;
+
+   int64_t now()
+   {
+      LARGE_INTEGER current;
+      QueryPerformanceCounter(&current);
+      // Whole seconds and the rest separately, so the multiplication
+      // can't overflow however long the machine has been up.
+      int64_t seconds = current.QuadPart / freq.QuadPart;
+      int64_t rest = current.QuadPart % freq.QuadPart;
+      return seconds * 1000000 + (rest * 1000000) / freq.QuadPart;
+   }
+
+   static void add(unsigned index, int64_t value)
+   {
+      series[index].samples.push_back(value);
+   }
+
+   static void report()
+   {
+      for (unsigned i = 0; i < SeriesCount; i++)
+      {
+         std::vector<int64_t> &samples = series[i].samples;
+         if (samples.empty())
+            continue;
+
+         std::sort(samples.begin(), samples.end());
+         size_t n = samples.size();
+         auto ms = [](int64_t usec) { return usec / 1000.0; };
+
+         char line[256];
+         std::snprintf(line, sizeof(line),
+               "%-15s n %5u  min %7.2f  p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms",
+               series[i].name, static_cast<unsigned>(n),
+               ms(samples[0]), ms(samples[n / 2]),
+               ms(samples[(n * 95) / 100]), ms(samples[(n * 99) / 100]),
+               ms(samples[n - 1]));
+         std::cerr << "[Latency]: " << line << std::endl;
+
+         samples.clear();
+      }
+   }
+
+   void init()
+   {
+      const char *env = std::getenv("RARCH_D3D9_LATENCY");
+      if (!env || active)
+         return;
+
+      QueryPerformanceFrequency(&freq);
+
+      report_interval = std::strtoul(env, nullptr, 0);
+      if (!report_interval)
+         report_interval = 600;
+      frames = 0;
+
+      trigger_any = false;
+      trigger_key = -1;
+      const char *trigger = std::getenv("RARCH_D3D9_LATENCY_TRIGGER");
+      if (trigger && !std::strcmp(trigger, "any"))
+         trigger_any = true;
+      else if (trigger)
+         trigger_key = std::strtol(trigger, nullptr, 0);
+
+      edge_pending = false;
+      polled = false;
+      frame_time = 0;
+      std::memset(queries, 0, sizeof(queries));
+      query_ptr = 0;
+      queries_supported = true;
+
+      active = true;
+      std::cerr << "[Latency]: Reporting every " << report_interval << " frames." << std::endl;
+      if (trigger_any || trigger_key >= 0)
+         std::cerr << "[Latency]: Presses are timed from when they are read, "
+            "up to one input read after they happened." << std::endl;
+   }
+
+   void deinit()
+   {
+      if (!active)
+         return;
+
+      release_device();
+      report();
+      active = false;
+   }
+
+   void input_polled(int64_t time)
+   {
+      if (!active)
+         return;
+
+      poll_time = time;
+      polled = true;
+   }
+
+   void input_edge(int device, DWORD offset, int64_t time)
+   {
+      if (!active || edge_pending)
+         return;
+
+      if (!trigger_any && (device != -1 || static_cast<int>(offset) != trigger_key))
+         return;
+
+      // Not the device timestamp, GetTickCount() is only good to 10-16 ms.
+      edge_time = time;
+      edge_pending = true;
+   }
+
+   // Collects the queries which completed since the last call.
+   static void check_queries()
+   {
+      int64_t time = now();
+      for (unsigned i = 0; i < Queries; i++)
+      {
+         Query &q = queries[i];
+         if (!q.issued)
+            continue;
+
+         HRESULT ret = q.query->GetData(nullptr, 0, 0);
+         if (ret == S_FALSE)
+            continue;
+
+         if (ret == S_OK)
+            add(PollGpu, time - q.poll_time);
+         q.issued = false;
+      }
+   }
+
+   void frame_begin()
+   {
+      if (!active)
+         return;
+
+      frame_time = now();
+      check_queries();
+   }
+
+   void present_begin(IDirect3DDevice9 *dev)
+   {
+      if (!active)
+         return;
+
+      if (polled && queries_supported)
+      {
+         Query &q = queries[query_ptr];
+         if (!q.query && FAILED(dev->CreateQuery(D3DQUERYTYPE_EVENT, &q.query)))
+         {
+            q.query = nullptr;
+            queries_supported = false;
+            std::cerr << "[Latency]: Event queries not supported, no GPU timings." << std::endl;
+         }
+
+         // A query still in flight means the GPU is more than
+         // Queries frames behind, skip this one.
+         if (q.query && !q.issued)
+         {
+            q.query->Issue(D3DISSUE_END);
+            q.poll_time = poll_time;
+            q.issued = true;
+            query_ptr = (query_ptr + 1) % Queries;
+         }
+      }
+
+      present_time = now();
+   }
+
+   void present_end()
+   {
+      if (!active)
+         return;
+
+      int64_t time = now();
+      add(PresentCall, time - present_time);
+      if (frame_time)
+         add(FramePresent, time - frame_time);
+
+      // Only frames which saw new input count.
+      if (polled)
+         add(PollPresent, time - poll_time);
+      polled = false;
+
+      if (edge_pending)
+      {
+         add(EdgePresent, time - edge_time);
+         edge_pending = false;
+      }
+
+      if (++frames >= report_interval)
+      {
+         report();
+         frames = 0;
+      }
+   }
+
+   void release_device()
+   {
+      for (unsigned i = 0; i < Queries; i++)
+      {
+         if (queries[i].query)
+            queries[i].query->Release();
+      }
+      std::memset(queries, 0, sizeof(queries));
+      query_ptr = 0;
+   }
+}
+
@@ -0,0 +1,63 @@
+#ifndef LATENCY_HPP__
+#define LATENCY_HPP__
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <d3d9.h>
+#include <atomic>
+#include <stdint.h>
+
+// Optional input-to-present latency measurement.
+// If RARCH_D3D9_LATENCY is set in the environment, every poll, frame
+// and Present is timestamped, and the distributions below are logged
+// every RARCH_D3D9_LATENCY frames (600 if it isn't a number), and at exit.
+//
+//   poll->present:    input sampled to Present() returned
+//   frame->present:   frame() called to Present() returned
+//   present:          time spent in Present()
+//   poll->gpu:        input sampled to the GPU finishing the frame,
+//                     through event queries where supported.
+//                     Queries are only checked once per frame() call,
+//                     so this is an upper bound.
+//   edge->present:    with RARCH_D3D9_LATENCY_TRIGGER, the first press seen
+//                     after the last measurement to the Present() showing it.
+//                     The trigger is a DIK_* keyboard code, or "any" for any
+//                     key or button on a buffered device.
+//                     Counts from when the press was read off the device, so
+//                     it misses up to one read interval (1 ms with the input
+//                     poll thread, a frame without).
+//
+// All calls happen on the thread driving the video and input drivers,
+// except enabled() and now(), which are safe anywhere.
+// Only needs <windows.h> and <d3d9.h>, so tools/latency_test can drive it
+// with a mock device and clock.
+namespace Latency
+{
+   extern std::atomic<bool> active;
+
+   void init();
+   void deinit();
+
+   inline bool enabled() { return active.load(std::memory_order_relaxed); }
+
+   // Microseconds, arbitrary time base.
+   int64_t now();
+
+   // Input state sampled at time (from now()) was handed to the core.
+   void input_polled(int64_t time);
+   // A press seen in that input, read off the device at time (from now()).
+   // device is -1 for the keyboard.
+   void input_edge(int device, DWORD offset, int64_t time);
+
+   void frame_begin();
+   void present_begin(IDirect3DDevice9 *dev);
+   void present_end();
+
+   // Releases queries. Called before Reset() and when the device goes away.
+   void release_device();
+}
+
+#endif
+
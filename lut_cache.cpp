@@ -0,0 +1,442 @@
+#include "lut_cache.hpp"
+#include "shader_cache.hpp"
+#include "thread.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+namespace LutCache
+{
+   struct Level
+   {
+      unsigned pitch;
+      unsigned rows;
+      std::string texels;
+   };
+
+   struct Image
+   {
+      Image() : mtime(0), tex(nullptr), dev(nullptr) {}
+      ~Image()
+      {
+         if (tex)
+            tex->Release();
+      }
+
+      uint64_t mtime;
+      D3DFORMAT format;
+      unsigned width, height;
+      std::vector<Level> levels;
+
+      // Texture shared by every chain using this image on dev.
+      // The cache holds one reference.
+      IDirect3DTexture9 *tex;
+      IDirect3DDevice9 *dev;
+   };
+
+   struct File
+   {
+      uint64_t mtime;
+      std::string data;
+   };
+
+   static Mutex lock;
+   static std::map<std::string, std::shared_ptr<Image>> images;
+   static std::map<std::string, File> files;
+
+   // Last write time and size, so a rewritten file is picked up even if
+   // the timestamp resolution is too coarse to tell.
+   static bool modified(const std::string &path, uint64_t &mtime)
+   {
+      WIN32_FILE_ATTRIBUTE_DATA attr;
+      if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attr))
+         return false;
+
+      mtime = (static_cast<uint64_t>(attr.ftLastWriteTime.dwHighDateTime) << 32) |
+         attr.ftLastWriteTime.dwLowDateTime;
+      mtime ^= (static_cast<uint64_t>(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+      return true;
+   }
+
+   static std::string image_key(const std::string &path, bool smooth, bool compress)
+   {
+      return path + (smooth ? "|linear" : "|point") + (compress ? "|dxt" : "");
+   }
+
+   // Whether an image for path has been decoded from its current version.
+   static bool decoded(const std::string &path, uint64_t mtime)
+   {
+      std::string prefix = path + "|";
+      for (auto itr = images.lower_bound(prefix);
+            itr != images.end() && itr->first.compare(0, prefix.size(), prefix) == 0; ++itr)
+      {
+         if (itr->second->mtime == mtime)
+            return true;
+      }
+      return false;
+   }
+
+   static bool has_alpha(D3DFORMAT format)
+   {
+      switch (format)
+      {
+         case D3DFMT_A8R8G8B8:
+         case D3DFMT_A8B8G8R8:
+         case D3DFMT_A1R5G5B5:
+         case D3DFMT_A4R4G4B4:
+         case D3DFMT_A8R3G3B2:
+         case D3DFMT_A2R10G10B10:
+         case D3DFMT_A2B10G10R10:
+         case D3DFMT_A16B16G16R16:
+         case D3DFMT_A8:
+         case D3DFMT_A8L8:
+         case D3DFMT_A4L4:
+            return true;
+         default:
+            return false;
+      }
+   }
+
+   static bool is_compressed(D3DFORMAT format)
+   {
+      switch (format)
+      {
+         case D3DFMT_DXT1:
+         case D3DFMT_DXT2:
+         case D3DFMT_DXT3:
+         case D3DFMT_DXT4:
+         case D3DFMT_DXT5:
+            return true;
+         default:
+            return false;
+      }
+   }
+
+   bool supports_format(IDirect3DDevice9 *dev, D3DFORMAT format)
+   {
+      D3DDEVICE_CREATION_PARAMETERS params;
+      if (FAILED(dev->GetCreationParameters(&params)))
+         return false;
+
+      IDirect3D9 *d3d;
+      if (FAILED(dev->GetDirect3D(&d3d)))
+         return false;
+
+      D3DDISPLAYMODE mode;
+      bool ret = SUCCEEDED(d3d->GetAdapterDisplayMode(params.AdapterOrdinal, &mode)) &&
+         SUCCEEDED(d3d->CheckDeviceFormat(params.AdapterOrdinal, params.DeviceType,
+                  mode.Format, 0, D3DRTYPE_TEXTURE, format));
+      d3d->Release();
+      return ret;
+   }
+
+   // Picks the block compressed format to load an image as,
+   // or D3DFMT_FROM_FILE to leave it alone.
+   static D3DFORMAT compressed_format(IDirect3DDevice9 *dev, const std::string &data)
+   {
+      D3DXIMAGE_INFO info;
+      if (FAILED(D3DXGetImageInfoFromFileInMemory(data.data(), data.size(), &info)))
+         return D3DFMT_FROM_FILE;
+
+      // D3D9 requires the top level of DXT textures to be in whole blocks.
+      if (is_compressed(info.Format) || (info.Width & 3) || (info.Height & 3))
+         return D3DFMT_FROM_FILE;
+
+      D3DFORMAT format = has_alpha(info.Format) ? D3DFMT_DXT5 : D3DFMT_DXT1;
+      return supports_format(dev, format) ? format : D3DFMT_FROM_FILE;
+   }
+
+   // Block compressed formats store 4x4 texel blocks per row.
+   static unsigned level_rows(D3DFORMAT format, unsigned height)
+   {
+      switch (format)
+      {
+         case D3DFMT_DXT1:
+         case D3DFMT_DXT2:
+         case D3DFMT_DXT3:
+         case D3DFMT_DXT4:
+         case D3DFMT_DXT5:
+            return (height + 3) / 4;
+         default:
+            return height;
+      }
+   }
+
+   static bool capture(IDirect3DTexture9 *tex, Image &image)
+   {
+      D3DSURFACE_DESC desc;
+      if (FAILED(tex->GetLevelDesc(0, &desc)))
+         return false;
+
+      image.format = desc.Format;
+      image.width = desc.Width;
+      image.height = desc.Height;
+      image.levels.resize(tex->GetLevelCount());
+
+      for (unsigned i = 0; i < image.levels.size(); i++)
+      {
+         D3DLOCKED_RECT rect;
+         if (FAILED(tex->GetLevelDesc(i, &desc)) ||
+               FAILED(tex->LockRect(i, &rect, nullptr, D3DLOCK_READONLY)))
+            return false;
+
+         Level &level = image.levels[i];
+         level.pitch = rect.Pitch;
+         level.rows = level_rows(desc.Format, desc.Height);
+         level.texels.assign(reinterpret_cast<const char*>(rect.pBits),
+               level.pitch * level.rows);
+         tex->UnlockRect(i);
+      }
+
+      return true;
+   }
+
+   static IDirect3DTexture9 *upload(IDirect3DDevice9 *dev, const Image &image)
+   {
+      IDirect3DTexture9 *tex;
+      if (FAILED(dev->CreateTexture(image.width, image.height, image.levels.size(),
+                  0, image.format, D3DPOOL_MANAGED, &tex, nullptr)))
+         return nullptr;
+
+      for (unsigned i = 0; i < image.levels.size(); i++)
+      {
+         D3DLOCKED_RECT rect;
+         if (FAILED(tex->LockRect(i, &rect, nullptr, 0)))
+         {
+            tex->Release();
+            return nullptr;
+         }
+
+         const Level &level = image.levels[i];
+         unsigned pitch = std::min<unsigned>(level.pitch, rect.Pitch);
+         for (unsigned y = 0; y < level.rows; y++)
+         {
+            std::memcpy(reinterpret_cast<uint8_t*>(rect.pBits) + y * rect.Pitch,
+                  level.texels.data() + y * level.pitch, pitch);
+         }
+         tex->UnlockRect(i);
+      }
+
+      return tex;
+   }
+
+   static IDirect3DTexture9 *decode(IDirect3DDevice9 *dev,
+         const std::string &data, bool smooth, bool compress)
+   {
+      D3DFORMAT format = compress ? compressed_format(dev, data) : D3DFMT_FROM_FILE;
+
+      IDirect3DTexture9 *tex;
+      if (FAILED(D3DXCreateTextureFromFileInMemoryEx(
+                  dev,
+                  data.data(),
+                  data.size(),
+                  D3DX_DEFAULT_NONPOW2,
+                  D3DX_DEFAULT_NONPOW2,
+                  0,
+                  0,
+                  format,
+                  D3DPOOL_MANAGED,
+                  smooth ? D3DX_FILTER_LINEAR : D3DX_FILTER_POINT,
+                  0,
+                  0,
+                  nullptr,
+                  nullptr,
+                  &tex)))
+         return nullptr;
+
+      return tex;
+   }
+
+   void prefetch(const std::vector<std::string> &paths)
+   {
+      struct Job
+      {
+         std::string path;
+         uint64_t mtime;
+      };
+
+      std::vector<Job> jobs;
+      {
+         Lock guard(lock);
+         for (unsigned i = 0; i < paths.size(); i++)
+         {
+            Job job = { paths[i], 0 };
+            if (!modified(job.path, job.mtime))
+               continue;
+
+            auto file = files.find(job.path);
+            if (file != files.end() && file->second.mtime == job.mtime)
+               continue;
+
+            if (decoded(job.path, job.mtime))
+               continue;
+
+            jobs.push_back(job);
+         }
+      }
+
+      if (jobs.empty())
+         return;
+
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      unsigned workers = std::min<unsigned>(info.dwNumberOfProcessors, jobs.size());
+      if (workers < 1)
+         workers = 1;
+
+      std::atomic<unsigned> next(0);
+      auto worker = [&]() {
+         unsigned i;
+         while ((i = next++) < jobs.size())
+         {
+            File file = { jobs[i].mtime };
+            if (!ShaderCache::read_file(jobs[i].path, file.data))
+               continue;
+
+            Lock guard(lock);
+            std::swap(files[jobs[i].path], file);
+         }
+      };
+
+      std::vector<std::unique_ptr<Thread>> threads;
+      for (unsigned i = 0; i < workers; i++)
+         threads.push_back(std::unique_ptr<Thread>(new Thread(worker)));
+      threads.clear();
+   }
+
+   void drop_prefetched()
+   {
+      Lock guard(lock);
+      files.clear();
+   }
+
+   // Makes tex the shared texture of image, unless another thread got there first.
+   static IDirect3DTexture9 *share(const std::shared_ptr<Image> &image,
+         IDirect3DDevice9 *dev, IDirect3DTexture9 *tex)
+   {
+      Lock guard(lock);
+      if (!image->tex)
+      {
+         tex->AddRef();
+         image->tex = tex;
+         image->dev = dev;
+      }
+      else if (image->dev == dev)
+      {
+         tex->Release();
+         tex = image->tex;
+         tex->AddRef();
+      }
+      return tex;
+   }
+
+   IDirect3DTexture9 *create_texture(IDirect3DDevice9 *dev,
+         const std::string &path, bool smooth, bool compress)
+   {
+      uint64_t mtime = 0;
+      bool cacheable = modified(path, mtime);
+      std::string key = image_key(path, smooth, compress);
+
+      std::string data;
+      bool have_data = false;
+      std::shared_ptr<Image> cached;
+      if (cacheable)
+      {
+         Lock guard(lock);
+         auto image = images.find(key);
+         if (image != images.end() && image->second->mtime == mtime)
+         {
+            if (image->second->tex && image->second->dev == dev)
+            {
+               image->second->tex->AddRef();
+               return image->second->tex;
+            }
+            cached = image->second;
+         }
+
+         auto file = files.find(path);
+         if (file != files.end())
+         {
+            if (file->second.mtime == mtime)
+            {
+               data.swap(file->second.data);
+               have_data = true;
+            }
+            files.erase(file);
+         }
+      }
+
+      // Uploading is slow for big LUTs, other threads shouldn't wait on it.
+      if (cached)
+      {
+         IDirect3DTexture9 *tex = upload(dev, *cached);
+         if (tex)
+            return share(cached, dev, tex);
+      }
+
+      if (!have_data && !ShaderCache::read_file(path, data))
+         return nullptr;
+
+      IDirect3DTexture9 *tex = decode(dev, data, smooth, compress);
+      if (!tex || !cacheable)
+         return tex;
+
+      std::shared_ptr<Image> image = std::make_shared<Image>();
+      image->mtime = mtime;
+      if (capture(tex, *image))
+      {
+         tex->AddRef();
+         image->tex = tex;
+         image->dev = dev;
+
+         Lock guard(lock);
+         images[key] = image;
+      }
+      else
+         std::cerr << "[Direct3D]: Couldn't cache LUT: " << path << std::endl;
+
+      return tex;
+   }
+
+   void trim()
+   {
+      Lock guard(lock);
+      for (auto itr = images.begin(); itr != images.end(); )
+      {
+         // Only the cache's own reference left.
+         IDirect3DTexture9 *tex = itr->second->tex;
+         bool used = false;
+         if (tex)
+         {
+            tex->AddRef();
+            used = tex->Release() > 1;
+         }
+
+         if (used)
+            ++itr;
+         else
+            images.erase(itr++);
+      }
+   }
+
+   void release_device(IDirect3DDevice9 *dev)
+   {
+      Lock guard(lock);
+      for (auto itr = images.begin(); itr != images.end(); ++itr)
+      {
+         Image &image = *itr->second;
+         if (image.tex && image.dev == dev)
+         {
+            image.tex->Release();
+            image.tex = nullptr;
+            image.dev = nullptr;
+         }
+      }
+   }
+}
+
@@ -0,0 +1,46 @@
+#ifndef LUT_CACHE_HPP__
+#define LUT_CACHE_HPP__
+
+#include "common.h"
+#include <string>
+#include <vector>
+
+// Process-wide cache of decoded LUT textures.
+//
+// Images are keyed on path and modification time. Chains using the same
+// image share one managed texture, which survives resets. The texels of
+// every mip level are also kept in system memory, so the texture can be
+// recreated for a new device without touching the disk or the image
+// decoder again. Images no chain uses any more are dropped by trim().
+//
+// LUTs can optionally be block compressed on load, to DXT1,
+// or DXT5 if the image has alpha. Compressed images are cached
+// separately, so the expensive compression also happens only once.
+namespace LutCache
+{
+   // Reads the files behind paths into memory on worker threads,
+   // skipping those which are already decoded and up to date.
+   void prefetch(const std::vector<std::string> &paths);
+   // Forgets prefetched files which were never decoded.
+   void drop_prefetched();
+
+   // Creates a managed texture for the image at path.
+   // If compress is set and the device supports it, the texture is
+   // block compressed. Files which are already block compressed (DDS)
+   // are always loaded as is.
+   // Returns nullptr if the image couldn't be loaded.
+   // The caller owns a reference to the (possibly shared) texture.
+   IDirect3DTexture9 *create_texture(IDirect3DDevice9 *dev,
+         const std::string &path, bool smooth, bool compress);
+
+   // Whether textures of format can be created on dev.
+   bool supports_format(IDirect3DDevice9 *dev, D3DFORMAT format);
+
+   // Forgets images whose texture isn't referenced by anything but the cache.
+   void trim();
+   // Drops the cache's references to textures of dev, before it goes away.
+   void release_device(IDirect3DDevice9 *dev);
+}
+
+#endif
+
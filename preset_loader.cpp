@@ -0,0 +1,52 @@
+#include "preset_loader.hpp"
+#include "lut_cache.hpp"
+
+#include <stdexcept>
+
+PresetLoader::PresetLoader(const std::string &path)
+   : path(path), done(false)
+{
+   io_thread = std::unique_ptr<Thread>(new Thread([this]() { load_files(); }));
+}
+
+PresetLoader::~PresetLoader()
+{
+   compile_thread.reset();
+   io_thread.reset();
+}
+
+void PresetLoader::compile(const ShaderCache::Profile &fragment,
+      const ShaderCache::Profile &vertex)
+{
+   if (compile_thread)
+      return;
+
+   this->fragment = fragment;
+   this->vertex = vertex;
+   compile_thread = std::unique_ptr<Thread>(new Thread([this]() { compile_shaders(); }));
+}
+
+void PresetLoader::load_files()
+{
+   try
+   {
+      preset = std::unique_ptr<ShaderPreset>(new ShaderPreset(path));
+
+      for (unsigned i = 0; i < preset->passes.size(); i++)
+         ShaderCache::preload(preset->passes[i].shader);
+      LutCache::prefetch(preset->lut_paths());
+   }
+   catch (const std::exception&)
+   {
+      // Building the chain will run into the same error and report it.
+   }
+}
+
+void PresetLoader::compile_shaders()
+{
+   io_thread->join();
+   if (preset)
+      ShaderCache::precompile(preset->shader_paths(), fragment, vertex);
+   done = true;
+}
+
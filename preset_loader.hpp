@@ -0,0 +1,54 @@
+#ifndef PRESET_LOADER_HPP__
+#define PRESET_LOADER_HPP__
+
+#include "common.h"
+#include "shader_cache.hpp"
+#include "thread.hpp"
+#include "shader_preset.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Loads a .cgp preset in the background.
+//
+// File I/O starts as soon as the loader is created, concurrently with
+// window and device creation: the preset is parsed into a ShaderPreset,
+// shader sources and LUT images are read into memory (see ShaderCache
+// and LutCache).
+// Compiling needs the device's profiles, so it only starts once compile()
+// is called. Meanwhile, the driver presents frames with the stock shader,
+// and swaps in the real chain once finished() returns true.
+// Building the chain then only has to create device objects.
+class PresetLoader
+{
+   public:
+      PresetLoader(const std::string &path);
+      ~PresetLoader();
+
+      void compile(const ShaderCache::Profile &fragment,
+            const ShaderCache::Profile &vertex);
+      bool compiling() const { return bool(compile_thread); }
+      bool finished() const { return done; }
+
+      // Once finished, hands over the parsed preset.
+      // nullptr if it couldn't be parsed.
+      std::unique_ptr<ShaderPreset> take_preset() { return std::move(preset); }
+
+   private:
+      std::string path;
+      std::unique_ptr<ShaderPreset> preset;
+
+      ShaderCache::Profile fragment;
+      ShaderCache::Profile vertex;
+
+      std::atomic<bool> done;
+      std::unique_ptr<Thread> io_thread;
+      std::unique_ptr<Thread> compile_thread;
+
+      void load_files();
+      void compile_shaders();
+};
+
+#endif
+
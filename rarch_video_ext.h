@@ -0,0 +1,42 @@
+/////
+// Extensions to the RetroArch video plugin API.
+//
+// These are not part of rarch_video_driver_t, so the plugin API version
+// is unaffected. Look them up with GetProcAddress() on the plugin.
+//
+
+#ifndef __RARCH_VIDEO_EXT_H
+#define __RARCH_VIDEO_EXT_H
+
+#include "rarch_video.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tightly packed BGR888, bottom-up like read_viewport. Pitch is width * 3.
+#define RARCH_READBACK_BGR888 0
+// Planar Y, U, V, top-down, BT.601 limited range. width * height * 3 / 2 bytes.
+#define RARCH_READBACK_I420 1
+// Planar Y followed by interleaved UV, otherwise like I420.
+#define RARCH_READBACK_NV12 2
+
+// Reads the content of the viewport into memory,
+// scaled to width x height and converted to format on the GPU.
+// YUV formats need a width divisible by 8 and a height divisible by 4.
+//
+// Called every frame with the same parameters, a call returns the previous
+// frame, so the GPU doesn't have to be waited on. Otherwise a call waits for
+// the current frame, which a call on the following frame then returns again.
+typedef int (RARCH_API_CALLTYPE *rarch_video_read_viewport_ext_t)(void *data,
+      unsigned width, unsigned height, unsigned format, unsigned char *buffer);
+
+RARCH_API_EXPORT int RARCH_API_CALLTYPE rarch_video_read_viewport_ext(void *data,
+      unsigned width, unsigned height, unsigned format, unsigned char *buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,108 @@
+#include "raw_keyboard.hpp"
+#include "D3DVideo.h"
+
+#include <stdexcept>
+#include <cstring>
+
+RawKeyboard::RawKeyboard()
+{
+   std::memset(keys, 0, sizeof(keys));
+   std::memset(presses, 0, sizeof(presses));
+
+   RAWINPUTDEVICE dev;
+   dev.usUsagePage = 0x01; // Generic desktop
+   dev.usUsage = 0x06; // Keyboard
+   dev.dwFlags = 0;
+   dev.hwndTarget = D3DVideo::hwnd();
+   if (!RegisterRawInputDevices(&dev, 1, sizeof(dev)))
+      throw std::runtime_error("Failed to register for raw keyboard input");
+
+   D3DVideo::set_message_handler(WM_INPUT, [this](WPARAM, LPARAM lParam) {
+         on_input(reinterpret_cast<HRAWINPUT>(lParam));
+      });
+   D3DVideo::set_message_handler(WM_KILLFOCUS, [this](WPARAM, LPARAM) {
+         on_focus_lost();
+      });
+}
+
+RawKeyboard::~RawKeyboard()
+{
+   D3DVideo::set_message_handler(WM_INPUT, D3DVideo::MessageHandler());
+   D3DVideo::set_message_handler(WM_KILLFOCUS, D3DVideo::MessageHandler());
+
+   RAWINPUTDEVICE dev;
+   dev.usUsagePage = 0x01;
+   dev.usUsage = 0x06;
+   dev.dwFlags = RIDEV_REMOVE;
+   dev.hwndTarget = nullptr;
+   RegisterRawInputDevices(&dev, 1, sizeof(dev));
+}
+
+void RawKeyboard::on_input(HRAWINPUT handle)
+{
+   RAWINPUT input;
+   UINT size = sizeof(input);
+   if (GetRawInputData(handle, RID_INPUT, &input, &size, sizeof(RAWINPUTHEADER)) == static_cast<UINT>(-1) ||
+         input.header.dwType != RIM_TYPEKEYBOARD)
+      return;
+
+   const RAWKEYBOARD &kb = input.data.keyboard;
+
+   // 0xff is sent for the fake shifts around some extended keys,
+   // and on keyboard overrun.
+   if (kb.VKey == 0xff || kb.MakeCode == 0 || kb.MakeCode >= 0x80)
+      return;
+
+   // DIK_* codes are set 1 scan codes, with the high bit set for E0 keys.
+   // Pause is the only E1 key, and is reported as its first scan code.
+   uint8_t key;
+   if (kb.Flags & RI_KEY_E1)
+   {
+      if (kb.VKey != VK_PAUSE)
+         return;
+      key = DIK_PAUSE;
+   }
+   else
+      key = kb.MakeCode | (kb.Flags & RI_KEY_E0 ? 0x80 : 0);
+
+   bool pressed = !(kb.Flags & RI_KEY_BREAK);
+
+   Lock guard(lock);
+   // Ignore typematic repeats.
+   if (pressed == !!keys[key])
+      return;
+
+   keys[key] = pressed ? 0x80 : 0;
+   if (pressed)
+      presses[key]++;
+
+   KeyEvent event = { key, pressed, static_cast<DWORD>(GetMessageTime()) };
+   pending.push_back(event);
+}
+
+void RawKeyboard::on_focus_lost()
+{
+   // Releases won't be seen without focus.
+   Lock guard(lock);
+   DWORD now = GetTickCount();
+   for (unsigned i = 0; i < 256; i++)
+   {
+      if (!keys[i])
+         continue;
+
+      keys[i] = 0;
+      KeyEvent event = { static_cast<uint8_t>(i), false, now };
+      pending.push_back(event);
+   }
+}
+
+void RawKeyboard::read(uint8_t out_keys[256], uint8_t out_presses[256],
+      std::vector<KeyEvent> &events)
+{
+   events.clear();
+
+   Lock guard(lock);
+   std::memcpy(out_keys, keys, sizeof(keys));
+   std::memcpy(out_presses, presses, sizeof(presses));
+   events.swap(pending);
+}
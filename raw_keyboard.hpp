@@ -0,0 +1,51 @@
+#ifndef RAW_KEYBOARD_HPP__
+#define RAW_KEYBOARD_HPP__
+
+#include "common.h"
+#include "thread.hpp"
+#include <stdint.h>
+#include <vector>
+
+// Keyboard read through Raw Input instead of DirectInput.
+//
+// Registers for WM_INPUT on the video window. Events are handled
+// by the message pump in D3DVideo::process(), and the state is
+// kept in DirectInput's layout: indexed by DIK_* code, 0x80 when held,
+// with a running press count per key.
+// Only sees the keyboard while the window has focus, like
+// a DISCL_FOREGROUND DirectInput device.
+class RawKeyboard
+{
+   public:
+      // Throws std::runtime_error if the window can't be registered.
+      RawKeyboard();
+      ~RawKeyboard();
+
+      RawKeyboard(const RawKeyboard&) = delete;
+      void operator=(const RawKeyboard&) = delete;
+
+      struct KeyEvent
+      {
+         uint8_t key;
+         bool pressed;
+         DWORD timestamp; // GetTickCount() time base.
+      };
+
+      // Copies out the current state, and moves the events
+      // seen since the last call into events.
+      // Can be called from any thread.
+      void read(uint8_t keys[256], uint8_t presses[256],
+            std::vector<KeyEvent> &events);
+
+   private:
+      Mutex lock;
+      uint8_t keys[256];
+      uint8_t presses[256];
+      std::vector<KeyEvent> pending;
+
+      void on_input(HRAWINPUT handle);
+      void on_focus_lost();
+};
+
+#endif
+
@@ -0,0 +1,413 @@
+#include "readback.hpp"
+#include "shader_cache.hpp"
+#include "swizzle.hpp"
+#include "trace.hpp"
+
+#include <Cg/cgD3D9.h>
+#include <cstring>
+#include <iostream>
+
+namespace Global
+{
+   // Packs four bytes of one YUV plane into each output texel.
+   // Each lane samples the scaled image at its own position,
+   // and takes a weighted sum of the color channels.
+   static const char *yuv_program =
+      "void main_vertex(float4 pos : POSITION, float2 tex : TEXCOORD0,\n"
+      "                 out float4 oPos : POSITION, out float2 oTex : TEXCOORD0)\n"
+      "{\n"
+      "  oPos = pos;\n"
+      "  oTex = tex;\n"
+      "}\n"
+
+      "float4 main_fragment(float2 pos : TEXCOORD0,\n"
+      "                     uniform sampler2D source,\n"
+      "                     uniform float4 texel_size,\n"
+      "                     uniform float4 scale,\n"
+      "                     uniform float4 offset,\n"
+      "                     uniform float4 coeff_r,\n"
+      "                     uniform float4 coeff_g,\n"
+      "                     uniform float4 coeff_b,\n"
+      "                     uniform float4 bias) : COLOR\n"
+      "{\n"
+      "  float4 u = (pos.x * scale.x + offset) * texel_size.x;\n"
+      "  float v = pos.y * scale.y * texel_size.y;\n"
+      "  float3 c0 = tex2D(source, float2(u.x, v)).rgb;\n"
+      "  float3 c1 = tex2D(source, float2(u.y, v)).rgb;\n"
+      "  float3 c2 = tex2D(source, float2(u.z, v)).rgb;\n"
+      "  float3 c3 = tex2D(source, float2(u.w, v)).rgb;\n"
+      "  float4 res = float4(c0.r, c1.r, c2.r, c3.r) * coeff_r +\n"
+      "               float4(c0.g, c1.g, c2.g, c3.g) * coeff_g +\n"
+      "               float4(c0.b, c1.b, c2.b, c3.b) * coeff_b + bias;\n"
+      // A8R8G8B8 is stored as B, G, R, A in memory.
+      "  return res.zyxw;\n"
+      "}";
+
+   // BT.601, limited range. Columns are R, G, B weights and bias.
+   static const float yuv_y[4] = {  0.257f,  0.504f,  0.098f,  16.0f / 255.0f };
+   static const float yuv_u[4] = { -0.148f, -0.291f,  0.439f, 128.0f / 255.0f };
+   static const float yuv_v[4] = {  0.439f, -0.368f, -0.071f, 128.0f / 255.0f };
+}
+
+Readback::Readback(IDirect3DDevice9 *dev, CGcontext ctx)
+   : dev(dev), ctx(ctx), head(0), count(0),
+   fPrg(nullptr), vPrg(nullptr), programs_failed(false)
+{
+   for (unsigned i = 0; i < Slots; i++)
+   {
+      slots[i].scaled = nullptr;
+      slots[i].target = nullptr;
+      slots[i].sysmem = nullptr;
+      slots[i].query = nullptr;
+      slots[i].width = 0;
+      slots[i].height = 0;
+      slots[i].format = BGR888;
+      slots[i].frame = 0;
+   }
+}
+
+Readback::~Readback()
+{
+   for (unsigned i = 0; i < Slots; i++)
+      release_slot(slots[i]);
+
+   if (fPrg)
+      cgDestroyProgram(fPrg);
+   if (vPrg)
+      cgDestroyProgram(vPrg);
+}
+
+void Readback::release_slot(Slot &slot)
+{
+   if (slot.scaled)
+      slot.scaled->Release();
+   if (slot.target)
+      slot.target->Release();
+   if (slot.sysmem)
+      slot.sysmem->Release();
+   if (slot.query)
+      slot.query->Release();
+
+   slot.scaled = nullptr;
+   slot.target = nullptr;
+   slot.sysmem = nullptr;
+   slot.query = nullptr;
+   slot.width = 0;
+   slot.height = 0;
+}
+
+bool Readback::init_slot(Slot &slot, unsigned width, unsigned height, Format format)
+{
+   if (slot.target && slot.width == width && slot.height == height && slot.format == format)
+      return true;
+
+   release_slot(slot);
+
+   // YUV planes are packed four bytes to a texel,
+   // the Y plane followed by the chroma planes.
+   bool yuv = format != BGR888;
+   unsigned target_width = yuv ? width / 4 : width;
+   unsigned target_height = yuv ? height * 3 / 2 : height;
+   D3DFORMAT target_format = yuv ? D3DFMT_A8R8G8B8 : D3DFMT_X8R8G8B8;
+
+   if ((yuv && FAILED(dev->CreateTexture(width, height, 1,
+                  D3DUSAGE_RENDERTARGET, D3DFMT_X8R8G8B8, D3DPOOL_DEFAULT,
+                  &slot.scaled, nullptr))) ||
+         FAILED(dev->CreateRenderTarget(target_width, target_height,
+               target_format, D3DMULTISAMPLE_NONE, 0, FALSE,
+               &slot.target, nullptr)) ||
+         FAILED(dev->CreateOffscreenPlainSurface(target_width, target_height,
+               target_format, D3DPOOL_SYSTEMMEM,
+               &slot.sysmem, nullptr)))
+   {
+      release_slot(slot);
+      return false;
+   }
+
+   // Without event queries, collect() just blocks in LockRect.
+   dev->CreateQuery(D3DQUERYTYPE_EVENT, &slot.query);
+
+   slot.width = width;
+   slot.height = height;
+   slot.format = format;
+   return true;
+}
+
+void Readback::pop()
+{
+   count--;
+}
+
+void Readback::drop()
+{
+   if (count)
+      pop();
+}
+
+void Readback::drop_older(unsigned frame)
+{
+   while (count && static_cast<int>(slots[(head + Slots - count) % Slots].frame - frame) < 0)
+      pop();
+}
+
+bool Readback::init_programs()
+{
+   if (fPrg && vPrg)
+      return true;
+   if (programs_failed)
+      return false;
+
+   CGprofile fragment_profile = cgD3D9GetLatestPixelProfile();
+   CGprofile vertex_profile = cgD3D9GetLatestVertexProfile();
+
+   fPrg = ShaderCache::create_program(ctx, "", Global::yuv_program,
+         fragment_profile, "main_fragment", cgD3D9GetOptimalOptions(fragment_profile));
+   vPrg = ShaderCache::create_program(ctx, "", Global::yuv_program,
+         vertex_profile, "main_vertex", cgD3D9GetOptimalOptions(vertex_profile));
+
+   if (!fPrg || !vPrg)
+   {
+      std::cerr << "[Direct3D]: Failed to compile YUV readback shader." << std::endl;
+      programs_failed = true;
+      return false;
+   }
+
+   cgD3D9LoadProgram(fPrg, true, 0);
+   cgD3D9LoadProgram(vPrg, true, 0);
+   return true;
+}
+
+template <class T>
+static void set_cg_param(CGprogram prog, const char *param,
+      const T& val)
+{
+   CGparameter cgp = cgGetNamedParameter(prog, param);
+   if (cgp)
+      cgD3D9SetUniform(cgp, &val);
+}
+
+// Draws the rectangle (x, y, width, height) of the packed target, in texels.
+// The shader gets the texel position as texcoord, with v running
+// from v_begin to v_end, so chroma rows can be interleaved.
+void Readback::draw_plane(const Slot &slot,
+      float x, float y, float width, float height,
+      float v_begin, float v_end,
+      const float *scale, const float *offset, const float (*coeff)[4])
+{
+   float target_width = slot.width / 4;
+   float target_height = slot.height * 3 / 2;
+
+   D3DXVECTOR4 texel_size(1.0f / slot.width, 1.0f / slot.height, 0.0f, 0.0f);
+   set_cg_param(fPrg, "texel_size", texel_size);
+   set_cg_param(fPrg, "scale", D3DXVECTOR4(scale[0], scale[1], 0.0f, 0.0f));
+   set_cg_param(fPrg, "offset", D3DXVECTOR4(offset[0], offset[1], offset[2], offset[3]));
+   set_cg_param(fPrg, "coeff_r", D3DXVECTOR4(coeff[0][0], coeff[1][0], coeff[2][0], coeff[3][0]));
+   set_cg_param(fPrg, "coeff_g", D3DXVECTOR4(coeff[0][1], coeff[1][1], coeff[2][1], coeff[3][1]));
+   set_cg_param(fPrg, "coeff_b", D3DXVECTOR4(coeff[0][2], coeff[1][2], coeff[2][2], coeff[3][2]));
+   set_cg_param(fPrg, "bias", D3DXVECTOR4(coeff[0][3], coeff[1][3], coeff[2][3], coeff[3][3]));
+
+   // Half texel offset, so texcoords are sampled at texel centers.
+   float x0 = 2.0f * (x - 0.5f) / target_width - 1.0f;
+   float x1 = 2.0f * (x + width - 0.5f) / target_width - 1.0f;
+   float y0 = 1.0f - 2.0f * (y - 0.5f) / target_height;
+   float y1 = 1.0f - 2.0f * (y + height - 0.5f) / target_height;
+
+   struct { float x, y, z, u, v; } vert[4] = {
+      { x0, y0, 0.5f, 0.0f,  v_begin },
+      { x1, y0, 0.5f, width, v_begin },
+      { x0, y1, 0.5f, 0.0f,  v_end },
+      { x1, y1, 0.5f, width, v_end },
+   };
+
+   dev->DrawPrimitiveUP(D3DPT_TRIANGLESTRIP, 2, vert, sizeof(vert[0]));
+}
+
+bool Readback::convert(Slot &slot)
+{
+   if (!init_programs())
+      return false;
+
+   CGparameter source = cgGetNamedParameter(fPrg, "source");
+   if (!source)
+      return false;
+   unsigned index = cgGetParameterResourceIndex(source);
+
+   IDirect3DSurface9 *old_target = nullptr;
+   if (FAILED(dev->GetRenderTarget(0, &old_target)))
+      return false;
+
+   D3DVIEWPORT9 old_vp;
+   dev->GetViewport(&old_vp);
+
+   static const D3DSAMPLERSTATETYPE states[] = {
+      D3DSAMP_MINFILTER, D3DSAMP_MAGFILTER, D3DSAMP_ADDRESSU, D3DSAMP_ADDRESSV,
+   };
+   static const DWORD values[] = {
+      D3DTEXF_LINEAR, D3DTEXF_LINEAR, D3DTADDRESS_CLAMP, D3DTADDRESS_CLAMP,
+   };
+   DWORD old_values[4];
+   for (unsigned i = 0; i < 4; i++)
+   {
+      dev->GetSamplerState(index, states[i], &old_values[i]);
+      dev->SetSamplerState(index, states[i], values[i]);
+   }
+
+   dev->SetRenderTarget(0, slot.target);
+   dev->BeginScene();
+
+   cgD3D9BindProgram(fPrg);
+   cgD3D9BindProgram(vPrg);
+   dev->SetFVF(D3DFVF_XYZ | D3DFVF_TEX1);
+   dev->SetTexture(index, slot.scaled);
+
+   float w = slot.width;
+   float h = slot.height;
+
+   // Y: each texel takes four neighbouring pixels of a row.
+   static const float y_scale[] = { 4.0f, 1.0f };
+   static const float y_offset[] = { -1.5f, -0.5f, 0.5f, 1.5f };
+   float y_coeffs[4][4];
+   for (unsigned i = 0; i < 4; i++)
+      std::memcpy(y_coeffs[i], Global::yuv_y, sizeof(y_coeffs[i]));
+   draw_plane(slot, 0.0f, 0.0f, w / 4, h, 0.0f, h, y_scale, y_offset, y_coeffs);
+
+   // Chroma is sampled between 2x2 pixel blocks,
+   // so bilinear filtering averages the block.
+   if (slot.format == I420)
+   {
+      // A texel row holds two rows of a chroma plane,
+      // even rows in the left half, odd rows in the right half.
+      static const float scale[] = { 8.0f, 2.0f };
+      static const float offset[] = { -3.0f, -1.0f, 1.0f, 3.0f };
+      const float *planes[] = { Global::yuv_u, Global::yuv_v };
+
+      for (unsigned p = 0; p < 2; p++)
+      {
+         float coeffs[4][4];
+         for (unsigned i = 0; i < 4; i++)
+            std::memcpy(coeffs[i], planes[p], sizeof(coeffs[i]));
+
+         float y = h + p * h / 4;
+         draw_plane(slot, 0.0f, y, w / 8, h / 4,
+               -0.5f, h / 2 - 0.5f, scale, offset, coeffs);
+         draw_plane(slot, w / 8, y, w / 8, h / 4,
+               0.5f, h / 2 + 0.5f, scale, offset, coeffs);
+      }
+   }
+   else
+   {
+      // Each texel is U, V of two neighbouring chroma samples.
+      static const float scale[] = { 4.0f, 2.0f };
+      static const float offset[] = { -1.0f, -1.0f, 1.0f, 1.0f };
+      float coeffs[4][4];
+      std::memcpy(coeffs[0], Global::yuv_u, sizeof(coeffs[0]));
+      std::memcpy(coeffs[1], Global::yuv_v, sizeof(coeffs[1]));
+      std::memcpy(coeffs[2], Global::yuv_u, sizeof(coeffs[2]));
+      std::memcpy(coeffs[3], Global::yuv_v, sizeof(coeffs[3]));
+      draw_plane(slot, 0.0f, h, w / 4, h / 2, 0.0f, h / 2, scale, offset, coeffs);
+   }
+
+   dev->EndScene();
+
+   dev->SetTexture(index, nullptr);
+   for (unsigned i = 0; i < 4; i++)
+      dev->SetSamplerState(index, states[i], old_values[i]);
+   dev->SetRenderTarget(0, old_target);
+   dev->SetViewport(&old_vp);
+   old_target->Release();
+   return true;
+}
+
+bool Readback::capture(IDirect3DSurface9 *src, const D3DVIEWPORT9 &vp,
+      unsigned width, unsigned height, Format format, unsigned frame)
+{
+   if (!vp.Width || !vp.Height || !supported(width, height, format))
+      return false;
+
+   if (count == Slots)
+      pop();
+
+   Slot &slot = slots[head];
+   if (!init_slot(slot, width, height, format))
+      return false;
+
+   RECT rect = { (LONG)vp.X, (LONG)vp.Y, (LONG)(vp.X + vp.Width), (LONG)(vp.Y + vp.Height) };
+   D3DTEXTUREFILTERTYPE filter = vp.Width == width && vp.Height == height ?
+      D3DTEXF_NONE : D3DTEXF_LINEAR;
+
+   if (slot.scaled)
+   {
+      IDirect3DSurface9 *scaled;
+      if (FAILED(slot.scaled->GetSurfaceLevel(0, &scaled)))
+         return false;
+
+      HRESULT ret = dev->StretchRect(src, &rect, scaled, nullptr, filter);
+      scaled->Release();
+
+      if (FAILED(ret) || !convert(slot))
+         return false;
+   }
+   else if (FAILED(dev->StretchRect(src, &rect, slot.target, nullptr, filter)))
+      return false;
+
+   if (FAILED(dev->GetRenderTargetData(slot.target, slot.sysmem)))
+      return false;
+
+   if (slot.query)
+      slot.query->Issue(D3DISSUE_END);
+
+   slot.frame = frame;
+   head = (head + 1) % Slots;
+   count++;
+   return true;
+}
+
+bool Readback::collect(uint8_t *buffer, unsigned width, unsigned height,
+      Format format, bool wait, bool keep)
+{
+   while (count)
+   {
+      Slot &slot = slots[(head + Slots - count) % Slots];
+      if (slot.width != width || slot.height != height || slot.format != format)
+      {
+         pop();
+         continue;
+      }
+
+      if (!wait && slot.query &&
+            slot.query->GetData(nullptr, 0, D3DGETDATA_FLUSH) == S_FALSE)
+         return false;
+
+      Trace::Scope trace("Readback");
+
+      D3DLOCKED_RECT rect;
+      if (FAILED(slot.sysmem->LockRect(&rect, nullptr, D3DLOCK_READONLY)))
+      {
+         pop();
+         return false;
+      }
+
+      const uint8_t *pixels = reinterpret_cast<const uint8_t*>(rect.pBits);
+      if (format == BGR888)
+      {
+         pixels += (height - 1) * rect.Pitch;
+         for (unsigned y = 0; y < height; y++, pixels -= rect.Pitch, buffer += width * 3)
+            Swizzle::xrgb8888_to_bgr888(buffer, reinterpret_cast<const uint32_t*>(pixels), width);
+      }
+      else
+      {
+         // Packed rows are exactly one row of the Y plane wide.
+         for (unsigned y = 0; y < height * 3 / 2; y++, pixels += rect.Pitch, buffer += width)
+            std::memcpy(buffer, pixels, width);
+      }
+
+      slot.sysmem->UnlockRect();
+
+      if (!keep)
+         pop();
+      return true;
+   }
+
+   return false;
+}
+
@@ -0,0 +1,125 @@
+#ifndef READBACK_HPP__
+#define READBACK_HPP__
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <d3d9.h>
+#include "rarch_video_ext.h"
+#include <Cg/cg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous readback of a rectangle of a render target.
+//
+// Each capture copies the rectangle into a render target of its own on
+// the GPU, and queues a copy of that to a system memory surface.
+// Surfaces are kept in a small ring and reused across captures,
+// so collecting a frame one or two captures later normally
+// doesn't have to wait for the GPU.
+//
+// Captures can be scaled, and converted to planar YUV on the GPU,
+// so only the bytes the caller wants cross the bus.
+//
+// All surfaces live in D3DPOOL_DEFAULT or depend on it,
+// so a Readback must be destroyed before the device is reset,
+// and before the Cg context goes away.
+class Readback
+{
+   public:
+      enum Format
+      {
+         // Bottom-up, like read_viewport.
+         BGR888 = RARCH_READBACK_BGR888,
+         // Top-down, BT.601 limited range.
+         I420 = RARCH_READBACK_I420,
+         NV12 = RARCH_READBACK_NV12
+      };
+
+      Readback(IDirect3DDevice9 *dev, CGcontext ctx);
+      ~Readback();
+
+      // Whether captures of this size and format can be made.
+      // YUV formats need a width divisible by 8 and a height divisible by 4.
+      static bool supported(unsigned width, unsigned height, Format format)
+      {
+         if (!width || !height)
+            return false;
+         if (format == BGR888)
+            return true;
+         return (format == I420 || format == NV12) && !(width & 7) && !(height & 3);
+      }
+
+      // Bytes collect() writes for a capture.
+      static size_t frame_size(unsigned width, unsigned height, Format format)
+      {
+         if (format == BGR888)
+            return size_t(width) * height * 3;
+         return size_t(width) * height * 3 / 2;
+      }
+
+      // Queues a copy of the viewport rectangle of src,
+      // scaled to width x height and converted to format.
+      // frame is the caller's frame number, see drop_older().
+      // If the ring is full, the oldest uncollected capture is dropped.
+      bool capture(IDirect3DSurface9 *src, const D3DVIEWPORT9 &vp,
+            unsigned width, unsigned height, Format format, unsigned frame = 0);
+
+      // Writes the oldest queued capture to buffer,
+      // which must hold frame_size() bytes.
+      // Captures of a different size or format are dropped.
+      // If wait is not set, returns false rather than waiting for the GPU.
+      // If keep is set, the capture stays queued.
+      bool collect(uint8_t *buffer, unsigned width, unsigned height,
+            Format format, bool wait, bool keep = false);
+
+      unsigned pending() const { return count; }
+      unsigned capacity() const { return Slots; }
+      // Drops the oldest queued capture.
+      void drop();
+      // Drops queued captures taken before frame.
+      void drop_older(unsigned frame);
+
+      Readback(const Readback&) = delete;
+      void operator=(const Readback&) = delete;
+
+   private:
+      IDirect3DDevice9 *dev;
+      CGcontext ctx;
+
+      struct Slot
+      {
+         // Scaled RGB copy, only used as shader input for YUV formats.
+         IDirect3DTexture9 *scaled;
+         // What gets read back: scaled RGB, or packed YUV planes.
+         IDirect3DSurface9 *target;
+         IDirect3DSurface9 *sysmem;
+         IDirect3DQuery9 *query;
+         unsigned width, height;
+         Format format;
+         unsigned frame;
+      };
+
+      enum { Slots = 3 };
+      Slot slots[Slots];
+      unsigned head;
+      unsigned count;
+
+      CGprogram fPrg, vPrg;
+      bool programs_failed;
+
+      bool init_slot(Slot &slot, unsigned width, unsigned height, Format format);
+      void release_slot(Slot &slot);
+      void pop();
+
+      bool init_programs();
+      bool convert(Slot &slot);
+      void draw_plane(const Slot &slot,
+            float x, float y, float width, float height,
+            float v_begin, float v_end,
+            const float *scale, const float *offset, const float (*coeff)[4]);
+};
+
+#endif
+
@@ -0,0 +1,127 @@
+#include "recorder.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <stdexcept>
+
+bool Recorder::is_y4m(const std::string &path)
+{
+   return path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+}
+
+void Recorder::viewport_size(const std::string &path,
+      unsigned vp_width, unsigned vp_height,
+      unsigned &width, unsigned &height)
+{
+   width = vp_width;
+   height = vp_height;
+   if (is_y4m(path))
+   {
+      width &= ~7u;
+      height &= ~3u;
+   }
+}
+
+Recorder::Recorder(const std::string &path, unsigned width, unsigned height, unsigned fps)
+   : path(path), width(width), height(height), captured(0), dropped_gpu(0)
+{
+   bool y4m = is_y4m(path);
+   format = y4m ? Readback::I420 : Readback::BGR888;
+
+   if (!Readback::supported(width, height, format))
+      throw std::runtime_error("Unsupported recording size!");
+
+   FILE *file = std::fopen(path.c_str(), "wb");
+   if (!file)
+      throw std::runtime_error("Failed to open recording file!");
+
+   writer = std::unique_ptr<FrameWriter>(new FrameWriter(file,
+            y4m ? FrameWriter::Y4M : FrameWriter::BGR888, width, height, fps));
+
+   std::cerr << "[Direct3D]: Recording " << width << "x" << height <<
+      (y4m ? " I420 (lossy)" : " BGR888 (lossless)") << " to " << path << std::endl;
+}
+
+Recorder::~Recorder()
+{
+   // Whatever the GPU still has queued is waited for, so nothing is lost at the end.
+   if (readback)
+      collect(true);
+   readback.reset();
+
+   writer->close();
+   unsigned written = writer->written();
+   unsigned dropped_writer = writer->dropped();
+   bool write_failed = writer->failed();
+   writer.reset();
+
+   std::cerr << "[Direct3D]: Recorded " << written << " of " << captured << " frames to " <<
+      path << ", dropped " << dropped_gpu << " waiting on the GPU and " <<
+      dropped_writer << " waiting on the disk." << std::endl;
+   if (write_failed)
+      std::cerr << "[Direct3D]: Writing the recording failed, it is truncated." << std::endl;
+}
+
+void Recorder::release_device()
+{
+   if (readback)
+      dropped_gpu += readback->pending();
+   readback.reset();
+}
+
+void Recorder::collect(bool wait)
+{
+   while (readback->pending())
+   {
+      uint8_t *frame = writer->acquire();
+      if (!frame)
+      {
+         // Final flush, let the writer catch up.
+         if (wait)
+         {
+            Sleep(1);
+            continue;
+         }
+
+         if (readback->pending() < readback->capacity())
+            return;
+
+         // The writer is behind, and the GPU needs the slot back.
+         if (!writer->dropped())
+            std::cerr << "[Direct3D]: Recording can't keep up, dropping frames." << std::endl;
+         writer->drop();
+         readback->drop();
+         continue;
+      }
+
+      if (!readback->collect(frame, width, height, format, wait))
+         return;
+
+      writer->commit();
+   }
+}
+
+void Recorder::capture(IDirect3DDevice9 *dev, CGcontext ctx,
+      IDirect3DSurface9 *src, const D3DVIEWPORT9 &vp)
+{
+   if (writer->failed())
+      return;
+
+   Trace::Scope trace("Record");
+
+   if (!readback)
+      readback = std::unique_ptr<Readback>(new Readback(dev, ctx));
+
+   collect(false);
+
+   captured++;
+   if (readback->pending() == readback->capacity())
+   {
+      if (!dropped_gpu++)
+         std::cerr << "[Direct3D]: Recording readback is behind, dropping frames." << std::endl;
+      return;
+   }
+
+   readback->capture(src, vp, width, height, format);
+}
+
@@ -0,0 +1,69 @@
+#ifndef RECORDER_HPP__
+#define RECORDER_HPP__
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <d3d9.h>
+#include "readback.hpp"
+#include "frame_writer.hpp"
+#include <memory>
+#include <string>
+
+// Records the presented viewport to a file, without stalling the frame.
+//
+// Each frame is captured through an asynchronous Readback, and finished
+// captures are handed to a FrameWriter, which writes them on its own thread.
+// If the GPU or the disk can't keep up, frames are dropped and counted
+// rather than waited for.
+//
+// .y4m files get I420 in a YUV4MPEG2 stream, which is 4:2:0 and limited
+// range, so not lossless. Anything else gets headerless top-down BGR888
+// frames, which are an exact copy of the viewport.
+//
+// Only needs <windows.h>, <d3d9.h> and Cg's headers, so tools/recorder_test
+// can run it on a stand-in Readback.
+class Recorder
+{
+   public:
+      // Throws std::runtime_error if the file can't be opened,
+      // or the format can't be recorded at this size.
+      Recorder(const std::string &path, unsigned width, unsigned height, unsigned fps);
+      ~Recorder();
+
+      // Size to record a viewport at: the viewport itself, rounded down
+      // to what I420 needs for .y4m files.
+      static void viewport_size(const std::string &path,
+            unsigned vp_width, unsigned vp_height,
+            unsigned &width, unsigned &height);
+
+      Recorder(const Recorder&) = delete;
+      void operator=(const Recorder&) = delete;
+
+      // Called once per frame, before Present.
+      void capture(IDirect3DDevice9 *dev, CGcontext ctx,
+            IDirect3DSurface9 *src, const D3DVIEWPORT9 &vp);
+
+      // Releases device resources. Must be called before the device is
+      // reset or destroyed. Recording carries on once capture() is called
+      // with the new device. Captures still on the GPU count as dropped.
+      void release_device();
+
+   private:
+      std::string path;
+      unsigned width, height;
+      Readback::Format format;
+
+      std::unique_ptr<Readback> readback;
+      std::unique_ptr<FrameWriter> writer;
+
+      unsigned captured;
+      unsigned dropped_gpu;
+
+      static bool is_y4m(const std::string &path);
+      void collect(bool wait);
+};
+
+#endif
+
@@ -1,4 +1,6 @@
 #include "render_chain.hpp"
+#include "lut_cache.hpp"
+#include "trace.hpp"
 #include <utility>
 
 #include <stdexcept>
@@ -72,6 +74,7 @@ void RenderChain::clear()
 
    passes.clear();
    luts.clear();
+   programs.clear();
 }
 
 void RenderChain::add_pass(const LinkInfo &info)
@@ -83,6 +86,17 @@ void RenderChain::add_pass(const LinkInfo &info)
 
    compile_shaders(pass, info.shader_path);
    init_fvf(pass);
+   create_pass_resources(pass);
+
+   passes.push_back(pass);
+
+   log_info(info);
+}
+
+void RenderChain::create_pass_resources(Pass &pass)
+{
+   pass.vertex_buf = nullptr;
+   pass.tex = nullptr;
 
    if (FAILED(dev->CreateVertexBuffer(
                4 * sizeof(Vertex),
@@ -95,7 +109,7 @@ void RenderChain::add_pass(const LinkInfo &info)
       throw std::runtime_error("Failed to create Vertex buf ...");
    }
 
-   if (FAILED(dev->CreateTexture(info.tex_w, info.tex_h, 1,
+   if (FAILED(dev->CreateTexture(pass.info.tex_w, pass.info.tex_h, 1,
                D3DUSAGE_RENDERTARGET,
                D3DFMT_X8R8G8B8,
                D3DPOOL_DEFAULT,
@@ -108,39 +122,99 @@ void RenderChain::add_pass(const LinkInfo &info)
    dev->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_BORDER);
    dev->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_BORDER);
    dev->SetTexture(0, nullptr);
+}
 
-   passes.push_back(pass);
+void RenderChain::create_prev_resources()
+{
+   for (unsigned i = 0; i < Textures; i++)
+   {
+      prev.last_width[i] = 0;
+      prev.last_height[i] = 0;
 
-   log_info(info);
+      if (FAILED(dev->CreateVertexBuffer(
+                  4 * sizeof(Vertex),
+                  0,
+                  FVF,
+                  D3DPOOL_DEFAULT,
+                  &prev.vertex_buf[i],
+                  nullptr)))
+      {
+         throw std::runtime_error("Failed to create Vertex buf ...");
+      }
+
+      // Don't leave garbage in buffers which might be bound as PREV
+      // before a frame has been rendered into them.
+      void *verts;
+      if (SUCCEEDED(prev.vertex_buf[i]->Lock(0, 4 * sizeof(Vertex), &verts, 0)))
+      {
+         std::memset(verts, 0, 4 * sizeof(Vertex));
+         prev.vertex_buf[i]->Unlock();
+      }
+   }
+}
+
+void RenderChain::on_lost_device()
+{
+   for (unsigned i = 0; i < Textures; i++)
+   {
+      if (prev.vertex_buf[i])
+         prev.vertex_buf[i]->Release();
+      prev.vertex_buf[i] = nullptr;
+   }
+
+   // First pass aliases the prev textures.
+   passes[0].vertex_buf = nullptr;
+   for (unsigned i = 1; i < passes.size(); i++)
+   {
+      if (passes[i].tex)
+         passes[i].tex->Release();
+      if (passes[i].vertex_buf)
+         passes[i].vertex_buf->Release();
+      passes[i].tex = nullptr;
+      passes[i].vertex_buf = nullptr;
+   }
+}
+
+void RenderChain::on_reset_device()
+{
+   create_prev_resources();
+
+   for (unsigned i = 0; i < passes.size(); i++)
+   {
+      passes[i].last_width = 0;
+      passes[i].last_height = 0;
+      if (i > 0)
+         create_pass_resources(passes[i]);
+   }
+
+   // Reset() throws away all device state, so set up what
+   // create_first_pass() did initially.
+   D3DXMATRIX ident;
+   D3DXMatrixIdentity(&ident);
+   dev->SetTransform(D3DTS_WORLD, &ident);
+   dev->SetTransform(D3DTS_VIEW, &ident);
+   dev->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_BORDER);
+   dev->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_BORDER);
 }
 
 void RenderChain::add_lut(const std::string &id,
       const std::string &path,
-      bool smooth)
+      bool smooth,
+      bool compress)
 {
-   IDirect3DTexture9 *lut;
-
    std::cerr << "[Direct3D]: Loading LUT texture: " << path << std::endl;
 
-   if (FAILED(D3DXCreateTextureFromFileExA(
-               dev,
-               path.c_str(),
-               D3DX_DEFAULT_NONPOW2,
-               D3DX_DEFAULT_NONPOW2,
-               0,
-               0,
-               D3DFMT_FROM_FILE,
-               D3DPOOL_MANAGED,
-               smooth ? D3DX_FILTER_LINEAR : D3DX_FILTER_POINT,
-               0,
-               0,
-               nullptr,
-               nullptr,
-               &lut)))
-   {
+   IDirect3DTexture9 *lut = LutCache::create_texture(dev, path, smooth, compress);
+   if (!lut)
       throw std::runtime_error("Failed to load LUT!");
-   }
 
+   add_lut(id, lut, smooth);
+}
+
+void RenderChain::add_lut(const std::string &id,
+      IDirect3DTexture9 *lut,
+      bool smooth)
+{
    dev->SetTexture(0, lut);
    dev->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_BORDER);
    dev->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_BORDER);
@@ -180,8 +254,9 @@ bool RenderChain::render(const void *data,
 
    unsigned current_width = width, current_height = height;
    unsigned out_width, out_height;
-   convert_geometry(passes[0].info, out_width, out_height,
-         current_width, current_height, final_viewport);
+   ChainPlan::convert_geometry(passes[0].info, out_width, out_height,
+         current_width, current_height,
+         final_viewport.Width, final_viewport.Height);
 
    blit_to_texture(data, width, height, pitch);
 
@@ -199,9 +274,10 @@ bool RenderChain::render(const void *data,
       to_pass.tex->GetSurfaceLevel(0, &target);
       dev->SetRenderTarget(0, target);
 
-      convert_geometry(from_pass.info,
+      ChainPlan::convert_geometry(from_pass.info,
             out_width, out_height,
-            current_width, current_height, final_viewport);
+            current_width, current_height,
+            final_viewport.Width, final_viewport.Height);
 
       D3DVIEWPORT9 viewport = {0};
       viewport.X = 0;
@@ -228,9 +304,10 @@ bool RenderChain::render(const void *data,
    dev->SetRenderTarget(0, back_buffer);
    Pass &last_pass = passes.back();
 
-   convert_geometry(last_pass.info,
+   ChainPlan::convert_geometry(last_pass.info,
          out_width, out_height,
-         current_width, current_height, final_viewport);
+         current_width, current_height,
+         final_viewport.Width, final_viewport.Height);
    set_viewport(final_viewport);
    set_vertices(last_pass,
             current_width, current_height,
@@ -260,22 +337,10 @@ void RenderChain::create_first_pass(const LinkInfo &info, PixelFormat fmt)
    pass.last_height = 0;
 
    prev.ptr = 0;
+   create_prev_resources();
+
    for (unsigned i = 0; i < Textures; i++)
    {
-      prev.last_width[i] = 0;
-      prev.last_height[i] = 0;
-
-      if (FAILED(dev->CreateVertexBuffer(
-                  4 * sizeof(Vertex),
-                  0,
-                  FVF,
-                  D3DPOOL_DEFAULT,
-                  &prev.vertex_buf[i],
-                  nullptr)))
-      {
-         throw std::runtime_error("Failed to create Vertex buf ...");
-      }
-
       if (FAILED(dev->CreateTexture(info.tex_w, info.tex_h, 1, 0,
                   fmt == RGB15 ? D3DFMT_X1R5G5B5 : D3DFMT_X8R8G8B8,
                   D3DPOOL_MANAGED,
@@ -301,49 +366,57 @@ void RenderChain::create_first_pass(const LinkInfo &info, PixelFormat fmt)
 
 void RenderChain::compile_shaders(Pass &pass, const std::string &shader)
 {
+   // Presets often use the same shader for several passes.
+   // Programs live as long as the Cg context, so just share them.
+   auto itr = programs.find(shader);
+   if (itr != programs.end())
+   {
+      pass.fPrg = itr->second.first;
+      pass.vPrg = itr->second.second;
+      return;
+   }
+
    CGprofile fragment_profile = cgD3D9GetLatestPixelProfile();
    CGprofile vertex_profile = cgD3D9GetLatestVertexProfile();
    const char **fragment_opts = cgD3D9GetOptimalOptions(fragment_profile);
    const char **vertex_opts = cgD3D9GetOptimalOptions(vertex_profile);
 
+   const char *source = nullptr;
    if (shader.length() > 0)
-   {
       std::cerr << "[Direct3D Cg]: Compiling shader: " << shader << std::endl;
-      pass.fPrg = cgCreateProgramFromFile(cgCtx, CG_SOURCE,
-            shader.c_str(), fragment_profile, "main_fragment", fragment_opts);
-
-      if (cgGetLastListing(cgCtx))
-         std::cerr << "Fragment error: " << std::endl <<
-            cgGetLastListing(cgCtx) << std::endl;
-
-      pass.vPrg = cgCreateProgramFromFile(cgCtx, CG_SOURCE,
-            shader.c_str(), vertex_profile, "main_vertex", vertex_opts);
-
-      if (cgGetLastListing(cgCtx))
-         std::cerr << "Vertex error: " << std::endl <<
-            cgGetLastListing(cgCtx) << std::endl;
-   }
    else
    {
       std::cerr << "[Direct3D Cg]: Compiling stock shader" << std::endl;
-
-      pass.fPrg = cgCreateProgram(cgCtx, CG_SOURCE, Global::stock_program,
-            fragment_profile, "main_fragment", fragment_opts);
-      if (cgGetLastListing(cgCtx))
-         std::cerr << "Fragment error: " << std::endl <<
-            cgGetLastListing(cgCtx) << std::endl;
-      pass.vPrg = cgCreateProgram(cgCtx, CG_SOURCE, Global::stock_program,
-            vertex_profile, "main_vertex", vertex_opts);
-      if (cgGetLastListing(cgCtx))
-         std::cerr << "Vertex error: " << std::endl <<
-            cgGetLastListing(cgCtx) << std::endl;
+      source = Global::stock_program;
    }
 
+   pass.fPrg = ShaderCache::create_program(cgCtx, shader, source,
+         fragment_profile, "main_fragment", fragment_opts);
+   pass.vPrg = ShaderCache::create_program(cgCtx, shader, source,
+         vertex_profile, "main_vertex", vertex_opts);
+
    if (!pass.fPrg || !pass.vPrg)
       throw std::runtime_error("Failed to compile shaders!");
 
    cgD3D9LoadProgram(pass.fPrg, true, 0);
    cgD3D9LoadProgram(pass.vPrg, true, 0);
+
+   programs[shader] = std::make_pair(pass.fPrg, pass.vPrg);
+}
+
+static void get_profile(ShaderCache::Profile &out, CGprofile profile)
+{
+   out.profile = profile;
+   out.opts.clear();
+   for (const char **opt = cgD3D9GetOptimalOptions(profile); opt && *opt; opt++)
+      out.opts.push_back(*opt);
+}
+
+void RenderChain::shader_profiles(ShaderCache::Profile &fragment,
+      ShaderCache::Profile &vertex)
+{
+   get_profile(fragment, cgD3D9GetLatestPixelProfile());
+   get_profile(vertex, cgD3D9GetLatestVertexProfile());
 }
 
 void RenderChain::set_shaders(Pass &pass)
@@ -489,46 +562,12 @@ void RenderChain::clear_texture(Pass &pass)
    }
 }
 
-void RenderChain::convert_geometry(const LinkInfo &info,
-      unsigned &out_width, unsigned &out_height,
-      unsigned width, unsigned height,
-      const D3DVIEWPORT9 &final_viewport)
-{
-   switch (info.scale_type_x)
-   {
-      case LinkInfo::Viewport:
-         out_width = info.scale_x * final_viewport.Width;
-         break;
-
-      case LinkInfo::Absolute:
-         out_width = info.abs_x;
-         break;
-
-      case LinkInfo::Relative:
-         out_width = info.scale_x * width;
-         break;
-   }
-
-   switch (info.scale_type_y)
-   {
-      case LinkInfo::Viewport:
-         out_height = info.scale_y * final_viewport.Height;
-         break;
-
-      case LinkInfo::Absolute:
-         out_height = info.abs_y;
-         break;
-
-      case LinkInfo::Relative:
-         out_height = info.scale_y * height;
-         break;
-   }
-}
-
 void RenderChain::blit_to_texture(const void *frame,
       unsigned width, unsigned height,
       unsigned pitch)
 {
+   Trace::Scope trace("Upload");
+
    Pass &first = passes[0];
    if (first.last_width != width || first.last_height != height)
       clear_texture(first);
@@ -549,6 +588,8 @@ void RenderChain::blit_to_texture(const void *frame,
 
 void RenderChain::render_pass(Pass &pass, unsigned pass_index)
 {
+   Trace::Scope trace("Pass", pass_index, true);
+
    set_shaders(pass);
    dev->SetTexture(0, pass.tex);
    dev->SetSamplerState(0, D3DSAMP_MINFILTER,
@@ -1018,6 +1059,8 @@ void RenderChain::bind_tracker(Pass &pass)
    if (!tracker)
       return;
 
+   Trace::Scope trace("Tracker");
+
    auto res = tracker->get_uniforms(frame_count);
    for (unsigned i = 0; i < res.size(); i++)
    {
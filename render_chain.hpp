@@ -6,6 +6,8 @@
 #include <map>
 #include <utility>
 #include "state_tracker.hpp"
+#include "shader_cache.hpp"
+#include "chain_plan.hpp"
 #include <memory>
 
 struct Vertex
@@ -15,20 +17,6 @@ struct Vertex
    float lut_u, lut_v;
 };
 
-struct LinkInfo
-{
-   enum ScaleType { Relative, Absolute, Viewport };
-
-   unsigned tex_w, tex_h;
-   
-   float scale_x, scale_y;
-   unsigned abs_x, abs_y;
-   bool filter_linear;
-   ScaleType scale_type_x, scale_type_y;
-
-   std::string shader_path;
-};
-
 class RenderChain
 {
    public:
@@ -42,7 +30,11 @@ class RenderChain
             const D3DVIEWPORT9 &final_viewport);
 
       void add_pass(const LinkInfo &info);
-      void add_lut(const std::string &id, const std::string &path, bool smooth);
+      // If compress is set, the LUT is block compressed where supported.
+      void add_lut(const std::string &id, const std::string &path,
+            bool smooth, bool compress);
+      // Takes ownership of a texture that has already been filled.
+      void add_lut(const std::string &id, IDirect3DTexture9 *tex, bool smooth);
       void add_state_tracker(const std::string &program,
             const std::string &py_class,
             const std::vector<std::string> &uniforms);
@@ -50,10 +42,18 @@ class RenderChain
       bool render(const void *data,
             unsigned width, unsigned height, unsigned pitch, unsigned rotation);
 
-      static void convert_geometry(const LinkInfo &info,
-            unsigned &out_width, unsigned &out_height,
-            unsigned width, unsigned height,
-            const D3DVIEWPORT9 &final_viewport);
+      // Compiler settings for the current device.
+      // Compiling the programs for a set of shaders up front with
+      // ShaderCache::precompile() means add_pass() only has to create
+      // device objects.
+      static void shader_profiles(ShaderCache::Profile &fragment,
+            ShaderCache::Profile &vertex);
+
+      // Releases and recreates D3DPOOL_DEFAULT resources around
+      // IDirect3DDevice9::Reset(). Compiled shaders and managed
+      // textures (LUTs, input textures) are kept alive.
+      void on_lost_device();
+      void on_reset_device();
 
       void clear();
       ~RenderChain();
@@ -66,7 +66,7 @@ class RenderChain
 
       std::unique_ptr<StateTracker> tracker;
 
-      enum { Textures = 8, TexturesMask = Textures - 1 };
+      enum { Textures = ChainPlan::HistoryTextures, TexturesMask = Textures - 1 };
       struct
       {
          IDirect3DTexture9 *tex[Textures];
@@ -88,6 +88,7 @@ class RenderChain
          std::vector<unsigned> attrib_map;
       };
       std::vector<Pass> passes;
+      std::map<std::string, std::pair<CGprogram, CGprogram>> programs;
 
       struct lut_info
       {
@@ -101,6 +102,8 @@ class RenderChain
       unsigned frame_count;
 
       void create_first_pass(const LinkInfo &info, PixelFormat fmt);
+      void create_pass_resources(Pass &pass);
+      void create_prev_resources();
       void compile_shaders(Pass &pass, const std::string &shader);
 
       void set_vertices(Pass &pass,
@@ -1,8 +1,11 @@
 
 #include "common.h"
+#include "rarch_video_ext.h"
 
 #include <iostream>
 #include <stdexcept>
+#include <cstdlib>
+#include <cstring>
 
 static rarch_video_driver_t video_driver;
 static rarch_input_driver_t input_driver;
@@ -67,7 +70,10 @@ static void* input_init(const int joypad_index[5], float axis_thres)
 {
    try 
    {
-      return new DirectInput(joypad_index, axis_thres);
+      // RARCH_DINPUT_KEYBOARD=raw reads the keyboard through Raw Input.
+      const char *keyboard = std::getenv("RARCH_DINPUT_KEYBOARD");
+      bool raw_keyboard = keyboard && !std::strcmp(keyboard, "raw");
+      return new DirectInput(joypad_index, axis_thres, raw_keyboard);
    }
    catch (const std::exception& e) 
    {
@@ -96,6 +102,12 @@ static void input_poll(void *data)
    reinterpret_cast<DirectInput*>(data)->poll();
 }
 
+RARCH_API_EXPORT int RARCH_API_CALLTYPE rarch_video_read_viewport_ext(void *data,
+      unsigned width, unsigned height, unsigned format, unsigned char *buffer)
+{
+   return reinterpret_cast<D3DVideo*>(data)->read_viewport(buffer, width, height, format);
+}
+
 RARCH_API_EXPORT const rarch_video_driver_t* RARCH_API_CALLTYPE rarch_video_init(void)
 {
    video_driver.init = video_init;
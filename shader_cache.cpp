@@ -0,0 +1,436 @@
+#include "shader_cache.hpp"
+#include "thread.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <stdint.h>
+
+namespace ShaderCache
+{
+   enum { MaxIncludeDepth = 16 };
+
+   bool read_file(const std::string &path, std::string &out)
+   {
+      FILE *file = std::fopen(path.c_str(), "rb");
+      if (!file)
+         return false;
+
+      std::fseek(file, 0, SEEK_END);
+      long len = std::ftell(file);
+      std::rewind(file);
+
+      bool ret = false;
+      if (len >= 0)
+      {
+         out.resize(len);
+         ret = len == 0 || std::fread(&out[0], 1, len, file) == static_cast<size_t>(len);
+      }
+
+      std::fclose(file);
+      return ret;
+   }
+
+   static Mutex preloaded_lock;
+   static std::map<std::string, std::string> preloaded;
+
+   static bool load_source(const std::string &path, std::string &out, bool keep)
+   {
+      {
+         Lock lock(preloaded_lock);
+         auto itr = preloaded.find(path);
+         if (itr != preloaded.end())
+         {
+            out = itr->second;
+            return true;
+         }
+      }
+
+      if (!read_file(path, out))
+         return false;
+
+      if (keep)
+      {
+         Lock lock(preloaded_lock);
+         preloaded[path] = out;
+      }
+      return true;
+   }
+
+   static std::string basedir(const std::string &path)
+   {
+      size_t pos = path.find_last_of("/\\");
+      if (pos == std::string::npos)
+         return "";
+      return path.substr(0, pos + 1);
+   }
+
+   // 64-bit FNV-1a.
+   static void hash(uint64_t &h, const char *data, size_t size)
+   {
+      for (size_t i = 0; i < size; i++)
+      {
+         h ^= static_cast<uint8_t>(data[i]);
+         h *= 0x100000001b3ull;
+      }
+   }
+
+   static void hash(uint64_t &h, const std::string &str)
+   {
+      // Include the terminator so concatenated fields can't alias.
+      hash(h, str.c_str(), str.size() + 1);
+   }
+
+   // Hashes source along with everything it #includes, the way cgc would find it.
+   // Returns false if an include couldn't be read, which disables caching.
+   // If keep is set, includes read from disk are kept as preloaded sources.
+   static bool hash_source(uint64_t &h, const std::string &source,
+         const std::string &dir, unsigned depth, bool keep)
+   {
+      hash(h, source);
+      if (depth >= MaxIncludeDepth)
+         return false;
+
+      size_t pos = 0;
+      while ((pos = source.find("#include", pos)) != std::string::npos)
+      {
+         pos += std::strlen("#include");
+         size_t begin = source.find_first_of("\"<\n", pos);
+         if (begin == std::string::npos || source[begin] == '\n')
+            continue;
+
+         size_t end = source.find_first_of(source[begin] == '"' ? "\"\n" : ">\n", begin + 1);
+         if (end == std::string::npos || source[end] == '\n')
+            continue;
+
+         std::string path = dir + source.substr(begin + 1, end - begin - 1);
+         std::string include;
+         if (!load_source(path, include, keep))
+            return false;
+
+         if (!hash_source(h, include, basedir(path), depth + 1, keep))
+            return false;
+         pos = end;
+      }
+
+      return true;
+   }
+
+   static std::string make_cache_dir()
+   {
+      const char *env = std::getenv("RARCH_D3D9_SHADER_CACHE");
+      std::string dir;
+      if (env && *env)
+         dir = env;
+      else
+      {
+         char tmp[MAX_PATH];
+         DWORD len = GetTempPathA(sizeof(tmp), tmp);
+         if (len == 0 || len > sizeof(tmp))
+            return "";
+         dir = tmp;
+         dir += "retroarch-d3d9-shaders";
+      }
+
+      if (dir[dir.size() - 1] != '/' && dir[dir.size() - 1] != '\\')
+         dir += '\\';
+
+      CreateDirectoryA(dir.c_str(), nullptr);
+      return dir;
+   }
+
+   static const std::string &cache_dir()
+   {
+      static const std::string dir = make_cache_dir();
+      return dir;
+   }
+
+   // dir is where #includes of source are looked up.
+   static bool cache_key(std::string &out,
+         const std::string &source, const std::string &dir,
+         CGprofile profile, const char *entry, const char **opts)
+   {
+      uint64_t h = 0xcbf29ce484222325ull;
+      if (!hash_source(h, source, dir, 0, false))
+         return false;
+
+      hash(h, entry);
+      hash(h, cgGetProfileString(profile));
+      for (const char **opt = opts; opt && *opt; opt++)
+         hash(h, *opt);
+      const char *version = cgGetString(CG_VERSION);
+      hash(h, version ? version : "");
+
+      char name[32];
+      std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(h));
+      out = name;
+      return true;
+   }
+
+   static Mutex memory_lock;
+   static std::map<std::string, std::string> memory;
+
+   static bool in_memory(const std::string &key)
+   {
+      Lock lock(memory_lock);
+      return memory.count(key) != 0;
+   }
+
+   static bool lookup(const std::string &key, std::string &object)
+   {
+      {
+         Lock lock(memory_lock);
+         auto itr = memory.find(key);
+         if (itr != memory.end())
+         {
+            object = itr->second;
+            return true;
+         }
+      }
+
+      const std::string &dir = cache_dir();
+      return !dir.empty() && read_file(dir + key + ".cgo", object);
+   }
+
+   static void store(const std::string &key, const char *compiled)
+   {
+      {
+         Lock lock(memory_lock);
+         memory[key] = compiled;
+      }
+
+      const std::string &dir = cache_dir();
+      if (dir.empty())
+         return;
+
+      // Write to a temporary and rename, so a concurrent reader
+      // never sees a half-written program.
+      std::string path = dir + key + ".cgo";
+      std::string tmp = path + ".tmp";
+      FILE *file = std::fopen(tmp.c_str(), "wb");
+      if (!file)
+         return;
+
+      size_t len = std::strlen(compiled);
+      bool ok = std::fwrite(compiled, 1, len, file) == len;
+      ok = (std::fclose(file) == 0) && ok;
+
+      if (!ok || !MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+         DeleteFileA(tmp.c_str());
+   }
+
+   static Mutex objects_lock;
+   static std::map<std::string, const char*> objects;
+
+   static std::string object_key(const std::string &path,
+         const char *profile, const char *entry)
+   {
+      return path + '|' + entry + '|' + profile;
+   }
+
+   void add_object(const std::string &path, const char *profile,
+         const char *entry, const char *object)
+   {
+      Lock lock(objects_lock);
+      objects[object_key(path, profile, entry)] = object;
+   }
+
+   void drop_objects()
+   {
+      Lock lock(objects_lock);
+      objects.clear();
+   }
+
+   static const char *find_object(const std::string &path,
+         CGprofile profile, const char *entry)
+   {
+      Lock lock(objects_lock);
+      auto itr = objects.find(object_key(path, cgGetProfileString(profile), entry));
+      return itr != objects.end() ? itr->second : nullptr;
+   }
+
+   CGprogram create_program(CGcontext ctx,
+         const std::string &path, const char *source,
+         CGprofile profile, const char *entry, const char **opts)
+   {
+      if (!source)
+      {
+         // Prebuilt objects were compiled without the device's optimal options,
+         // which are only tuning hints.
+         const char *object = find_object(path, profile, entry);
+         if (object)
+         {
+            CGprogram prg = cgCreateProgram(ctx, CG_OBJECT, object, profile, entry, nullptr);
+            if (prg)
+               return prg;
+
+            std::cerr << "[Direct3D Cg]: Ignoring invalid prebuilt " << entry <<
+               " for " << path << std::endl;
+         }
+      }
+
+      // Shaders are read once (or taken from what was preloaded), so the
+      // cache key always describes the exact text that gets compiled.
+      std::string text, dir;
+      if (!source)
+      {
+         if (!load_source(path, text, false))
+         {
+            std::cerr << "[Direct3D Cg]: Failed to read shader: " << path << std::endl;
+            return nullptr;
+         }
+         source = text.c_str();
+         dir = basedir(path);
+      }
+
+      std::string key;
+      bool cacheable = cache_key(key, source, dir, profile, entry, opts);
+
+      std::string object;
+      if (cacheable && lookup(key, object))
+      {
+         CGprogram prg = cgCreateProgram(ctx, CG_OBJECT, object.c_str(), profile, entry, nullptr);
+         if (prg)
+            return prg;
+
+         std::cerr << "[Direct3D Cg]: Ignoring invalid cache entry: " << key << std::endl;
+      }
+
+      // Compiling from memory, so tell cgc where the file's #includes are.
+      std::vector<const char*> args;
+      for (const char **opt = opts; opt && *opt; opt++)
+         args.push_back(*opt);
+      std::string include = "-I" + dir;
+      if (!dir.empty())
+         args.push_back(include.c_str());
+      args.push_back(nullptr);
+
+      CGprogram prg = cgCreateProgram(ctx, CG_SOURCE, source, profile, entry, &args[0]);
+
+      if (cgGetLastListing(ctx))
+         std::cerr << "[Direct3D Cg]: " << entry << " error:" << std::endl <<
+            cgGetLastListing(ctx) << std::endl;
+
+      if (prg && cacheable)
+      {
+         const char *compiled = cgGetProgramString(prg, CG_COMPILED_PROGRAM);
+         if (compiled)
+            store(key, compiled);
+      }
+
+      return prg;
+   }
+
+   void preload(const std::string &path)
+   {
+      uint64_t h = 0;
+      std::string file;
+      if (load_source(path, file, true))
+         hash_source(h, file, basedir(path), 0, true);
+   }
+
+   void drop_preloaded()
+   {
+      Lock lock(preloaded_lock);
+      preloaded.clear();
+   }
+
+   struct Job
+   {
+      std::string path;
+      const Profile *profile;
+      const char *entry;
+   };
+
+   static std::vector<const char*> profile_opts(const Profile &profile)
+   {
+      std::vector<const char*> opts;
+      for (unsigned i = 0; i < profile.opts.size(); i++)
+         opts.push_back(profile.opts[i].c_str());
+      opts.push_back(nullptr);
+      return opts;
+   }
+
+   // Results are only kept for programs with a cache key. Compiling the others
+   // ahead of time would just mean compiling them twice. Programs already in
+   // memory (e.g. precompiled by PresetLoader) need no work at all.
+   static void add_job(std::vector<Job> &jobs, const std::string &path,
+         const Profile &profile, const char *entry)
+   {
+      if (find_object(path, profile.profile, entry))
+         return;
+
+      std::string key, source;
+      std::vector<const char*> opts = profile_opts(profile);
+      if (!load_source(path, source, false) ||
+            !cache_key(key, source, basedir(path), profile.profile, entry, &opts[0]) ||
+            in_memory(key))
+         return;
+
+      Job job = { path, &profile, entry };
+      jobs.push_back(job);
+   }
+
+   void precompile(const std::vector<std::string> &shaders,
+         const Profile &fragment, const Profile &vertex)
+   {
+      std::vector<Job> jobs;
+      std::map<std::string, bool> seen;
+      for (unsigned i = 0; i < shaders.size(); i++)
+      {
+         if (shaders[i].empty() || seen[shaders[i]])
+            continue;
+         seen[shaders[i]] = true;
+
+         add_job(jobs, shaders[i], fragment, "main_fragment");
+         add_job(jobs, shaders[i], vertex, "main_vertex");
+      }
+
+      if (jobs.empty())
+         return;
+
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      unsigned workers = std::min<unsigned>(info.dwNumberOfProcessors, jobs.size());
+      if (workers < 1)
+         workers = 1;
+
+      std::atomic<unsigned> next(0);
+      auto worker = [&]() {
+         // Cg contexts can't be shared between threads,
+         // but separate contexts can compile concurrently.
+         CGcontext ctx = cgCreateContext();
+         if (!ctx)
+            return;
+
+         unsigned i;
+         while ((i = next++) < jobs.size())
+         {
+            const Job &job = jobs[i];
+
+            std::vector<const char*> opts = profile_opts(*job.profile);
+
+            CGprogram prg = create_program(ctx, job.path, nullptr,
+                  job.profile->profile, job.entry, &opts[0]);
+            if (prg)
+               cgDestroyProgram(prg);
+         }
+
+         cgDestroyContext(ctx);
+      };
+
+      std::cerr << "[Direct3D Cg]: Compiling " << jobs.size() <<
+         " programs on " << workers << " threads ..." << std::endl;
+
+      std::vector<std::unique_ptr<Thread>> threads;
+      for (unsigned i = 0; i < workers; i++)
+         threads.push_back(std::unique_ptr<Thread>(new Thread(worker)));
+      threads.clear();
+   }
+}
+
@@ -0,0 +1,62 @@
+#ifndef SHADER_CACHE_HPP__
+#define SHADER_CACHE_HPP__
+
+#include "common.h"
+#include <Cg/cg.h>
+#include <string>
+#include <vector>
+
+// Persistent cache of compiled Cg programs.
+//
+// Programs are keyed on a hash of their source (with #includes resolved),
+// entry point, profile, compiler options and Cg runtime version.
+// The compiled output is stored on disk and loaded back with CG_OBJECT,
+// which skips the Cg compiler entirely.
+//
+// Cache lives in %TEMP%\retroarch-d3d9-shaders,
+// or in RARCH_D3D9_SHADER_CACHE if set.
+// Compiled programs are also kept in memory for the lifetime of the process.
+namespace ShaderCache
+{
+   // Compiler settings, copied out of the Cg runtime so that
+   // they can be used from other threads.
+   struct Profile
+   {
+      CGprofile profile;
+      std::vector<std::string> opts;
+   };
+
+   // Compiles vertex and fragment programs of shaders concurrently,
+   // one Cg context per worker thread.
+   // Results only end up in the cache, so following create_program()
+   // calls for the same programs don't have to invoke the compiler.
+   // Programs which can't be cached (unreadable #includes) are left
+   // for create_program(), programs already in memory are skipped.
+   void precompile(const std::vector<std::string> &shaders,
+         const Profile &fragment, const Profile &vertex);
+
+   // Creates a program in ctx. If source is nullptr, source is read from path.
+   // Returns nullptr if compilation failed.
+   CGprogram create_program(CGcontext ctx,
+         const std::string &path, const char *source,
+         CGprofile profile, const char *entry, const char **opts);
+
+   // Reads a shader and everything it #includes into memory ahead of time,
+   // so that create_program() doesn't have to wait for the disk.
+   void preload(const std::string &path);
+   // Forgets preloaded sources, so later loads see changes on disk.
+   void drop_preloaded();
+
+   // Registers a program compiled ahead of time (e.g. from a shader pack)
+   // for path, profile and entry. create_program() with a null source
+   // creates it directly from object, which must stay valid until
+   // drop_objects() is called.
+   void add_object(const std::string &path, const char *profile,
+         const char *entry, const char *object);
+   void drop_objects();
+
+   bool read_file(const std::string &path, std::string &out);
+}
+
+#endif
+
@@ -0,0 +1,334 @@
+#include "shader_pack.hpp"
+#include "shader_cache.hpp"
+#include "lut_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+// Bytes per texel, or per 4x4 block for block compressed formats.
+// 0 for formats a pack can't hold.
+static unsigned format_bytes(D3DFORMAT format, bool &blocks)
+{
+   blocks = false;
+   switch (format)
+   {
+      case D3DFMT_DXT1:
+         blocks = true;
+         return 8;
+      case D3DFMT_DXT2:
+      case D3DFMT_DXT3:
+      case D3DFMT_DXT4:
+      case D3DFMT_DXT5:
+         blocks = true;
+         return 16;
+
+      case D3DFMT_L8:
+      case D3DFMT_A8:
+      case D3DFMT_A4L4:
+      case D3DFMT_R3G3B2:
+         return 1;
+      case D3DFMT_R5G6B5:
+      case D3DFMT_X1R5G5B5:
+      case D3DFMT_A1R5G5B5:
+      case D3DFMT_A4R4G4B4:
+      case D3DFMT_X4R4G4B4:
+      case D3DFMT_A8R3G3B2:
+      case D3DFMT_A8L8:
+      case D3DFMT_L16:
+      case D3DFMT_R16F:
+         return 2;
+      case D3DFMT_R8G8B8:
+         return 3;
+      case D3DFMT_A8R8G8B8:
+      case D3DFMT_X8R8G8B8:
+      case D3DFMT_A8B8G8R8:
+      case D3DFMT_X8B8G8R8:
+      case D3DFMT_A2R10G10B10:
+      case D3DFMT_A2B10G10R10:
+      case D3DFMT_G16R16:
+      case D3DFMT_G16R16F:
+      case D3DFMT_R32F:
+         return 4;
+      case D3DFMT_A16B16G16R16:
+      case D3DFMT_A16B16G16R16F:
+      case D3DFMT_G32R32F:
+         return 8;
+      case D3DFMT_A32B32G32R32F:
+         return 16;
+
+      default:
+         return 0;
+   }
+}
+
+// Bytes of texels in a row of a level width texels wide, 0 if the format is unknown.
+static unsigned row_bytes(D3DFORMAT format, unsigned width)
+{
+   bool blocks;
+   unsigned bytes = format_bytes(format, blocks);
+   return blocks ? ((width + 3) / 4) * bytes : width * bytes;
+}
+
+static unsigned level_rows(D3DFORMAT format, unsigned height)
+{
+   bool blocks;
+   format_bytes(format, blocks);
+   return blocks ? (height + 3) / 4 : height;
+}
+
+ShaderPack::ShaderPack(const std::string &path)
+   : file(INVALID_HANDLE_VALUE), mapping(nullptr), base(nullptr), size(0)
+{
+   file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+   if (file == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("Failed to open shader pack!");
+
+   LARGE_INTEGER file_size;
+   if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < static_cast<LONGLONG>(sizeof(Pack::Header)) ||
+         file_size.QuadPart > 0x7fffffff)
+   {
+      unmap();
+      throw std::runtime_error("Invalid shader pack size!");
+   }
+   size = file_size.QuadPart;
+
+   mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+   if (mapping)
+      base = reinterpret_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+   if (!base)
+   {
+      unmap();
+      throw std::runtime_error("Failed to map shader pack!");
+   }
+
+   parsed.path = path;
+   parsed.basedir = ShaderPreset::dirname(path);
+
+   try
+   {
+      parse();
+   }
+   catch (...)
+   {
+      ShaderCache::drop_objects();
+      unmap();
+      throw;
+   }
+}
+
+ShaderPack::~ShaderPack()
+{
+   ShaderCache::drop_objects();
+   unmap();
+}
+
+void ShaderPack::unmap()
+{
+   if (base)
+      UnmapViewOfFile(base);
+   if (mapping)
+      CloseHandle(mapping);
+   if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+
+   base = nullptr;
+   mapping = nullptr;
+   file = INVALID_HANDLE_VALUE;
+}
+
+const Pack::Header &ShaderPack::header() const
+{
+   return *reinterpret_cast<const Pack::Header*>(base);
+}
+
+bool ShaderPack::valid(uint32_t offset, uint64_t length) const
+{
+   return offset <= size && length <= size - offset;
+}
+
+const char *ShaderPack::string(uint32_t offset) const
+{
+   if (!offset)
+      return nullptr;
+   if (offset >= size || !std::memchr(base + offset, '\0', size - offset))
+      throw std::runtime_error("Invalid string in shader pack!");
+   return reinterpret_cast<const char*>(base + offset);
+}
+
+template<typename T>
+const T *ShaderPack::table(uint32_t offset, uint32_t count) const
+{
+   if (offset % sizeof(uint32_t) || !valid(offset, static_cast<uint64_t>(count) * sizeof(T)))
+      throw std::runtime_error("Invalid table in shader pack!");
+   return reinterpret_cast<const T*>(base + offset);
+}
+
+const char *ShaderPack::vertex_profile() const
+{
+   return string(header().vertex_profile);
+}
+
+const char *ShaderPack::fragment_profile() const
+{
+   return string(header().fragment_profile);
+}
+
+void ShaderPack::parse()
+{
+   const Pack::Header &head = header();
+   if (std::memcmp(head.magic, Pack::Magic, sizeof(Pack::Magic)) ||
+         head.version != Pack::Version || head.size != size)
+      throw std::runtime_error("Not a shader pack, or built for another version!");
+
+   const char *vertex = vertex_profile();
+   const char *fragment = fragment_profile();
+   if (!vertex || !fragment)
+      throw std::runtime_error("Shader pack lacks profiles!");
+
+   if (head.pass_count < 1)
+      throw std::runtime_error("Must have at least one shader!");
+
+   const Pack::Pass *passes = table<Pack::Pass>(head.passes, head.pass_count);
+   for (uint32_t i = 0; i < head.pass_count; i++)
+   {
+      const Pack::Pass &in = passes[i];
+      const char *shader = string(in.shader);
+      const char *vertex_object = string(in.vertex_object);
+      const char *fragment_object = string(in.fragment_object);
+      if (!shader || !vertex_object || !fragment_object ||
+            in.type_x > ShaderPreset::Absolute || in.type_y > ShaderPreset::Absolute ||
+            in.filter_linear > ShaderPreset::Disabled)
+         throw std::runtime_error("Invalid pass in shader pack!");
+
+      ShaderPreset::Pass pass;
+      pass.shader = parsed.basedir + shader;
+      pass.has_scale = in.has_scale;
+      pass.type_x = static_cast<ShaderPreset::ScaleType>(in.type_x);
+      pass.type_y = static_cast<ShaderPreset::ScaleType>(in.type_y);
+      pass.scale_x = in.scale_x;
+      pass.scale_y = in.scale_y;
+      pass.abs_x = in.abs_x;
+      pass.abs_y = in.abs_y;
+      pass.filter_linear = static_cast<ShaderPreset::Option>(in.filter_linear);
+      parsed.passes.push_back(pass);
+
+      ShaderCache::add_object(pass.shader, vertex, "main_vertex", vertex_object);
+      ShaderCache::add_object(pass.shader, fragment, "main_fragment", fragment_object);
+   }
+
+   const Pack::Lut *luts = table<Pack::Lut>(head.luts, head.lut_count);
+   for (uint32_t i = 0; i < head.lut_count; i++)
+   {
+      const Pack::Lut &in = luts[i];
+      const char *id = string(in.id);
+      const char *source = string(in.path);
+      if (!id || !source || !valid_lut(in))
+         throw std::runtime_error("Invalid LUT in shader pack!");
+
+      ShaderPreset::Lut lut;
+      lut.id = id;
+      lut.path = parsed.basedir + source;
+      lut.filter_linear = in.filter_linear;
+      lut.compress = in.compress ? ShaderPreset::Enabled : ShaderPreset::Disabled;
+      parsed.luts.push_back(lut);
+   }
+
+   if (head.import_count)
+   {
+      const char *script = string(head.import_script);
+      const char *script_class = string(head.import_script_class);
+      if (!script || !script_class)
+         throw std::runtime_error("Invalid imports in shader pack!");
+
+      parsed.import_script = parsed.basedir + script;
+      parsed.import_script_class = script_class;
+
+      const uint32_t *imports = table<uint32_t>(head.imports, head.import_count);
+      for (uint32_t i = 0; i < head.import_count; i++)
+      {
+         const char *import = string(imports[i]);
+         if (!import)
+            throw std::runtime_error("Invalid imports in shader pack!");
+         parsed.imports.push_back(import);
+      }
+   }
+}
+
+// Checks the mip chain against the size and format,
+// so create_texture() never reads past the texels of a level.
+bool ShaderPack::valid_lut(const Pack::Lut &lut) const
+{
+   D3DFORMAT format = static_cast<D3DFORMAT>(lut.format);
+   bool blocks;
+   if (!format_bytes(format, blocks) || !lut.width || !lut.height ||
+         lut.width > 16384 || lut.height > 16384)
+      return false;
+
+   // D3D9 wants the top level of block compressed textures in whole blocks.
+   if (blocks && ((lut.width & 3) || (lut.height & 3)))
+      return false;
+
+   unsigned max_levels = 1;
+   while ((std::max(lut.width, lut.height) >> max_levels) > 0)
+      max_levels++;
+   if (!lut.level_count || lut.level_count > max_levels)
+      return false;
+
+   const Pack::Level *levels = table<Pack::Level>(lut.levels, lut.level_count);
+   for (uint32_t i = 0; i < lut.level_count; i++)
+   {
+      const Pack::Level &level = levels[i];
+      unsigned width = std::max(lut.width >> i, 1u);
+      unsigned height = std::max(lut.height >> i, 1u);
+      if (level.rows != level_rows(format, height) || level.pitch < row_bytes(format, width) ||
+            !valid(level.texels, static_cast<uint64_t>(level.pitch) * level.rows))
+         return false;
+   }
+
+   return true;
+}
+
+IDirect3DTexture9 *ShaderPack::create_texture(IDirect3DDevice9 *dev, unsigned index) const
+{
+   const Pack::Lut &lut = table<Pack::Lut>(header().luts, header().lut_count)[index];
+   const Pack::Level *levels = table<Pack::Level>(lut.levels, lut.level_count);
+
+   // Packs hold DXT textures even for devices without them.
+   D3DFORMAT format = static_cast<D3DFORMAT>(lut.format);
+   if (!LutCache::supports_format(dev, format))
+      return nullptr;
+
+   IDirect3DTexture9 *tex;
+   if (FAILED(dev->CreateTexture(lut.width, lut.height, lut.level_count,
+               0, format, D3DPOOL_MANAGED, &tex, nullptr)))
+      return nullptr;
+
+   for (unsigned i = 0; i < lut.level_count; i++)
+   {
+      D3DSURFACE_DESC desc;
+      D3DLOCKED_RECT rect;
+      if (FAILED(tex->GetLevelDesc(i, &desc)) || FAILED(tex->LockRect(i, &rect, nullptr, 0)))
+      {
+         tex->Release();
+         return nullptr;
+      }
+
+      // parse() checked the levels against the size we asked for,
+      // but never write more than the level we got.
+      const Pack::Level &level = levels[i];
+      unsigned rows = std::min(level.rows, level_rows(format, desc.Height));
+      unsigned bytes = std::min<unsigned>(row_bytes(format, desc.Width), rect.Pitch);
+      bytes = std::min<unsigned>(bytes, level.pitch);
+      for (unsigned y = 0; y < rows; y++)
+      {
+         std::memcpy(reinterpret_cast<uint8_t*>(rect.pBits) + y * rect.Pitch,
+               base + level.texels + y * level.pitch, bytes);
+      }
+      tex->UnlockRect(i);
+   }
+
+   return tex;
+}
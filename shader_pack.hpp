@@ -0,0 +1,58 @@
+#ifndef SHADER_PACK_HPP__
+#define SHADER_PACK_HPP__
+
+#include "common.h"
+#include "shader_preset.hpp"
+#include "shader_pack_format.hpp"
+#include <string>
+
+// A shader pack built by tools/shader_packer, see shader_pack_format.hpp.
+//
+// The file stays memory mapped for as long as the pack lives.
+// Its compiled programs are registered with ShaderCache, so building the
+// chain creates them straight from the mapping without compiling anything
+// (as long as the device wants the profiles the pack was built for).
+// LUT textures are filled straight from the mapped texels, or loaded from
+// their source image if the device can't use the packed format.
+class ShaderPack
+{
+   public:
+      // Throws std::runtime_error if the file can't be mapped or is malformed.
+      explicit ShaderPack(const std::string &path);
+      ~ShaderPack();
+
+      ShaderPack(const ShaderPack&) = delete;
+      void operator=(const ShaderPack&) = delete;
+
+      // Shader and script paths are resolved against the pack's directory.
+      const ShaderPreset &preset() const { return parsed; }
+
+      const char *vertex_profile() const;
+      const char *fragment_profile() const;
+
+      // Creates a managed texture for preset().luts[index].
+      // Returns nullptr if the device can't create it, e.g. lacks the
+      // (compressed) format. The LUT's path is then the source image.
+      IDirect3DTexture9 *create_texture(IDirect3DDevice9 *dev, unsigned index) const;
+
+   private:
+      HANDLE file;
+      HANDLE mapping;
+      const uint8_t *base;
+      size_t size;
+
+      ShaderPreset parsed;
+
+      const Pack::Header &header() const;
+      const char *string(uint32_t offset) const;
+      bool valid(uint32_t offset, uint64_t length) const;
+      template<typename T>
+      const T *table(uint32_t offset, uint32_t count) const;
+      bool valid_lut(const Pack::Lut &lut) const;
+
+      void parse();
+      void unmap();
+};
+
+#endif
+
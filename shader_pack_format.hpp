@@ -0,0 +1,82 @@
+#ifndef SHADER_PACK_FORMAT_HPP__
+#define SHADER_PACK_FORMAT_HPP__
+
+#include <stdint.h>
+
+// On-disk layout of a shader pack (.cgpack), written by tools/shader_packer
+// and memory mapped by ShaderPack.
+//
+// A pack holds a parsed preset, the compiled Cg programs of every pass for
+// one vertex and one fragment profile, and the LUTs as texels in their final
+// D3DFORMAT with the whole mip chain, so loading one needs neither the Cg
+// compiler nor an image decoder.
+//
+// Everything is little endian. Offsets are from the start of the file.
+// Strings are NUL terminated, offset 0 means no string.
+// Texel data is aligned to PackAlignment.
+namespace Pack
+{
+   static const char Magic[8] = { 'R', 'A', 'D', '3', 'D', 'P', 'K', '\0' };
+   enum { Version = 2, PackAlignment = 16 };
+
+   struct Header
+   {
+      char magic[8];
+      uint32_t version;
+      uint32_t size; // Of the whole file.
+
+      uint32_t vertex_profile; // Profile names, as in cgGetProfileString().
+      uint32_t fragment_profile;
+
+      uint32_t pass_count;
+      uint32_t passes; // Pass[pass_count]
+      uint32_t lut_count;
+      uint32_t luts; // Lut[lut_count]
+
+      uint32_t import_script; // Relative to the pack.
+      uint32_t import_script_class;
+      uint32_t import_count;
+      uint32_t imports; // uint32_t[import_count], string offsets.
+   };
+
+   struct Pass
+   {
+      uint32_t shader; // Path relative to the pack, identifies the programs.
+      uint32_t vertex_object; // Compiled programs, for CG_OBJECT.
+      uint32_t fragment_object;
+
+      uint32_t has_scale;
+      uint32_t type_x, type_y; // ShaderPreset::ScaleType
+      float scale_x, scale_y;
+      uint32_t abs_x, abs_y;
+      uint32_t filter_linear; // ShaderPreset::Option
+   };
+
+   // Levels are in the usual mip chain order, each half the size of the
+   // previous one (at least 1). rows and pitch must match the format and
+   // that size, pitch can be padded.
+   struct Level
+   {
+      uint32_t pitch; // Bytes per row (of blocks for DXT formats).
+      uint32_t rows;
+      uint32_t texels;
+   };
+
+   struct Lut
+   {
+      uint32_t id;
+      uint32_t filter_linear;
+      uint32_t format; // D3DFORMAT
+      uint32_t width, height;
+      uint32_t level_count;
+      uint32_t levels; // Level[level_count]
+
+      // Source image, relative to the pack, and whether the packer was asked
+      // to compress it. Loaded instead if the device can't use the texels.
+      uint32_t path;
+      uint32_t compress;
+   };
+}
+
+#endif
+
@@ -0,0 +1,192 @@
+#include "shader_preset.hpp"
+#include "config_file.hpp"
+
+#include <stdexcept>
+#include <cstdio>
+
+// Splits on ';', skipping empty elements.
+static std::vector<std::string> tokenize(const std::string &str)
+{
+   std::vector<std::string> list;
+   size_t pos = 0;
+   while (pos < str.size())
+   {
+      size_t end = str.find(';', pos);
+      if (end == std::string::npos)
+         end = str.size();
+      if (end > pos)
+         list.push_back(str.substr(pos, end - pos));
+      pos = end + 1;
+   }
+   return list;
+}
+
+static ShaderPreset::ScaleType parse_scale_type(const std::string &type, const char *axis)
+{
+   if (type == "source")
+      return ShaderPreset::Source;
+   else if (type == "viewport")
+      return ShaderPreset::Viewport;
+   else if (type == "absolute")
+      return ShaderPreset::Absolute;
+   else
+      throw std::runtime_error(std::string("Invalid scale_type_") + axis + "!");
+}
+
+static ShaderPreset::Option get_option(ConfigFile &conf, const std::string &key)
+{
+   bool val;
+   if (!conf.get(key, val))
+      return ShaderPreset::Default;
+   return val ? ShaderPreset::Enabled : ShaderPreset::Disabled;
+}
+
+static ShaderPreset::Pass parse_pass(ConfigFile &conf, const std::string &basedir, int i)
+{
+   char key[64];
+   ShaderPreset::Pass pass;
+
+   std::snprintf(key, sizeof(key), "shader%d", i);
+   std::string relpath;
+   if (!conf.get(key, relpath))
+      throw std::runtime_error("Couldn't locate shader path in meta-shader");
+   pass.shader = basedir + relpath;
+
+   std::string type_x = "source";
+   std::string type_y = "source";
+   pass.has_scale = false;
+
+   std::snprintf(key, sizeof(key), "scale_type%d", i);
+   std::string type;
+   if (conf.get(key, type))
+   {
+      type_x = type_y = type;
+      pass.has_scale = true;
+   }
+   else
+   {
+      std::snprintf(key, sizeof(key), "scale_type_x%d", i);
+      if (conf.get(key, type_x))
+         pass.has_scale = true;
+      std::snprintf(key, sizeof(key), "scale_type_y%d", i);
+      if (conf.get(key, type_y))
+         pass.has_scale = true;
+   }
+
+   pass.type_x = parse_scale_type(type_x, "x");
+   pass.type_y = parse_scale_type(type_y, "y");
+
+   // scaleN is read both as a factor and as an absolute size,
+   // which one applies depends on the scale type.
+   double scale_x = 1.0, scale_y = 1.0;
+   int abs_x = 0, abs_y = 0;
+
+   char key_x[64], key_y[64];
+   std::snprintf(key, sizeof(key), "scale%d", i);
+   std::snprintf(key_x, sizeof(key_x), "scale_x%d", i);
+   std::snprintf(key_y, sizeof(key_y), "scale_y%d", i);
+
+   double scale;
+   if (conf.get(key, scale))
+      scale_x = scale_y = scale;
+   else
+   {
+      conf.get(key_x, scale_x);
+      conf.get(key_y, scale_y);
+   }
+
+   int absolute;
+   if (conf.get(key, absolute))
+      abs_x = abs_y = absolute;
+   else
+   {
+      conf.get(key_x, abs_x);
+      conf.get(key_y, abs_y);
+   }
+
+   pass.scale_x = scale_x;
+   pass.scale_y = scale_y;
+   pass.abs_x = abs_x > 0 ? abs_x : 0;
+   pass.abs_y = abs_y > 0 ? abs_y : 0;
+
+   std::snprintf(key, sizeof(key), "filter_linear%d", i);
+   pass.filter_linear = get_option(conf, key);
+
+   return pass;
+}
+
+ShaderPreset::ShaderPreset(const std::string &path)
+   : path(path), basedir(dirname(path))
+{
+   ConfigFile conf(path);
+
+   int shaders;
+   if (!conf.get("shaders", shaders))
+      throw std::runtime_error("Couldn't find \"shaders\" in meta-shader");
+
+   if (shaders < 1)
+      throw std::runtime_error("Must have at least one shader!");
+
+   for (int i = 0; i < shaders; i++)
+      passes.push_back(parse_pass(conf, basedir, i));
+
+   std::string textures;
+   if (conf.get("textures", textures))
+   {
+      std::vector<std::string> ids = tokenize(textures);
+      for (unsigned i = 0; i < ids.size(); i++)
+      {
+         Lut lut;
+         lut.id = ids[i];
+
+         std::string relpath;
+         if (!conf.get(lut.id, relpath))
+            throw std::runtime_error("Failed to get LUT texture path!");
+         lut.path = basedir + relpath;
+
+         lut.filter_linear = true;
+         conf.get(lut.id + "_filter", lut.filter_linear);
+         lut.compress = get_option(conf, lut.id + "_compress");
+
+         luts.push_back(lut);
+      }
+   }
+
+   std::string import_list;
+   if (conf.get("imports", import_list))
+   {
+      imports = tokenize(import_list);
+
+      std::string script;
+      if (!conf.get("import_script", script))
+         throw std::runtime_error("Didn't find import_script!");
+      import_script = basedir + script;
+
+      if (!conf.get("import_script_class", import_script_class))
+         throw std::runtime_error("Didn't find import_script_class!");
+   }
+}
+
+std::vector<std::string> ShaderPreset::shader_paths() const
+{
+   std::vector<std::string> paths;
+   for (unsigned i = 0; i < passes.size(); i++)
+      paths.push_back(passes[i].shader);
+   return paths;
+}
+
+std::vector<std::string> ShaderPreset::lut_paths() const
+{
+   std::vector<std::string> paths;
+   for (unsigned i = 0; i < luts.size(); i++)
+      paths.push_back(luts[i].path);
+   return paths;
+}
+
+std::string ShaderPreset::dirname(const std::string &path)
+{
+   size_t pos = path.find_last_of("/\\");
+   if (pos == std::string::npos)
+      return "";
+   return path.substr(0, pos + 1);
+}
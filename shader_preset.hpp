@@ -0,0 +1,65 @@
+#ifndef SHADER_PRESET_HPP__
+#define SHADER_PRESET_HPP__
+
+#include <string>
+#include <vector>
+
+// A .cgp preset, parsed and validated once.
+//
+// Holds everything the render chain needs from the file, so that
+// restores and rebuilds don't have to touch the config again.
+// Paths are resolved against the directory of the preset.
+// Doesn't depend on Direct3D or Windows.
+struct ShaderPreset
+{
+   enum ScaleType { Source, Viewport, Absolute };
+   // Settings which fall back to a driver or environment default.
+   enum Option { Default, Enabled, Disabled };
+
+   struct Pass
+   {
+      std::string shader;
+
+      // Whether scale_type was given at all, which decides
+      // how the chain treats the first and last pass.
+      bool has_scale;
+      ScaleType type_x, type_y;
+      float scale_x, scale_y;
+      // Absolute size, 0 if not given.
+      unsigned abs_x, abs_y;
+
+      Option filter_linear;
+   };
+
+   struct Lut
+   {
+      std::string id;
+      std::string path;
+      bool filter_linear;
+      Option compress;
+   };
+
+   // Throws std::runtime_error if the preset can't be read or is invalid.
+   explicit ShaderPreset(const std::string &path);
+   // Empty preset, for callers that fill it in themselves.
+   ShaderPreset() {}
+
+   std::string path;
+   std::string basedir;
+
+   std::vector<Pass> passes;
+   std::vector<Lut> luts;
+
+   // State tracker, only set if imports is non-empty.
+   std::string import_script;
+   std::string import_script_class;
+   std::vector<std::string> imports;
+
+   std::vector<std::string> shader_paths() const;
+   std::vector<std::string> lut_paths() const;
+
+   static std::string dirname(const std::string &path);
+};
+
+#endif
+
@@ -0,0 +1,64 @@
+#include "swizzle.hpp"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#define HAVE_SSSE3_KERNEL
+#endif
+
+namespace Swizzle
+{
+   // Converts four pixels at a time into three 32-bit words,
+   // which avoids most of the byte stores.
+   static void xrgb8888_to_bgr888_c(uint8_t *dst, const uint32_t *src, unsigned width)
+   {
+      unsigned x = 0;
+      for (; x + 4 <= width; x += 4, src += 4, dst += 12)
+      {
+         uint32_t a = src[0] & 0xffffff;
+         uint32_t b = src[1] & 0xffffff;
+         uint32_t c = src[2] & 0xffffff;
+         uint32_t d = src[3] & 0xffffff;
+
+         uint32_t out[3] = {
+            a | (b << 24),
+            (b >> 8) | (c << 16),
+            (c >> 16) | (d << 8),
+         };
+         std::memcpy(dst, out, sizeof(out));
+      }
+
+      for (; x < width; x++, src++)
+      {
+         *dst++ = (*src >>  0) & 0xff;
+         *dst++ = (*src >>  8) & 0xff;
+         *dst++ = (*src >> 16) & 0xff;
+      }
+   }
+
+   static bool has_ssse3()
+   {
+#ifdef HAVE_SSSE3_KERNEL
+      unsigned eax, ebx, ecx, edx;
+      if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+         return false;
+      return ecx & bit_SSSE3;
+#else
+      return false;
+#endif
+   }
+
+   void xrgb8888_to_bgr888(uint8_t *dst, const uint32_t *src, unsigned width)
+   {
+      static const bool ssse3 = has_ssse3();
+#ifdef HAVE_SSSE3_KERNEL
+      if (ssse3)
+      {
+         xrgb8888_to_bgr888_ssse3(dst, src, width);
+         return;
+      }
+#endif
+      xrgb8888_to_bgr888_c(dst, src, width);
+   }
+}
+
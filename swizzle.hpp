@@ -0,0 +1,19 @@
+#ifndef SWIZZLE_HPP__
+#define SWIZZLE_HPP__
+
+#include <stdint.h>
+
+// Pixel format conversion for readback.
+namespace Swizzle
+{
+   // Converts a row of XRGB8888 pixels to tightly packed BGR888.
+   // Picks the fastest kernel the CPU supports.
+   void xrgb8888_to_bgr888(uint8_t *dst, const uint32_t *src, unsigned width);
+
+   // SSSE3 kernel, only call this if the CPU supports it.
+   // Lives in its own translation unit, which is built with -mssse3.
+   void xrgb8888_to_bgr888_ssse3(uint8_t *dst, const uint32_t *src, unsigned width);
+}
+
+#endif
+
@@ -0,0 +1,38 @@
+#include "swizzle.hpp"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <tmmintrin.h>
+
+namespace Swizzle
+{
+   // 16 pixels per iteration: each group of four is packed into
+   // 12 bytes with pshufb, then the four groups are merged into
+   // three full 16 byte stores.
+   void xrgb8888_to_bgr888_ssse3(uint8_t *dst, const uint32_t *src, unsigned width)
+   {
+      const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+            -1, -1, -1, -1);
+
+      unsigned x = 0;
+      for (; x + 16 <= width; x += 16, src += 16, dst += 48)
+      {
+         __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src +  0)), pack);
+         __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src +  4)), pack);
+         __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src +  8)), pack);
+         __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 12)), pack);
+
+         _mm_storeu_si128((__m128i*)(dst +  0), _mm_or_si128(a, _mm_slli_si128(b, 12)));
+         _mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+         _mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+      }
+
+      for (; x < width; x++, src++)
+      {
+         *dst++ = (*src >>  0) & 0xff;
+         *dst++ = (*src >>  8) & 0xff;
+         *dst++ = (*src >> 16) & 0xff;
+      }
+   }
+}
+#endif
+
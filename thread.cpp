@@ -0,0 +1,39 @@
+#include "thread.hpp"
+#include <stdexcept>
+
+Thread::Thread(const std::function<void ()> &func)
+   : handle(nullptr), func(func)
+{
+   handle = CreateThread(nullptr, 0, entry, this, 0, nullptr);
+   if (!handle)
+      throw std::runtime_error("Failed to create thread!");
+}
+
+Thread::~Thread()
+{
+   join();
+}
+
+void Thread::join()
+{
+   if (handle)
+   {
+      WaitForSingleObject(handle, INFINITE);
+      CloseHandle(handle);
+      handle = nullptr;
+   }
+}
+
+Event::Event()
+{
+   handle = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+   if (!handle)
+      throw std::runtime_error("Failed to create event!");
+}
+
+DWORD WINAPI Thread::entry(void *data)
+{
+   reinterpret_cast<Thread*>(data)->func();
+   return 0;
+}
+
@@ -0,0 +1,81 @@
+#ifndef THREAD_HPP__
+#define THREAD_HPP__
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <functional>
+
+// Thin wrappers around Win32 threading primitives.
+// std::thread and friends aren't reliably available with MinGW.
+// Only needs <windows.h>, not the D3D headers behind common.h,
+// so code built on it can be tested without them.
+
+class Thread
+{
+   public:
+      Thread(const std::function<void ()> &func);
+      ~Thread();
+
+      Thread(const Thread&) = delete;
+      void operator=(const Thread&) = delete;
+
+      void join();
+
+   private:
+      HANDLE handle;
+      std::function<void ()> func;
+
+      static DWORD WINAPI entry(void *data);
+};
+
+class Mutex
+{
+   public:
+      Mutex() { InitializeCriticalSection(&cs); }
+      ~Mutex() { DeleteCriticalSection(&cs); }
+
+      Mutex(const Mutex&) = delete;
+      void operator=(const Mutex&) = delete;
+
+      void lock() { EnterCriticalSection(&cs); }
+      void unlock() { LeaveCriticalSection(&cs); }
+
+   private:
+      CRITICAL_SECTION cs;
+};
+
+// Auto-reset event.
+class Event
+{
+   public:
+      Event();
+      ~Event() { CloseHandle(handle); }
+
+      Event(const Event&) = delete;
+      void operator=(const Event&) = delete;
+
+      void signal() { SetEvent(handle); }
+      // Returns false on timeout.
+      bool wait(DWORD ms = INFINITE) { return WaitForSingleObject(handle, ms) == WAIT_OBJECT_0; }
+
+   private:
+      HANDLE handle;
+};
+
+class Lock
+{
+   public:
+      Lock(Mutex &mutex) : mutex(mutex) { mutex.lock(); }
+      ~Lock() { mutex.unlock(); }
+
+      Lock(const Lock&) = delete;
+      void operator=(const Lock&) = delete;
+
+   private:
+      Mutex &mutex;
+};
+
+#endif
+
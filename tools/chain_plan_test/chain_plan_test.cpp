@@ -0,0 +1,216 @@
+// Pins the links ChainPlan::plan() makes out of small .cgp presets,
+// so changes to the planning show up without a device.
+//
+// Run with "make check". Exits with 0 if everything passed.
+
+#include "../../chain_plan.hpp"
+#include "../../shader_preset.hpp"
+#include "check.hpp"
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+static std::string dir;
+static std::vector<std::string> written;
+
+// Input scale 1 (256x256 input textures), 1280x960 viewport.
+enum { InputScale = 1, ViewportWidth = 1280, ViewportHeight = 960 };
+
+static std::vector<LinkInfo> plan(const char *name, const char *cgp, bool smooth = false)
+{
+   std::string path = dir + "/" + name;
+   FILE *file = std::fopen(path.c_str(), "w");
+   CHECK(file);
+   if (file)
+   {
+      std::fputs(cgp, file);
+      std::fclose(file);
+   }
+   written.push_back(path);
+
+   try
+   {
+      ShaderPreset preset(path);
+      return ChainPlan::plan(preset, InputScale, smooth, ViewportWidth, ViewportHeight);
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << name << ": " << e.what() << std::endl;
+      Global::failures++;
+      return std::vector<LinkInfo>();
+   }
+}
+
+static LinkInfo link(const char *shader, unsigned tex_w, unsigned tex_h,
+      LinkInfo::ScaleType type_x, float scale_x, unsigned abs_x,
+      LinkInfo::ScaleType type_y, float scale_y, unsigned abs_y,
+      bool filter_linear)
+{
+   LinkInfo link = {0};
+   link.shader_path = *shader ? dir + "/" + shader : "";
+   link.tex_w = tex_w;
+   link.tex_h = tex_h;
+   link.scale_type_x = type_x;
+   link.scale_x = scale_x;
+   link.abs_x = abs_x;
+   link.scale_type_y = type_y;
+   link.scale_y = scale_y;
+   link.abs_y = abs_y;
+   link.filter_linear = filter_linear;
+   return link;
+}
+
+static void print(const LinkInfo &link)
+{
+   std::cerr << "    \"" << link.shader_path << "\" tex " << link.tex_w << "x" << link.tex_h <<
+      ", x type " << link.scale_type_x << " scale " << link.scale_x << " abs " << link.abs_x <<
+      ", y type " << link.scale_type_y << " scale " << link.scale_y << " abs " << link.abs_y <<
+      ", linear " << link.filter_linear << std::endl;
+}
+
+static void check_links(const char *name,
+      const std::vector<LinkInfo> &links, const std::vector<LinkInfo> &expected)
+{
+   bool same = links.size() == expected.size();
+   for (unsigned i = 0; same && i < links.size(); i++)
+   {
+      const LinkInfo &a = links[i], &b = expected[i];
+      same = a.shader_path == b.shader_path &&
+         a.tex_w == b.tex_w && a.tex_h == b.tex_h &&
+         a.scale_type_x == b.scale_type_x && a.scale_x == b.scale_x && a.abs_x == b.abs_x &&
+         a.scale_type_y == b.scale_type_y && a.scale_y == b.scale_y && a.abs_y == b.abs_y &&
+         a.filter_linear == b.filter_linear;
+   }
+
+   CHECK(same);
+   if (same)
+      return;
+
+   std::cerr << "  " << name << ", got:" << std::endl;
+   for (unsigned i = 0; i < links.size(); i++)
+      print(links[i]);
+   std::cerr << "  Expected:" << std::endl;
+   for (unsigned i = 0; i < expected.size(); i++)
+      print(expected[i]);
+}
+
+static const LinkInfo::ScaleType Relative = LinkInfo::Relative;
+static const LinkInfo::ScaleType Absolute = LinkInfo::Absolute;
+static const LinkInfo::ScaleType Viewport = LinkInfo::Viewport;
+
+// A single pass without a scale renders straight to the viewport.
+static void test_first_pass_only()
+{
+   check_links("first pass only",
+         plan("single.cgp",
+            "shaders = 1\n"
+            "shader0 = a.cg\n"
+            "filter_linear0 = true\n"),
+         {
+            link("a.cg", 256, 256, Viewport, 1.0f, 256, Viewport, 1.0f, 256, true),
+         });
+
+   // Without scales, the first pass keeps the source size
+   // and the last one goes to the viewport.
+   check_links("no scales",
+         plan("unscaled.cgp",
+            "shaders = 2\n"
+            "shader0 = a.cg\n"
+            "shader1 = b.cg\n"),
+         {
+            link("a.cg", 256, 256, Relative, 1.0f, 256, Relative, 1.0f, 256, false),
+            link("b.cg", 256, 256, Viewport, 1.0f, 256, Viewport, 1.0f, 256, false),
+         });
+}
+
+// A scaled last pass gets a stock pass after it, filtered like the driver's
+// smooth setting, to bring its output to the viewport.
+static void test_extra_pass()
+{
+   check_links("extra pass",
+         plan("extra.cgp",
+            "shaders = 2\n"
+            "shader0 = a.cg\n"
+            "scale_type0 = source\n"
+            "scale0 = 2.0\n"
+            "shader1 = b.cg\n"
+            "scale_type1 = source\n"
+            "scale1 = 1.5\n"
+            "filter_linear1 = false\n",
+            true),
+         {
+            // scaleN also reads as an absolute size, unused for these types.
+            link("a.cg", 256, 256, Relative, 2.0f, 2, Relative, 2.0f, 2, true),
+            link("b.cg", 512, 512, Relative, 1.5f, 1, Relative, 1.5f, 1, false),
+            link("", 1024, 1024, Viewport, 1.0f, 1, Viewport, 1.0f, 1, true),
+         });
+}
+
+// Each axis follows its own scale type.
+static void test_mixed_axes()
+{
+   check_links("mixed axes",
+         plan("mixed.cgp",
+            "shaders = 2\n"
+            "shader0 = a.cg\n"
+            "scale_type_x0 = absolute\n"
+            "scale_x0 = 320\n"
+            "scale_type_y0 = viewport\n"
+            "scale_y0 = 0.5\n"
+            "shader1 = b.cg\n"),
+         {
+            link("a.cg", 256, 256, Absolute, 320.0f, 320, Viewport, 0.5f, 256, false),
+            link("b.cg", 512, 512, Viewport, 1.0f, 256, Viewport, 1.0f, 256, false),
+         });
+}
+
+// Every pass renders at its own absolute size. The old planner sized
+// every later pass from pass 0's.
+static void test_absolute_per_pass()
+{
+   check_links("absolute per pass",
+         plan("absolute.cgp",
+            "shaders = 3\n"
+            "shader0 = a.cg\n"
+            "scale_type0 = absolute\n"
+            "scale_x0 = 100\n"
+            "scale_y0 = 50\n"
+            "shader1 = b.cg\n"
+            "scale_type1 = absolute\n"
+            "scale1 = 300\n"
+            "shader2 = c.cg\n"
+            "scale_type2 = absolute\n"
+            "scale_x2 = 40\n"
+            "scale_y2 = 30\n"),
+         {
+            link("a.cg", 256, 256, Absolute, 100.0f, 100, Absolute, 50.0f, 50, false),
+            link("b.cg", 128, 64, Absolute, 300.0f, 300, Absolute, 300.0f, 300, false),
+            link("c.cg", 512, 512, Absolute, 40.0f, 40, Absolute, 30.0f, 30, false),
+            link("", 64, 32, Viewport, 1.0f, 40, Viewport, 1.0f, 30, false),
+         });
+}
+
+int main()
+{
+   char tmp[] = "/tmp/chain_plan_test.XXXXXX";
+   if (!mkdtemp(tmp))
+   {
+      std::cerr << "Failed to create temporary directory." << std::endl;
+      return 1;
+   }
+   dir = tmp;
+
+   test_first_pass_only();
+   test_extra_pass();
+   test_mixed_axes();
+   test_absolute_per_pass();
+
+   for (unsigned i = 0; i < written.size(); i++)
+      std::remove(written[i].c_str());
+   rmdir(tmp);
+
+   return report_checks();
+}
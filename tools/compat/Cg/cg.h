@@ -0,0 +1,11 @@
+#ifndef COMPAT_CG_H__
+#define COMPAT_CG_H__
+
+// Stands in for <Cg/cg.h> when testing parts of the driver on Linux.
+// Only the handle types, nothing is ever compiled.
+
+typedef struct _CGcontext *CGcontext;
+typedef struct _CGprogram *CGprogram;
+
+#endif
+
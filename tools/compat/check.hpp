@@ -0,0 +1,59 @@
+#ifndef COMPAT_CHECK_HPP__
+#define COMPAT_CHECK_HPP__
+
+// Shared by the test harnesses under tools/.
+// CHECK() logs failed conditions and keeps going,
+// main() returns report_checks() at the end.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace Global
+{
+   static unsigned failures;
+}
+
+#define CHECK(cond) do { \
+   if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": Check failed: " #cond << std::endl; \
+      Global::failures++; \
+   } \
+} while (0)
+
+// Captures what is logged to std::cerr between construction and log().
+struct LogCapture
+{
+   LogCapture() : old(std::cerr.rdbuf(stream.rdbuf())) {}
+   ~LogCapture() { restore(); }
+
+   void restore()
+   {
+      if (old)
+         std::cerr.rdbuf(old);
+      old = nullptr;
+   }
+
+   std::string log()
+   {
+      restore();
+      return stream.str();
+   }
+
+   std::ostringstream stream;
+   std::streambuf *old;
+};
+
+static inline int report_checks()
+{
+   if (Global::failures)
+   {
+      std::cerr << Global::failures << " checks failed." << std::endl;
+      return 1;
+   }
+
+   std::cerr << "All checks passed." << std::endl;
+   return 0;
+}
+
+#endif
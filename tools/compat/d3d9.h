@@ -0,0 +1,38 @@
+#ifndef COMPAT_D3D9_H__
+#define COMPAT_D3D9_H__
+
+// Stands in for <d3d9.h> when testing parts of the driver on Linux.
+// Only what those parts call is declared, each test defines the methods
+// to mock the device.
+
+#include <windows.h>
+
+enum D3DQUERYTYPE { D3DQUERYTYPE_EVENT = 8 };
+#define D3DISSUE_END (1 << 0)
+#define D3DGETDATA_FLUSH (1 << 0)
+
+struct D3DVIEWPORT9
+{
+   DWORD X, Y;
+   DWORD Width, Height;
+   float MinZ, MaxZ;
+};
+
+// Only passed around by pointer.
+struct IDirect3DSurface9;
+struct IDirect3DTexture9;
+
+struct IDirect3DQuery9
+{
+   HRESULT Issue(DWORD flags);
+   HRESULT GetData(void *data, DWORD size, DWORD flags);
+   ULONG Release();
+};
+
+struct IDirect3DDevice9
+{
+   HRESULT CreateQuery(D3DQUERYTYPE type, IDirect3DQuery9 **query);
+};
+
+#endif
+
@@ -0,0 +1,173 @@
+#ifndef COMPAT_WINDOWS_H__
+#define COMPAT_WINDOWS_H__
+
+// Stands in for <windows.h> when testing parts of the driver on Linux.
+// The threading calls thread.hpp uses are implemented on top of pthreads.
+// Clocks are only declared, each test defines them, usually as mocks.
+
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+typedef uint32_t DWORD;
+typedef unsigned long ULONG;
+typedef int32_t HRESULT;
+typedef int BOOL;
+typedef void *LPVOID;
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+
+#define WINAPI
+#define FALSE 0
+#define TRUE 1
+#define INFINITE 0xffffffffu
+#define WAIT_OBJECT_0 0u
+#define WAIT_TIMEOUT 258u
+
+#define S_OK ((HRESULT)0)
+#define S_FALSE ((HRESULT)1)
+#define E_FAIL ((HRESULT)0x80004005)
+#define FAILED(hr) ((HRESULT)(hr) < 0)
+#define SUCCEEDED(hr) ((HRESULT)(hr) >= 0)
+
+union LARGE_INTEGER
+{
+   int64_t QuadPart;
+};
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq);
+
+struct CompatHandle
+{
+   virtual ~CompatHandle() {}
+   virtual DWORD wait(DWORD ms) = 0;
+};
+typedef CompatHandle *HANDLE;
+
+struct CompatThread : CompatHandle
+{
+   pthread_t thread;
+   LPTHREAD_START_ROUTINE func;
+   LPVOID data;
+   bool joined;
+
+   static void *entry(void *self)
+   {
+      CompatThread *t = static_cast<CompatThread*>(self);
+      t->func(t->data);
+      return nullptr;
+   }
+
+   DWORD wait(DWORD)
+   {
+      if (!joined)
+         pthread_join(thread, nullptr);
+      joined = true;
+      return WAIT_OBJECT_0;
+   }
+
+   ~CompatThread()
+   {
+      if (!joined)
+         pthread_detach(thread);
+   }
+};
+
+// Auto-reset only, which is all Event uses.
+struct CompatEvent : CompatHandle
+{
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   bool set;
+
+   CompatEvent() : set(false)
+   {
+      pthread_mutex_init(&mutex, nullptr);
+      pthread_cond_init(&cond, nullptr);
+   }
+
+   ~CompatEvent()
+   {
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&mutex);
+   }
+
+   DWORD wait(DWORD ms)
+   {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += ms / 1000;
+      deadline.tv_nsec += (ms % 1000) * 1000000l;
+      if (deadline.tv_nsec >= 1000000000l)
+      {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000l;
+      }
+
+      pthread_mutex_lock(&mutex);
+      int ret = 0;
+      while (!set && ret != ETIMEDOUT)
+      {
+         if (ms == INFINITE)
+            pthread_cond_wait(&cond, &mutex);
+         else
+            ret = pthread_cond_timedwait(&cond, &mutex, &deadline);
+      }
+      bool signaled = set;
+      set = false;
+      pthread_mutex_unlock(&mutex);
+      return signaled ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+   }
+
+   void signal()
+   {
+      pthread_mutex_lock(&mutex);
+      set = true;
+      pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&mutex);
+   }
+};
+
+inline HANDLE CreateThread(void *, size_t, LPTHREAD_START_ROUTINE func, LPVOID data, DWORD, DWORD *)
+{
+   CompatThread *t = new CompatThread;
+   t->func = func;
+   t->data = data;
+   t->joined = false;
+   if (pthread_create(&t->thread, nullptr, CompatThread::entry, t))
+   {
+      t->joined = true;
+      delete t;
+      return nullptr;
+   }
+   return t;
+}
+
+inline HANDLE CreateEvent(void *, BOOL, BOOL, const char *) { return new CompatEvent; }
+inline BOOL SetEvent(HANDLE event) { static_cast<CompatEvent*>(event)->signal(); return TRUE; }
+inline DWORD WaitForSingleObject(HANDLE handle, DWORD ms) { return handle->wait(ms); }
+inline BOOL CloseHandle(HANDLE handle) { delete handle; return TRUE; }
+inline void Sleep(DWORD ms) { usleep(ms * 1000); }
+
+struct CRITICAL_SECTION
+{
+   pthread_mutex_t mutex;
+};
+
+inline void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&cs->mutex, &attr);
+   pthread_mutexattr_destroy(&attr);
+}
+
+inline void DeleteCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_destroy(&cs->mutex); }
+inline void EnterCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_lock(&cs->mutex); }
+inline void LeaveCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_unlock(&cs->mutex); }
+
+#endif
+
@@ -0,0 +1,122 @@
+// Times config_file_new() on a large config.
+//
+// Usage: config_bench [-n loads] [config.cfg]
+//
+// Without a config, writes one with 100000 shader passes (300000 keys,
+// about 8.7 MB) to a temporary file, like a huge .cgp preset.
+// Prints the fastest and average time of a load, including config_file_free().
+// To compare two versions of config_file.c, build this at both and run
+// them on the same file.
+
+#include "../../config_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+enum { Passes = 100000 };
+
+static bool write_config(const char *path)
+{
+   FILE *file = std::fopen(path, "w");
+   if (!file)
+      return false;
+
+   for (unsigned i = 0; i < Passes; i++)
+   {
+      std::fprintf(file, "shader%u = \"shaders/pass%u.cg\"\n", i, i);
+      std::fprintf(file, "filter_linear%u = true # c\n", i);
+      std::fprintf(file, "scale%u   =   2.0\n", i);
+   }
+
+   return std::fclose(file) == 0;
+}
+
+// Makes sure the file was actually parsed, not just read.
+static bool check_config(config_file_t *conf, bool generated)
+{
+   if (!conf)
+      return false;
+   if (!generated)
+      return true;
+
+   char key[64];
+   std::snprintf(key, sizeof(key), "scale%u", Passes - 1);
+   double scale = 0.0;
+   bool linear = false;
+   return config_get_double(conf, key, &scale) && scale == 2.0 &&
+      config_get_bool(conf, "filter_linear0", &linear) && linear;
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned loads = 20;
+   int c;
+   while ((c = getopt(argc, argv, "n:")) != -1)
+   {
+      if (c == 'n' && std::atoi(optarg) > 0)
+         loads = std::atoi(optarg);
+      else
+      {
+         std::cerr << "Usage: " << argv[0] << " [-n loads] [config.cfg]" << std::endl;
+         return 1;
+      }
+   }
+
+   std::string path;
+   bool generated = optind >= argc;
+   if (generated)
+   {
+      char tmp[] = "/tmp/config_bench.XXXXXX";
+      int fd = mkstemp(tmp);
+      if (fd < 0)
+      {
+         std::cerr << "Failed to create temporary file." << std::endl;
+         return 1;
+      }
+      close(fd);
+
+      path = tmp;
+      if (!write_config(path.c_str()))
+      {
+         std::cerr << "Failed to write " << path << "." << std::endl;
+         std::remove(path.c_str());
+         return 1;
+      }
+   }
+   else
+      path = argv[optind];
+
+   typedef std::chrono::steady_clock Clock;
+   double total = 0.0, best = 0.0;
+   bool ok = true;
+   for (unsigned i = 0; i < loads && ok; i++)
+   {
+      Clock::time_point start = Clock::now();
+      config_file_t *conf = config_file_new(path.c_str());
+      ok = check_config(conf, generated);
+      if (conf)
+         config_file_free(conf);
+      double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+      total += ms;
+      best = i ? std::min(best, ms) : ms;
+   }
+
+   if (generated)
+      std::remove(path.c_str());
+
+   if (!ok)
+   {
+      std::cerr << "Failed to parse " << path << "." << std::endl;
+      return 1;
+   }
+
+   std::printf("%u loads: best %.2f ms, average %.2f ms\n", loads, best, total / loads);
+   return 0;
+}
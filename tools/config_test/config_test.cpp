@@ -0,0 +1,244 @@
+// Checks config_file.c lookups and dumps against the behaviour of the
+// original list based parser: which entry wins with #includes and
+// duplicate keys, what config_set_* does to included keys, and dump order.
+//
+// Run with "make check". Exits with 0 if everything passed.
+
+#include "../../config_file.h"
+#include "check.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+// Linked with --wrap=calloc, so the hash index can be made to run out of memory.
+namespace Fail
+{
+   static bool index_grow;
+}
+
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+   // The index is an array of entry pointers, at least 16 of them.
+   // Let the first one through, fail growing it.
+   if (Fail::index_grow && size == sizeof(void*) && count > 16)
+      return nullptr;
+   return __real_calloc(count, size);
+}
+
+static std::string dir;
+
+static void write_file(const char *name, const char *data)
+{
+   FILE *file = std::fopen((dir + "/" + name).c_str(), "w");
+   CHECK(file);
+   if (!file)
+      return;
+   std::fputs(data, file);
+   std::fclose(file);
+}
+
+static config_file_t *load(const char *name)
+{
+   config_file_t *conf = config_file_new((dir + "/" + name).c_str());
+   CHECK(conf);
+   if (!conf)
+      std::exit(report_checks());
+   return conf;
+}
+
+static std::string get(config_file_t *conf, const char *key)
+{
+   char buf[256];
+   if (!config_get_array(conf, key, buf, sizeof(buf)))
+      return "(none)";
+   return buf;
+}
+
+static std::string dump(config_file_t *conf, bool all)
+{
+   FILE *file = std::tmpfile();
+   if (all)
+      config_file_dump_all(conf, file);
+   else
+      config_file_dump(conf, file);
+
+   std::string out;
+   std::rewind(file);
+   int c;
+   while ((c = std::getc(file)) != EOF)
+      out += static_cast<char>(c);
+   std::fclose(file);
+   return out;
+}
+
+#define CHECK_STR(a, b) do { \
+   std::string a_ = (a), b_ = (b); \
+   CHECK(a_ == b_); \
+   if (a_ != b_) \
+      std::cerr << "  Got:" << std::endl << a_ << std::endl << "  Expected:" << std::endl << b_ << std::endl; \
+} while (0)
+
+// The first entry for a key in list order wins. Included entries sit
+// where the #include was, so they override what follows it, not what precedes it.
+static void test_include_override()
+{
+   write_file("main.cfg",
+         "a = \"parent first\"\n"
+         "#include \"inc.cfg\"\n"
+         "b = parent_after\n"
+         "c = 3\n");
+   write_file("inc.cfg",
+         "a = included\n"
+         "b = included\n"
+         "#include \"nested.cfg\"\n"
+         "d = 4\n");
+   write_file("nested.cfg",
+         "c = nested\n"
+         "e = nested\n");
+
+   config_file_t *conf = load("main.cfg");
+   CHECK_STR(get(conf, "a"), "parent first");
+   CHECK_STR(get(conf, "b"), "included");
+   CHECK_STR(get(conf, "c"), "nested");
+   CHECK_STR(get(conf, "e"), "nested");
+   int d = 0;
+   CHECK(config_get_int(conf, "d", &d) && d == 4);
+   CHECK(config_entry_exists(conf, "e"));
+   CHECK(!config_entry_exists(conf, "f"));
+
+   CHECK_STR(dump(conf, true),
+         "#include \"inc.cfg\"\n"
+         "a = \"parent first\" \n"
+         "a = \"included\" (included)\n"
+         "b = \"included\" (included)\n"
+         "c = \"nested\" (included)\n"
+         "e = \"nested\" (included)\n"
+         "d = \"4\" (included)\n"
+         "b = \"parent_after\" \n"
+         "c = \"3\" \n");
+   CHECK_STR(dump(conf, false),
+         "#include \"inc.cfg\"\n"
+         "a = \"parent first\"\n"
+         "b = \"parent_after\"\n"
+         "c = \"3\"\n");
+
+   config_file_free(conf);
+}
+
+// Included entries are never written. Setting a key goes to its first
+// writable entry, or a new one at the end, even if an included entry
+// still shadows it for the getters.
+static void test_set_included()
+{
+   write_file("set.cfg",
+         "#include \"set_inc.cfg\"\n"
+         "own = 1\n");
+   write_file("set_inc.cfg",
+         "shared = included\n"
+         "only_included = included\n");
+
+   config_file_t *conf = load("set.cfg");
+   config_set_string(conf, "only_included", "first");
+   config_set_string(conf, "only_included", "second");
+   config_set_string(conf, "own", "2");
+   config_set_int(conf, "new", 5);
+
+   CHECK_STR(get(conf, "only_included"), "included");
+   CHECK_STR(get(conf, "own"), "2");
+   CHECK_STR(get(conf, "new"), "5");
+
+   CHECK_STR(dump(conf, false),
+         "#include \"set_inc.cfg\"\n"
+         "own = \"2\"\n"
+         "only_included = \"second\"\n"
+         "new = \"5\"\n");
+   CHECK_STR(dump(conf, true),
+         "#include \"set_inc.cfg\"\n"
+         "shared = \"included\" (included)\n"
+         "only_included = \"included\" (included)\n"
+         "own = \"2\" \n"
+         "only_included = \"second\" \n"
+         "new = \"5\" \n");
+
+   config_file_free(conf);
+}
+
+static void test_duplicates()
+{
+   write_file("dup.cfg",
+         "k = 1\n"
+         "other = x\n"
+         "k = 2\n"
+         "k = 3\n");
+
+   config_file_t *conf = load("dup.cfg");
+   int k = 0;
+   CHECK(config_get_int(conf, "k", &k) && k == 1);
+
+   config_set_int(conf, "k", 9);
+   CHECK(config_get_int(conf, "k", &k) && k == 9);
+   CHECK_STR(dump(conf, false),
+         "k = \"9\"\n"
+         "other = \"x\"\n"
+         "k = \"2\"\n"
+         "k = \"3\"\n");
+
+   config_file_free(conf);
+}
+
+// Whatever doesn't fit when the index can't grow is left out entirely,
+// so every entry which is dumped can also be looked up.
+static void test_index_full()
+{
+   std::string data;
+   for (unsigned i = 0; i < 40; i++)
+      data += "key" + std::to_string(i) + " = " + std::to_string(i) + "\n";
+   write_file("full.cfg", data.c_str());
+
+   Fail::index_grow = true;
+   config_file_t *conf = load("full.cfg");
+   config_set_string(conf, "late", "1");
+   Fail::index_grow = false;
+
+   std::string all = dump(conf, true);
+   unsigned found = 0;
+   for (unsigned i = 0; i < 40; i++)
+   {
+      std::string key = "key" + std::to_string(i);
+      bool dumped = all.find(key + " = ") != std::string::npos;
+      CHECK(dumped == config_entry_exists(conf, key.c_str()));
+      found += dumped;
+   }
+   CHECK(found > 0 && found < 40);
+   CHECK(!config_entry_exists(conf, "late") && all.find("late") == std::string::npos);
+
+   config_file_free(conf);
+}
+
+int main()
+{
+   char tmp[] = "/tmp/config_test.XXXXXX";
+   if (!mkdtemp(tmp))
+   {
+      std::cerr << "Failed to create temporary directory." << std::endl;
+      return 1;
+   }
+   dir = tmp;
+
+   test_include_override();
+   test_set_included();
+   test_duplicates();
+   test_index_full();
+
+   const char *files[] = { "main.cfg", "inc.cfg", "nested.cfg", "set.cfg",
+      "set_inc.cfg", "dup.cfg", "full.cfg" };
+   for (unsigned i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+      std::remove((dir + "/" + files[i]).c_str());
+   rmdir(tmp);
+
+   return report_checks();
+}
@@ -0,0 +1,286 @@
+// Drives Latency with a mock clock and device, and checks what it reports.
+//
+// Run with "make check". Exits with 0 if everything passed.
+
+#include "../../latency.hpp"
+#include "check.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <map>
+
+// 10 MHz, like QueryPerformanceFrequency() on most current machines.
+namespace Mock
+{
+   enum { Frequency = 10000000 };
+   static int64_t counter;
+
+   // The GPU finishes a frame this long after it was issued.
+   enum { GpuDelay = 10000 };
+   struct QueryState
+   {
+      bool issued;
+      int64_t issue_time;
+   };
+   static std::map<IDirect3DQuery9*, QueryState> queries;
+   static unsigned created;
+   static bool create_fails;
+
+   static int64_t time() { return counter / (Frequency / 1000000); }
+   static void set_time(int64_t usec) { counter = usec * (Frequency / 1000000); }
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+   count->QuadPart = Mock::counter;
+   return 1;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+   freq->QuadPart = Mock::Frequency;
+   return 1;
+}
+
+HRESULT IDirect3DDevice9::CreateQuery(D3DQUERYTYPE type, IDirect3DQuery9 **query)
+{
+   if (Mock::create_fails || type != D3DQUERYTYPE_EVENT)
+      return E_FAIL;
+
+   *query = new IDirect3DQuery9;
+   Mock::queries[*query] = Mock::QueryState();
+   Mock::created++;
+   return S_OK;
+}
+
+HRESULT IDirect3DQuery9::Issue(DWORD flags)
+{
+   Mock::QueryState &state = Mock::queries.at(this);
+   state.issued = flags == D3DISSUE_END;
+   state.issue_time = Mock::time();
+   return S_OK;
+}
+
+HRESULT IDirect3DQuery9::GetData(void *, DWORD, DWORD)
+{
+   const Mock::QueryState &state = Mock::queries.at(this);
+   if (!state.issued || Mock::time() < state.issue_time + Mock::GpuDelay)
+      return S_FALSE;
+   return S_OK;
+}
+
+ULONG IDirect3DQuery9::Release()
+{
+   Mock::queries.erase(this);
+   delete this;
+   return 0;
+}
+
+struct Stats
+{
+   unsigned n;
+   double min, p50, p95, p99, max;
+};
+
+// Finds the first report of a series in the log.
+static bool find_series(const std::string &log, const char *name, Stats &stats)
+{
+   std::string prefix = std::string("[Latency]: ") + name + " ";
+   size_t pos = log.find(prefix);
+   if (pos == std::string::npos)
+      return false;
+
+   return std::sscanf(log.c_str() + pos + prefix.size(),
+         " n %u min %lf p50 %lf p95 %lf p99 %lf max %lf",
+         &stats.n, &stats.min, &stats.p50, &stats.p95, &stats.p99, &stats.max) == 6;
+}
+
+static void check_series(const std::string &log, const char *name, unsigned n, double ms)
+{
+   Stats stats;
+   bool found = find_series(log, name, stats);
+   CHECK(found);
+   if (!found)
+   {
+      std::cerr << "  Missing series " << name << "." << std::endl;
+      return;
+   }
+
+   CHECK(stats.n == n);
+   CHECK(stats.min == ms && stats.max == ms);
+   if (stats.n != n || stats.min != ms || stats.max != ms)
+      std::cerr << "  " << name << ": n " << stats.n << ", min " << stats.min
+         << ", max " << stats.max << ", expected n " << n << ", " << ms << " ms." << std::endl;
+}
+
+static unsigned count(const std::string &log, const char *str)
+{
+   unsigned n = 0;
+   for (size_t pos = log.find(str); pos != std::string::npos; pos = log.find(str, pos + 1))
+      n++;
+   return n;
+}
+
+enum { TriggerKey = 0x39, OtherKey = 0x1e };
+
+// One frame as the driver sees it: input polled at start,
+// frame() called 2 ms later, Present() from 5 to 6 ms.
+// If edge_key isn't -1, the key is pressed as input is polled.
+static void run_frame(IDirect3DDevice9 *dev, int64_t start, int edge_device = 0, int edge_key = -1)
+{
+   Mock::set_time(start);
+   Latency::input_polled(Latency::now());
+   if (edge_key >= 0)
+      Latency::input_edge(edge_device, edge_key, Latency::now());
+
+   Mock::set_time(start + 2000);
+   Latency::frame_begin();
+
+   Mock::set_time(start + 5000);
+   Latency::present_begin(dev);
+
+   Mock::set_time(start + 6000);
+   Latency::present_end();
+}
+
+// Far enough into the uptime that counter * 1000000 overflows 64 bits,
+// about 23 days at 10 MHz.
+static const int64_t Uptime = INT64_C(2000000000000);
+
+static void test_now()
+{
+   LogCapture capture;
+   Latency::init();
+
+   Mock::counter = Uptime * 10;
+   CHECK(Latency::now() == Uptime);
+   Mock::counter = Uptime * 10 + 15;
+   CHECK(Latency::now() == Uptime + 1);
+   Mock::counter = INT64_MAX;
+   CHECK(Latency::now() == INT64_MAX / 10);
+
+   Latency::deinit();
+}
+
+static void test_series()
+{
+   IDirect3DDevice9 dev;
+   LogCapture capture;
+   Latency::init();
+   CHECK(Latency::enabled());
+
+   int64_t start = Uptime;
+   run_frame(&dev, start);
+   // A key which isn't the trigger, and the trigger on another device.
+   run_frame(&dev, start + 16000, -1, OtherKey);
+   run_frame(&dev, start + 32000, 0, TriggerKey);
+
+   std::string log = capture.log();
+   check_series(log, "poll->present", 3, 6.0);
+   check_series(log, "frame->present", 3, 4.0);
+   check_series(log, "present", 3, 1.0);
+   // Frames 1 and 2 are seen finished by the frame() call after them,
+   // 18 ms after input was polled. Frame 3 is still in flight.
+   check_series(log, "poll->gpu", 2, 18.0);
+   CHECK(log.find("edge->present") == std::string::npos);
+
+   LogCapture edge_capture;
+   run_frame(&dev, start + 48000, -1, TriggerKey);
+   // A press read by an earlier read than the poll counts from that read,
+   // to the microsecond. A second press before a Present() doesn't restart
+   // the measurement.
+   Mock::set_time(start + 64000);
+   Latency::input_polled(Latency::now());
+   Latency::input_edge(-1, TriggerKey, Latency::now() - 2500);
+   Mock::set_time(start + 65000);
+   Latency::input_edge(-1, TriggerKey, Latency::now());
+   Mock::set_time(start + 66000);
+   Latency::frame_begin();
+   Latency::present_begin(&dev);
+   Latency::present_end();
+   run_frame(&dev, start + 80000);
+
+   log = edge_capture.log();
+   Stats stats;
+   CHECK(find_series(log, "edge->present", stats));
+   CHECK(stats.n == 2 && stats.min == 4.5 && stats.max == 6.0);
+
+   Latency::deinit();
+   CHECK(Mock::queries.empty());
+}
+
+static void test_unsupported_queries()
+{
+   IDirect3DDevice9 dev;
+   LogCapture capture;
+   Mock::create_fails = true;
+   Latency::init();
+
+   for (unsigned i = 0; i < 6; i++)
+      run_frame(&dev, Uptime + i * 16000);
+   Latency::deinit();
+   Mock::create_fails = false;
+
+   std::string log = capture.log();
+   CHECK(count(log, "Event queries not supported") == 1);
+   CHECK(log.find("poll->gpu") == std::string::npos);
+   check_series(log, "poll->present", 3, 6.0);
+}
+
+static void test_release_device()
+{
+   IDirect3DDevice9 dev;
+   LogCapture capture;
+   Latency::init();
+
+   unsigned created = Mock::created;
+   for (unsigned i = 0; i < 8; i++)
+      run_frame(&dev, Uptime + i * 16000);
+   // Queries are reused once the GPU is done with them.
+   CHECK(Mock::created - created == 4);
+   CHECK(Mock::queries.size() == 4);
+
+   Latency::release_device();
+   CHECK(Mock::queries.empty());
+
+   // And created again on the new device.
+   run_frame(&dev, Uptime + 8 * 16000);
+   CHECK(Mock::queries.size() == 1);
+
+   Latency::deinit();
+   CHECK(Mock::queries.empty());
+}
+
+static void test_disabled()
+{
+   IDirect3DDevice9 dev;
+   unsetenv("RARCH_D3D9_LATENCY");
+
+   LogCapture capture;
+   Latency::init();
+   CHECK(!Latency::enabled());
+   run_frame(&dev, Uptime);
+   Latency::deinit();
+
+   CHECK(capture.log().empty());
+   CHECK(Mock::queries.empty());
+}
+
+int main()
+{
+   setenv("RARCH_D3D9_LATENCY", "3", 1);
+   char trigger[16];
+   std::snprintf(trigger, sizeof(trigger), "%d", TriggerKey);
+   setenv("RARCH_D3D9_LATENCY_TRIGGER", trigger, 1);
+
+   test_now();
+   test_series();
+   test_unsupported_queries();
+   test_release_device();
+   test_disabled();
+
+   return report_checks();
+}
@@ -0,0 +1,333 @@
+// Reports what a .cgp preset costs on the GPU, without needing one.
+//
+// Usage: preset_planner [options] preset.cgp
+//
+// Uses the same planning code as the driver (ChainPlan), so texture sizes
+// match what RenderChain allocates. Fill is the number of pixels each pass
+// shades per frame for the given input size.
+// Exits with 2 if a budget is given and exceeded.
+
+#include "../../chain_plan.hpp"
+#include "../../shader_preset.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct Options
+{
+   unsigned input_width, input_height;
+   unsigned input_scale;
+   unsigned vp_width, vp_height;
+   bool rgb15;
+   bool smooth;
+   bool compress_luts;
+   double vram_budget; // MiB, 0 if none.
+   double fill_budget; // Mpix per frame, 0 if none.
+   std::string preset;
+};
+
+static bool parse_size(const char *arg, unsigned &width, unsigned &height)
+{
+   return std::sscanf(arg, "%ux%u", &width, &height) == 2 && width && height;
+}
+
+// Image dimensions from PNG, TGA or BMP headers, which is what presets use.
+static bool image_size(const std::string &path, unsigned &width, unsigned &height)
+{
+   FILE *file = std::fopen(path.c_str(), "rb");
+   if (!file)
+      return false;
+
+   uint8_t head[26] = {0};
+   size_t len = std::fread(head, 1, sizeof(head), file);
+   std::fclose(file);
+
+   static const uint8_t png[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+   if (len >= 24 && !std::memcmp(head, png, sizeof(png)) && !std::memcmp(head + 12, "IHDR", 4))
+   {
+      width = (head[16] << 24) | (head[17] << 16) | (head[18] << 8) | head[19];
+      height = (head[20] << 24) | (head[21] << 16) | (head[22] << 8) | head[23];
+      return true;
+   }
+
+   if (len >= 26 && head[0] == 'B' && head[1] == 'M')
+   {
+      width = head[18] | (head[19] << 8) | (head[20] << 16) | (head[21] << 24);
+      int32_t h = head[22] | (head[23] << 8) | (head[24] << 16) | (head[25] << 24);
+      height = h < 0 ? -h : h;
+      return true;
+   }
+
+   size_t ext = path.find_last_of('.');
+   if (len >= 18 && ext != std::string::npos &&
+         (path.compare(ext, std::string::npos, ".tga") == 0 ||
+          path.compare(ext, std::string::npos, ".TGA") == 0))
+   {
+      width = head[12] | (head[13] << 8);
+      height = head[14] | (head[15] << 8);
+      return true;
+   }
+
+   return false;
+}
+
+// LUTs are loaded with a full mip chain. Block compression is assumed
+// to end up as DXT5, which is the larger of the two.
+static uint64_t lut_bytes(unsigned width, unsigned height, bool compressed)
+{
+   uint64_t bytes = 0;
+   for (;;)
+   {
+      if (compressed)
+         bytes += static_cast<uint64_t>((width + 3) / 4) * ((height + 3) / 4) * 16;
+      else
+         bytes += static_cast<uint64_t>(width) * height * 4;
+
+      if (width == 1 && height == 1)
+         break;
+      width = std::max(width / 2, 1u);
+      height = std::max(height / 2, 1u);
+   }
+   return bytes;
+}
+
+static double mib(uint64_t bytes)
+{
+   return bytes / (1024.0 * 1024.0);
+}
+
+static void format_bytes(char *buf, size_t size, uint64_t bytes)
+{
+   if (bytes < 1024 * 1024)
+      std::snprintf(buf, size, "%.1f KiB", bytes / 1024.0);
+   else
+      std::snprintf(buf, size, "%.2f MiB", mib(bytes));
+}
+
+static const char *scale_name(LinkInfo::ScaleType type)
+{
+   switch (type)
+   {
+      case LinkInfo::Absolute:
+         return "abs";
+      case LinkInfo::Viewport:
+         return "vp";
+      default:
+         return "src";
+   }
+}
+
+static std::string base_name(const std::string &path)
+{
+   if (path.empty())
+      return "(stock)";
+   size_t pos = path.find_last_of("/\\");
+   return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+static int report(const Options &opt)
+{
+   ShaderPreset preset(opt.preset);
+   std::vector<LinkInfo> links = ChainPlan::plan(preset,
+         opt.input_scale, opt.smooth, opt.vp_width, opt.vp_height);
+
+   std::printf("Preset: %s\n", opt.preset.c_str());
+   std::printf("Input: %ux%u %s, input_scale %u, viewport %ux%u\n\n",
+         opt.input_width, opt.input_height, opt.rgb15 ? "XRGB1555" : "XRGB8888",
+         opt.input_scale, opt.vp_width, opt.vp_height);
+
+   if (opt.input_width > links[0].tex_w || opt.input_height > links[0].tex_h)
+      std::printf("Warning: input is larger than the %ux%u input texture and will be cropped.\n\n",
+            links[0].tex_w, links[0].tex_h);
+
+   std::printf("%-4s %-24s %-11s %-9s %-6s %10s  %-16s %10s\n",
+         "Pass", "Shader", "Texture", "Format", "Filter", "Memory", "Output", "Fill");
+
+   uint64_t input_bytes = 0, target_bytes = 0, fill = 0;
+   unsigned width = opt.input_width, height = opt.input_height;
+   for (unsigned i = 0; i < links.size(); i++)
+   {
+      const LinkInfo &link = links[i];
+
+      // A pass samples its own texture. The first one is the input,
+      // which is kept for several frames of history.
+      uint64_t bytes;
+      const char *format;
+      if (i == 0)
+      {
+         bytes = static_cast<uint64_t>(link.tex_w) * link.tex_h *
+            (opt.rgb15 ? 2 : 4) * ChainPlan::HistoryTextures;
+         format = opt.rgb15 ? "X1R5G5B5" : "X8R8G8B8";
+         input_bytes += bytes;
+      }
+      else
+      {
+         bytes = static_cast<uint64_t>(link.tex_w) * link.tex_h * 4;
+         format = "X8R8G8B8";
+         target_bytes += bytes;
+      }
+
+      unsigned out_width, out_height;
+      ChainPlan::convert_geometry(link, out_width, out_height,
+            width, height, opt.vp_width, opt.vp_height);
+
+      // Rendering is clipped to the target, the next texture or the viewport.
+      bool last = i + 1 == links.size();
+      unsigned clip_w = last ? opt.vp_width : links[i + 1].tex_w;
+      unsigned clip_h = last ? opt.vp_height : links[i + 1].tex_h;
+      uint64_t pixels = static_cast<uint64_t>(std::min(out_width, clip_w)) *
+         std::min(out_height, clip_h);
+      fill += pixels;
+
+      char tex[32], out[32], mem[32];
+      std::snprintf(tex, sizeof(tex), "%ux%u", link.tex_w, link.tex_h);
+      std::snprintf(out, sizeof(out), "%ux%u %s", out_width, out_height,
+            link.scale_type_x == link.scale_type_y ? scale_name(link.scale_type_x) : "mixed");
+      format_bytes(mem, sizeof(mem), bytes);
+
+      std::printf("%-4u %-24s %-11s %-9s %-6s %10s  %-16s %10llu\n",
+            i, base_name(link.shader_path).c_str(), tex,
+            format, link.filter_linear ? "linear" : "point",
+            mem, out, static_cast<unsigned long long>(pixels));
+      if (i == 0)
+         std::printf("     (input texture, %u frames of history)\n",
+               static_cast<unsigned>(ChainPlan::HistoryTextures));
+
+      width = out_width;
+      height = out_height;
+   }
+
+   uint64_t lut_total = 0;
+   if (!preset.luts.empty())
+   {
+      std::printf("\n%-4s %-24s %-11s %-9s %10s\n", "LUT", "Id", "Size", "Format", "Memory");
+      for (unsigned i = 0; i < preset.luts.size(); i++)
+      {
+         const ShaderPreset::Lut &lut = preset.luts[i];
+         bool compress = lut.compress == ShaderPreset::Default ?
+            opt.compress_luts : lut.compress == ShaderPreset::Enabled;
+
+         unsigned lut_w, lut_h;
+         if (!image_size(lut.path, lut_w, lut_h))
+         {
+            std::printf("%-4u %-24s %-11s %-9s %10s\n", i, lut.id.c_str(), "?", "?", "?");
+            continue;
+         }
+
+         // Mirrors LutCache, only whole blocks get compressed.
+         compress = compress && !(lut_w & 3) && !(lut_h & 3);
+         uint64_t bytes = lut_bytes(lut_w, lut_h, compress);
+         lut_total += bytes;
+
+         char size[32], mem[32];
+         std::snprintf(size, sizeof(size), "%ux%u", lut_w, lut_h);
+         format_bytes(mem, sizeof(mem), bytes);
+         std::printf("%-4u %-24s %-11s %-9s %10s\n", i, lut.id.c_str(), size,
+               compress ? "DXT" : "A8R8G8B8", mem);
+      }
+   }
+
+   uint64_t total = input_bytes + target_bytes + lut_total;
+   double mpix = fill / 1000000.0;
+   std::printf("\nVRAM: %.2f MiB (input %.2f, render targets %.2f, LUTs %.2f)\n",
+         mib(total), mib(input_bytes), mib(target_bytes), mib(lut_total));
+   std::printf("Fill: %.2f Mpix/frame, %.1f Mpix/s at 60 Hz\n", mpix, mpix * 60.0);
+
+   int ret = 0;
+   if (opt.vram_budget > 0.0 && mib(total) > opt.vram_budget)
+   {
+      std::printf("Over VRAM budget of %.2f MiB.\n", opt.vram_budget);
+      ret = 2;
+   }
+   if (opt.fill_budget > 0.0 && mpix > opt.fill_budget)
+   {
+      std::printf("Over fill budget of %.2f Mpix/frame.\n", opt.fill_budget);
+      ret = 2;
+   }
+   return ret;
+}
+
+static void print_help()
+{
+   std::cerr << "Usage: preset_planner [options] preset.cgp" << std::endl;
+   std::cerr << "  --input WxH          Frame size from the core (default 256x224)." << std::endl;
+   std::cerr << "  --input-scale N      input_scale of the video driver (default 1)." << std::endl;
+   std::cerr << "  --viewport WxH       Final viewport (default 1280x960)." << std::endl;
+   std::cerr << "  --rgb15              Core uses XRGB1555." << std::endl;
+   std::cerr << "  --smooth             Bilinear filtering by default." << std::endl;
+   std::cerr << "  --compress-luts      As RARCH_D3D9_LUT_COMPRESS=1." << std::endl;
+   std::cerr << "  --vram-budget MIB    Exit with 2 if VRAM use exceeds this." << std::endl;
+   std::cerr << "  --fill-budget MPIX   Exit with 2 if Mpix per frame exceed this." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+   Options opt;
+   opt.input_width = 256;
+   opt.input_height = 224;
+   opt.input_scale = 1;
+   opt.vp_width = 1280;
+   opt.vp_height = 960;
+   opt.rgb15 = false;
+   opt.smooth = false;
+   opt.compress_luts = false;
+   opt.vram_budget = 0.0;
+   opt.fill_budget = 0.0;
+
+   for (int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+      bool ok = true;
+
+      if (!std::strcmp(arg, "--rgb15"))
+         opt.rgb15 = true;
+      else if (!std::strcmp(arg, "--smooth"))
+         opt.smooth = true;
+      else if (!std::strcmp(arg, "--compress-luts"))
+         opt.compress_luts = true;
+      else if (value && !std::strcmp(arg, "--input"))
+         ok = parse_size(argv[++i], opt.input_width, opt.input_height);
+      else if (value && !std::strcmp(arg, "--viewport"))
+         ok = parse_size(argv[++i], opt.vp_width, opt.vp_height);
+      else if (value && !std::strcmp(arg, "--input-scale"))
+         ok = (opt.input_scale = std::strtoul(argv[++i], nullptr, 0)) > 0;
+      else if (value && !std::strcmp(arg, "--vram-budget"))
+         ok = (opt.vram_budget = std::strtod(argv[++i], nullptr)) > 0.0;
+      else if (value && !std::strcmp(arg, "--fill-budget"))
+         ok = (opt.fill_budget = std::strtod(argv[++i], nullptr)) > 0.0;
+      else if (arg[0] != '-' && opt.preset.empty())
+         opt.preset = arg;
+      else
+         ok = false;
+
+      if (!ok)
+      {
+         print_help();
+         return 1;
+      }
+   }
+
+   if (opt.preset.empty())
+   {
+      print_help();
+      return 1;
+   }
+
+   try
+   {
+      return report(opt);
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+   }
+}
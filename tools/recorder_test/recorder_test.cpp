@@ -0,0 +1,518 @@
+// Drives FrameWriter with synthetic frames, and Recorder on top of a
+// stand-in Readback whose GPU finishes captures after a set number of
+// frames, and checks what ends up in the file and the log.
+//
+// Run with "make check". Exits with 0 if everything passed.
+
+#include "../../frame_writer.hpp"
+#include "../../recorder.hpp"
+#include "../../trace.hpp"
+#include "check.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum { Width = 64, Height = 32, Fps = 60 };
+
+// Every byte depends on frame, row and column, so swapped or flipped rows show.
+static void fill_frame(uint8_t *frame, size_t size, unsigned index)
+{
+   for (size_t i = 0; i < size; i++)
+      frame[i] = static_cast<uint8_t>(index * 31 + i * 7 + i / (Width * 3));
+}
+
+// The device side of recording, instead of readback.cpp.
+// Captures are numbered, and collect() fills frames with fill_frame().
+namespace Mock
+{
+   // Advanced by the test once per presented frame.
+   static unsigned frame;
+   // Frames until a capture can be collected without waiting.
+   static unsigned gpu_delay;
+   static unsigned next_capture;
+   static unsigned ready_at[3];
+   static unsigned waits;
+   static unsigned readbacks;
+   static Readback::Format format;
+
+   static void reset(unsigned delay)
+   {
+      frame = next_capture = waits = 0;
+      gpu_delay = delay;
+   }
+}
+
+Trace::Scope::Scope(const char *name, int arg, bool gpu) {}
+Trace::Scope::~Scope() {}
+
+Readback::Readback(IDirect3DDevice9 *dev, CGcontext ctx)
+   : dev(dev), ctx(ctx), head(0), count(0), fPrg(nullptr), vPrg(nullptr), programs_failed(false)
+{
+   Mock::readbacks++;
+}
+
+Readback::~Readback()
+{
+   Mock::readbacks--;
+}
+
+void Readback::pop()
+{
+   count--;
+}
+
+void Readback::drop()
+{
+   if (count)
+      pop();
+}
+
+bool Readback::capture(IDirect3DSurface9 *, const D3DVIEWPORT9 &vp,
+      unsigned width, unsigned height, Format format, unsigned)
+{
+   if (!vp.Width || !vp.Height || !supported(width, height, format))
+      return false;
+
+   if (count == Slots)
+      pop();
+
+   Slot &slot = slots[head];
+   slot.width = width;
+   slot.height = height;
+   slot.format = format;
+   slot.frame = Mock::next_capture++;
+   Mock::ready_at[head] = Mock::frame + Mock::gpu_delay;
+   Mock::format = format;
+
+   head = (head + 1) % Slots;
+   count++;
+   return true;
+}
+
+bool Readback::collect(uint8_t *buffer, unsigned width, unsigned height,
+      Format format, bool wait, bool keep)
+{
+   while (count)
+   {
+      unsigned index = (head + Slots - count) % Slots;
+      const Slot &slot = slots[index];
+      if (slot.width != width || slot.height != height || slot.format != format)
+      {
+         pop();
+         continue;
+      }
+
+      if (Mock::frame < Mock::ready_at[index])
+      {
+         if (!wait)
+            return false;
+         Mock::waits++;
+      }
+
+      fill_frame(buffer, frame_size(width, height, format), slot.frame);
+      if (!keep)
+         pop();
+      return true;
+   }
+
+   return false;
+}
+
+// Pushes frames without ever waiting, like Recorder does.
+// Returns the indices of the frames which made it into the ring.
+static std::vector<unsigned> push_frames(FrameWriter &writer, unsigned count, bool retry)
+{
+   std::vector<unsigned> committed;
+   for (unsigned i = 0; i < count; i++)
+   {
+      uint8_t *frame = writer.acquire();
+      while (!frame && retry)
+      {
+         usleep(1000);
+         frame = writer.acquire();
+      }
+
+      if (!frame)
+      {
+         writer.drop();
+         continue;
+      }
+
+      fill_frame(frame, writer.frame_size(), i);
+      writer.commit();
+      committed.push_back(i);
+   }
+   return committed;
+}
+
+static std::string read_all(FILE *file)
+{
+   std::string out;
+   char buf[4096];
+   size_t len;
+   while ((len = std::fread(buf, 1, sizeof(buf), file)) > 0)
+      out.append(buf, len);
+   return out;
+}
+
+static std::string read_file(const std::string &path)
+{
+   std::string out;
+   FILE *file = std::fopen(path.c_str(), "rb");
+   if (file)
+   {
+      out = read_all(file);
+      std::fclose(file);
+   }
+   return out;
+}
+
+// Expected file contents for frames in BGR888, which come in bottom-up.
+static std::string expected_bgr(const std::vector<unsigned> &indices)
+{
+   std::string out;
+   std::vector<uint8_t> frame(Width * Height * 3);
+   size_t pitch = Width * 3;
+   for (unsigned i = 0; i < indices.size(); i++)
+   {
+      fill_frame(&frame[0], frame.size(), indices[i]);
+      for (unsigned y = Height; y > 0; y--)
+         out.append(reinterpret_cast<const char*>(&frame[(y - 1) * pitch]), pitch);
+   }
+   return out;
+}
+
+static void test_bgr(const std::string &dir)
+{
+   std::string path = dir + "/frames.bgr";
+   FrameWriter writer(std::fopen(path.c_str(), "wb"), FrameWriter::BGR888, Width, Height, Fps);
+   CHECK(writer.frame_size() == Width * Height * 3);
+
+   std::vector<unsigned> committed = push_frames(writer, 50, true);
+   writer.close();
+
+   CHECK(committed.size() == 50);
+   CHECK(writer.written() == 50);
+   CHECK(writer.dropped() == 0);
+   CHECK(!writer.failed());
+   CHECK(read_file(path) == expected_bgr(committed));
+}
+
+static void test_y4m(const std::string &dir)
+{
+   std::string path = dir + "/frames.y4m";
+   FrameWriter writer(std::fopen(path.c_str(), "wb"), FrameWriter::Y4M, Width, Height, Fps);
+   CHECK(writer.frame_size() == Width * Height * 3 / 2);
+
+   std::vector<unsigned> committed = push_frames(writer, 20, true);
+   writer.close();
+   CHECK(writer.written() == 20);
+
+   char header[128];
+   std::snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n",
+         (unsigned)Width, (unsigned)Height, (unsigned)Fps);
+   std::string expected = header;
+   std::vector<uint8_t> frame(writer.frame_size());
+   for (unsigned i = 0; i < committed.size(); i++)
+   {
+      fill_frame(&frame[0], frame.size(), committed[i]);
+      expected += "FRAME\n";
+      expected.append(reinterpret_cast<const char*>(&frame[0]), frame.size());
+   }
+   CHECK(read_file(path) == expected);
+}
+
+// A pipe nobody reads from stalls the writer, like a disk that can't keep up.
+// The producer must then drop frames rather than wait, and every frame it
+// did hand over must still arrive, in order.
+static void test_drops()
+{
+   int fds[2];
+   if (pipe(fds) != 0)
+   {
+      CHECK(!"pipe() failed");
+      return;
+   }
+
+   FILE *out = fdopen(fds[1], "wb");
+   FILE *in = fdopen(fds[0], "rb");
+   FrameWriter writer(out, FrameWriter::BGR888, Width, Height, Fps);
+
+   // Far more than the ring and the pipe buffer hold.
+   const unsigned count = 200;
+   std::vector<unsigned> committed = push_frames(writer, count, false);
+   CHECK(writer.dropped() > 0);
+   CHECK(committed.size() + writer.dropped() == count);
+
+   std::string received;
+   std::thread reader([&]() { received = read_all(in); });
+   writer.close();
+   reader.join();
+   std::fclose(in);
+
+   CHECK(writer.written() == committed.size());
+   CHECK(!writer.failed());
+   CHECK(received == expected_bgr(committed));
+}
+
+static void test_write_failure(const std::string &dir)
+{
+   std::string path = dir + "/readonly.bgr";
+   FILE *file = std::fopen(path.c_str(), "wb");
+   std::fclose(file);
+
+   // Read-only stream, every write fails.
+   FrameWriter writer(std::fopen(path.c_str(), "rb"), FrameWriter::BGR888, Width, Height, Fps);
+   push_frames(writer, 4, true);
+   writer.close();
+
+   CHECK(writer.failed());
+   CHECK(writer.written() == 0);
+}
+
+static const D3DVIEWPORT9 viewport = { 0, 0, Width, Height, 0.0f, 1.0f };
+
+// Paced frames leave the writer plenty of time for each, so only
+// the stand-in GPU decides what is dropped.
+static void run_frames(Recorder &recorder, unsigned count, bool paced = true)
+{
+   for (unsigned i = 0; i < count; i++)
+   {
+      recorder.capture(nullptr, nullptr, nullptr, viewport);
+      Mock::frame++;
+      if (paced)
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+}
+
+struct Totals
+{
+   unsigned written, captured, dropped_gpu, dropped_disk;
+};
+
+// From the summary Recorder logs when it is destroyed.
+static bool parse_totals(const std::string &log, Totals &totals)
+{
+   size_t pos = log.find("Recorded ");
+   return pos != std::string::npos &&
+      std::sscanf(log.c_str() + pos,
+            "Recorded %u of %u frames to %*s dropped %u waiting on the GPU and %u",
+            &totals.written, &totals.captured, &totals.dropped_gpu, &totals.dropped_disk) == 4;
+}
+
+static void check_totals(const std::string &log, unsigned written, unsigned captured,
+      unsigned dropped_gpu, unsigned dropped_disk)
+{
+   Totals totals;
+   bool parsed = parse_totals(log, totals);
+   CHECK(parsed);
+   if (!parsed)
+      return;
+
+   CHECK(totals.written == written && totals.captured == captured &&
+         totals.dropped_gpu == dropped_gpu && totals.dropped_disk == dropped_disk);
+   if (totals.written != written || totals.captured != captured ||
+         totals.dropped_gpu != dropped_gpu || totals.dropped_disk != dropped_disk)
+      std::cerr << "  Log: " << log;
+}
+
+static std::vector<unsigned> sequence(unsigned begin, unsigned end)
+{
+   std::vector<unsigned> out;
+   for (unsigned i = begin; i < end; i++)
+      out.push_back(i);
+   return out;
+}
+
+// Only .y4m needs I420's alignment, raw BGR888 records the viewport as is.
+static void test_recorder_size(const std::string &dir)
+{
+   unsigned width, height;
+   Recorder::viewport_size(dir + "/size.y4m", 1283, 722, width, height);
+   CHECK(width == 1280 && height == 720);
+   Recorder::viewport_size(dir + "/size.bgr", 1283, 722, width, height);
+   CHECK(width == 1283 && height == 722);
+
+   bool threw = false;
+   try
+   {
+      Recorder recorder(dir + "/size.y4m", 1283, 720, Fps);
+   }
+   catch (const std::runtime_error&)
+   {
+      threw = true;
+   }
+   CHECK(threw);
+}
+
+// With the GPU a frame behind, every capture is collected the frame after,
+// nothing is waited for until the final flush, and nothing is dropped.
+static void test_recorder(const std::string &dir)
+{
+   std::string path = dir + "/recorder.bgr";
+   Mock::reset(1);
+   LogCapture capture;
+   {
+      Recorder recorder(path, Width, Height, Fps);
+      run_frames(recorder, 30);
+      CHECK(Mock::waits == 0);
+      CHECK(Mock::format == Readback::BGR888);
+   }
+   CHECK(Mock::readbacks == 0);
+
+   check_totals(capture.log(), 30, 30, 0, 0);
+   CHECK(read_file(path) == expected_bgr(sequence(0, 30)));
+}
+
+static void test_recorder_y4m(const std::string &dir)
+{
+   std::string path = dir + "/recorder.y4m";
+   Mock::reset(1);
+   LogCapture capture;
+   {
+      Recorder recorder(path, Width, Height, Fps);
+      run_frames(recorder, 5);
+      CHECK(Mock::format == Readback::I420);
+   }
+
+   std::string log = capture.log();
+   check_totals(log, 5, 5, 0, 0);
+   CHECK(log.find("I420 (lossy)") != std::string::npos);
+
+   std::string data = read_file(path);
+   CHECK(data.compare(0, 20, "YUV4MPEG2 W64 H32 F6") == 0);
+   CHECK(data.size() == data.find('\n') + 1 + 5 * (6 + Width * Height * 3 / 2));
+}
+
+// A GPU that never catches up: the ring fills with the first captures,
+// later frames are dropped and counted rather than waited for.
+static void test_recorder_gpu_behind(const std::string &dir)
+{
+   std::string path = dir + "/gpu_behind.bgr";
+   Mock::reset(1000);
+   LogCapture capture;
+   {
+      Recorder recorder(path, Width, Height, Fps);
+      run_frames(recorder, 10);
+      CHECK(Mock::waits == 0);
+   }
+
+   check_totals(capture.log(), 3, 10, 7, 0);
+   CHECK(read_file(path) == expected_bgr(sequence(0, 3)));
+}
+
+// A FIFO nobody reads from until the end stalls the writer. Frames are then
+// dropped on the disk side, and every frame is accounted for exactly once.
+static void test_recorder_disk_behind(const std::string &dir)
+{
+   std::string path = dir + "/fifo.bgr";
+   if (mkfifo(path.c_str(), 0600) != 0)
+   {
+      CHECK(!"mkfifo() failed");
+      return;
+   }
+
+   // Opened first, so opening the FIFO for writing doesn't block.
+   int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+   CHECK(fd >= 0);
+   fcntl(fd, F_SETFL, 0);
+
+   Mock::reset(0);
+   const unsigned count = 300;
+   std::string received;
+   LogCapture capture;
+   std::unique_ptr<Recorder> recorder(new Recorder(path, Width, Height, Fps));
+   run_frames(*recorder, count, false);
+
+   // Destroying the recorder waits for the writer, which needs the reader.
+   std::thread reader([&]() {
+      FILE *in = fdopen(fd, "rb");
+      received = read_all(in);
+      std::fclose(in);
+   });
+   recorder.reset();
+   reader.join();
+   std::remove(path.c_str());
+
+   Totals totals;
+   CHECK(parse_totals(capture.log(), totals));
+   CHECK(totals.captured == count);
+   CHECK(totals.dropped_disk > 0);
+   CHECK(totals.written + totals.dropped_gpu + totals.dropped_disk == count);
+
+   // Whatever arrived is whole frames, in capture order.
+   size_t size = Width * Height * 3;
+   CHECK(received.size() == totals.written * size);
+   unsigned next = 0;
+   for (size_t offset = 0; offset + size <= received.size(); offset += size)
+   {
+      while (next < count && received.compare(offset, size,
+               expected_bgr(std::vector<unsigned>(1, next))) != 0)
+         next++;
+      CHECK(next < count);
+      next++;
+   }
+}
+
+// Captures still on the GPU when the device goes away are dropped,
+// and recording carries on with the next device.
+static void test_recorder_release_device(const std::string &dir)
+{
+   std::string path = dir + "/release.bgr";
+   Mock::reset(1);
+   LogCapture capture;
+   {
+      Recorder recorder(path, Width, Height, Fps);
+      run_frames(recorder, 5);
+      CHECK(Mock::readbacks == 1);
+      recorder.release_device();
+      CHECK(Mock::readbacks == 0);
+      run_frames(recorder, 5);
+      CHECK(Mock::readbacks == 1);
+   }
+
+   check_totals(capture.log(), 9, 10, 1, 0);
+   std::vector<unsigned> expected = sequence(0, 4);
+   std::vector<unsigned> after = sequence(5, 10);
+   expected.insert(expected.end(), after.begin(), after.end());
+   CHECK(read_file(path) == expected_bgr(expected));
+}
+
+int main()
+{
+   char dir[] = "/tmp/recorder_test.XXXXXX";
+   if (!mkdtemp(dir))
+   {
+      std::cerr << "Failed to create temporary directory." << std::endl;
+      return 1;
+   }
+
+   test_bgr(dir);
+   test_y4m(dir);
+   test_drops();
+   test_write_failure(dir);
+   test_recorder_size(dir);
+   test_recorder(dir);
+   test_recorder_y4m(dir);
+   test_recorder_gpu_behind(dir);
+   test_recorder_disk_behind(dir);
+   test_recorder_release_device(dir);
+
+   const char *files[] = { "frames.bgr", "frames.y4m", "readonly.bgr",
+      "recorder.bgr", "recorder.y4m", "gpu_behind.bgr", "release.bgr" };
+   for (unsigned i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+      std::remove((std::string(dir) + "/" + files[i]).c_str());
+   rmdir(dir);
+
+   return report_checks();
+}
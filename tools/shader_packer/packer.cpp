@@ -0,0 +1,372 @@
+// Builds a shader pack (.cgpack) out of a .cgp preset, see shader_pack_format.hpp.
+//
+// Usage: shader_packer [--compress] [--vertex-profile vs_3_0]
+//          [--fragment-profile ps_3_0] in.cgp out.cgpack
+//
+// Shader, script and LUT paths are stored relative to the preset, so the
+// pack should live in the same directory as the preset it was built from.
+// The driver still needs the sources there if the device wants other
+// profiles than the pack was built for, or can't create a packed LUT.
+
+#include "../../shader_preset.hpp"
+#include "../../shader_pack_format.hpp"
+
+#include <windows.h>
+#include <d3d9.h>
+#include <d3dx9.h>
+#include <Cg/cg.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Global
+{
+   static IDirect3D9 *d3d;
+   static IDirect3DDevice9 *dev;
+   static CGcontext ctx;
+}
+
+class Writer
+{
+   public:
+      Writer() : out(sizeof(Pack::Header), '\0') {}
+
+      uint32_t offset() const { return out.size(); }
+
+      void align(unsigned alignment)
+      {
+         out.resize((out.size() + alignment - 1) & ~(alignment - 1), '\0');
+      }
+
+      uint32_t write(const void *data, size_t size)
+      {
+         uint32_t ret = offset();
+         out.append(reinterpret_cast<const char*>(data), size);
+         return ret;
+      }
+
+      uint32_t string(const std::string &str)
+      {
+         return write(str.c_str(), str.size() + 1);
+      }
+
+      template<typename T>
+      uint32_t table(const std::vector<T> &entries)
+      {
+         align(sizeof(uint32_t));
+         if (entries.empty())
+            return offset();
+         return write(&entries[0], entries.size() * sizeof(T));
+      }
+
+      void finish(Pack::Header &header)
+      {
+         header.size = out.size();
+         std::memcpy(&out[0], &header, sizeof(header));
+      }
+
+      bool save(const std::string &path) const
+      {
+         FILE *file = std::fopen(path.c_str(), "wb");
+         if (!file)
+            return false;
+
+         bool ok = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+         return (std::fclose(file) == 0) && ok;
+      }
+
+   private:
+      std::string out;
+};
+
+// Paths in the pack are relative to the preset.
+static std::string relative(const ShaderPreset &preset, const std::string &path)
+{
+   if (path.compare(0, preset.basedir.size(), preset.basedir) == 0)
+      return path.substr(preset.basedir.size());
+   return path;
+}
+
+static uint32_t compile(Writer &writer, const std::string &path,
+      CGprofile profile, const char *entry)
+{
+   // The driver passes cgD3D9GetOptimalOptions() for the actual device,
+   // which isn't known here. Those are tuning hints, the profile is what matters.
+   CGprogram prg = cgCreateProgramFromFile(Global::ctx, CG_SOURCE, path.c_str(),
+         profile, entry, nullptr);
+
+   const char *listing = cgGetLastListing(Global::ctx);
+   if (listing)
+      std::cerr << path << ": " << entry << ":" << std::endl << listing << std::endl;
+
+   const char *compiled = prg ? cgGetProgramString(prg, CG_COMPILED_PROGRAM) : nullptr;
+   if (!compiled)
+      throw std::runtime_error("Failed to compile " + path + "!");
+
+   uint32_t ret = writer.string(compiled);
+   cgDestroyProgram(prg);
+   return ret;
+}
+
+static bool has_alpha(D3DFORMAT format)
+{
+   switch (format)
+   {
+      case D3DFMT_A8R8G8B8:
+      case D3DFMT_A8B8G8R8:
+      case D3DFMT_A1R5G5B5:
+      case D3DFMT_A4R4G4B4:
+      case D3DFMT_A8R3G3B2:
+      case D3DFMT_A2R10G10B10:
+      case D3DFMT_A2B10G10R10:
+      case D3DFMT_A16B16G16R16:
+      case D3DFMT_A8:
+      case D3DFMT_A8L8:
+      case D3DFMT_A4L4:
+         return true;
+      default:
+         return false;
+   }
+}
+
+static bool is_compressed(D3DFORMAT format)
+{
+   switch (format)
+   {
+      case D3DFMT_DXT1:
+      case D3DFMT_DXT2:
+      case D3DFMT_DXT3:
+      case D3DFMT_DXT4:
+      case D3DFMT_DXT5:
+         return true;
+      default:
+         return false;
+   }
+}
+
+// Same choice as LutCache, minus the device format check,
+// as DXT1/DXT5 are supported by everything that runs ps_2_0.
+static D3DFORMAT lut_format(const std::string &path, bool compress)
+{
+   D3DXIMAGE_INFO info;
+   if (!compress || FAILED(D3DXGetImageInfoFromFileA(path.c_str(), &info)))
+      return D3DFMT_FROM_FILE;
+
+   if (is_compressed(info.Format) || (info.Width & 3) || (info.Height & 3))
+      return D3DFMT_FROM_FILE;
+
+   return has_alpha(info.Format) ? D3DFMT_DXT5 : D3DFMT_DXT1;
+}
+
+static Pack::Lut pack_lut(Writer &writer, const ShaderPreset &preset,
+      const ShaderPreset::Lut &lut, bool compress_all)
+{
+   bool compress = lut.compress == ShaderPreset::Default ?
+      compress_all : lut.compress == ShaderPreset::Enabled;
+
+   IDirect3DTexture9 *tex;
+   if (FAILED(D3DXCreateTextureFromFileExA(Global::dev, lut.path.c_str(),
+               D3DX_DEFAULT_NONPOW2, D3DX_DEFAULT_NONPOW2, 0, 0,
+               lut_format(lut.path, compress), D3DPOOL_SCRATCH,
+               lut.filter_linear ? D3DX_FILTER_LINEAR : D3DX_FILTER_POINT,
+               0, 0, nullptr, nullptr, &tex)))
+      throw std::runtime_error("Failed to load LUT " + lut.path + "!");
+
+   D3DSURFACE_DESC desc;
+   tex->GetLevelDesc(0, &desc);
+
+   Pack::Lut out = {0};
+   out.id = writer.string(lut.id);
+   out.filter_linear = lut.filter_linear;
+   out.format = desc.Format;
+   out.width = desc.Width;
+   out.height = desc.Height;
+   out.path = writer.string(relative(preset, lut.path));
+   out.compress = compress;
+
+   std::vector<Pack::Level> levels(tex->GetLevelCount());
+   for (unsigned i = 0; i < levels.size(); i++)
+   {
+      D3DLOCKED_RECT rect;
+      if (FAILED(tex->GetLevelDesc(i, &desc)) ||
+            FAILED(tex->LockRect(i, &rect, nullptr, D3DLOCK_READONLY)))
+      {
+         tex->Release();
+         throw std::runtime_error("Failed to read LUT " + lut.path + "!");
+      }
+
+      // Block compressed formats store 4x4 texel blocks per row.
+      levels[i].pitch = rect.Pitch;
+      levels[i].rows = is_compressed(desc.Format) ? (desc.Height + 3) / 4 : desc.Height;
+
+      writer.align(Pack::PackAlignment);
+      levels[i].texels = writer.write(rect.pBits, levels[i].pitch * levels[i].rows);
+      tex->UnlockRect(i);
+   }
+   tex->Release();
+
+   out.level_count = levels.size();
+   out.levels = writer.table(levels);
+
+   std::cerr << "LUT " << lut.id << ": " << out.width << "x" << out.height <<
+      ", " << out.level_count << " levels" <<
+      (is_compressed(static_cast<D3DFORMAT>(out.format)) ? ", compressed" : "") << std::endl;
+   return out;
+}
+
+static void pack(const std::string &in, const std::string &out,
+      const char *vertex_name, const char *fragment_name, bool compress)
+{
+   ShaderPreset preset(in);
+
+   CGprofile vertex = cgGetProfile(vertex_name);
+   CGprofile fragment = cgGetProfile(fragment_name);
+   if (vertex == CG_PROFILE_UNKNOWN || fragment == CG_PROFILE_UNKNOWN)
+      throw std::runtime_error("Unknown Cg profile!");
+
+   Writer writer;
+   Pack::Header header = {{0}};
+   std::memcpy(header.magic, Pack::Magic, sizeof(header.magic));
+   header.version = Pack::Version;
+   header.vertex_profile = writer.string(vertex_name);
+   header.fragment_profile = writer.string(fragment_name);
+
+   std::vector<Pack::Pass> passes;
+   for (unsigned i = 0; i < preset.passes.size(); i++)
+   {
+      const ShaderPreset::Pass &in = preset.passes[i];
+      std::cerr << "Compiling " << in.shader << " ..." << std::endl;
+
+      Pack::Pass pass = {0};
+      pass.shader = writer.string(relative(preset, in.shader));
+      pass.vertex_object = compile(writer, in.shader, vertex, "main_vertex");
+      pass.fragment_object = compile(writer, in.shader, fragment, "main_fragment");
+      pass.has_scale = in.has_scale;
+      pass.type_x = in.type_x;
+      pass.type_y = in.type_y;
+      pass.scale_x = in.scale_x;
+      pass.scale_y = in.scale_y;
+      pass.abs_x = in.abs_x;
+      pass.abs_y = in.abs_y;
+      pass.filter_linear = in.filter_linear;
+      passes.push_back(pass);
+   }
+   header.pass_count = passes.size();
+   header.passes = writer.table(passes);
+
+   std::vector<Pack::Lut> luts;
+   for (unsigned i = 0; i < preset.luts.size(); i++)
+      luts.push_back(pack_lut(writer, preset, preset.luts[i], compress));
+   header.lut_count = luts.size();
+   header.luts = writer.table(luts);
+
+   if (!preset.imports.empty())
+   {
+      header.import_script = writer.string(relative(preset, preset.import_script));
+      header.import_script_class = writer.string(preset.import_script_class);
+
+      std::vector<uint32_t> imports;
+      for (unsigned i = 0; i < preset.imports.size(); i++)
+         imports.push_back(writer.string(preset.imports[i]));
+      header.import_count = imports.size();
+      header.imports = writer.table(imports);
+   }
+
+   writer.finish(header);
+   if (!writer.save(out))
+      throw std::runtime_error("Failed to write " + out + "!");
+
+   std::cerr << "Wrote " << out << " (" << header.size << " bytes)." << std::endl;
+}
+
+// Scratch textures don't need real hardware, a NULLREF device is enough for D3DX.
+static void init_d3d()
+{
+   Global::d3d = Direct3DCreate9(D3D_SDK_VERSION);
+   if (!Global::d3d)
+      throw std::runtime_error("Failed to create D3D9 interface!");
+
+   D3DPRESENT_PARAMETERS d3dpp;
+   ZeroMemory(&d3dpp, sizeof(d3dpp));
+   d3dpp.Windowed = TRUE;
+   d3dpp.SwapEffect = D3DSWAPEFFECT_DISCARD;
+   d3dpp.BackBufferWidth = d3dpp.BackBufferHeight = 1;
+
+   if (FAILED(Global::d3d->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_NULLREF,
+               GetDesktopWindow(), D3DCREATE_SOFTWARE_VERTEXPROCESSING,
+               &d3dpp, &Global::dev)))
+      throw std::runtime_error("Failed to create D3D9 device!");
+}
+
+static void deinit_d3d()
+{
+   if (Global::dev)
+      Global::dev->Release();
+   if (Global::d3d)
+      Global::d3d->Release();
+}
+
+static void print_help()
+{
+   std::cerr << "Usage: shader_packer [--compress] [--vertex-profile vs_3_0] "
+      "[--fragment-profile ps_3_0] in.cgp out.cgpack" << std::endl;
+   std::cerr << "  --compress: Block compress LUTs which don't set <id>_compress." << std::endl;
+   std::cerr << "  Profiles must match what the driver picks for the target GPU," <<
+      " otherwise it compiles from source." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *vertex = "vs_3_0";
+   const char *fragment = "ps_3_0";
+   bool compress = false;
+   std::vector<std::string> files;
+
+   for (int i = 1; i < argc; i++)
+   {
+      if (!std::strcmp(argv[i], "--compress"))
+         compress = true;
+      else if (!std::strcmp(argv[i], "--vertex-profile") && i + 1 < argc)
+         vertex = argv[++i];
+      else if (!std::strcmp(argv[i], "--fragment-profile") && i + 1 < argc)
+         fragment = argv[++i];
+      else if (argv[i][0] == '-')
+      {
+         print_help();
+         return 1;
+      }
+      else
+         files.push_back(argv[i]);
+   }
+
+   if (files.size() != 2)
+   {
+      print_help();
+      return 1;
+   }
+
+   int ret = 0;
+   try
+   {
+      init_d3d();
+      Global::ctx = cgCreateContext();
+      if (!Global::ctx)
+         throw std::runtime_error("Failed to create Cg context!");
+
+      pack(files[0], files[1], vertex, fragment, compress);
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << "Error: " << e.what() << std::endl;
+      ret = 1;
+   }
+
+   if (Global::ctx)
+      cgDestroyContext(Global::ctx);
+   deinit_d3d();
+   return ret;
+}
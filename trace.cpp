@@ -0,0 +1,216 @@
+#include "trace.hpp"
+#include "thread.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <d3d9.h>
+
+namespace Trace
+{
+   std::atomic<bool> active(false);
+
+   struct Event
+   {
+      std::atomic<uint32_t> seq;
+      const char *name;
+      int64_t timestamp;
+      DWORD tid;
+      int arg;
+      char phase;
+   };
+
+   // Bounded multi-producer queue.
+   // Each cell carries a sequence number telling producers and the
+   // consumer whether it's free or filled, so no locks are needed.
+   enum { Events = 1 << 14, EventsMask = Events - 1 };
+   static Event ring[Events];
+   static std::atomic<uint32_t> head;
+   static uint32_t tail;
+   static std::atomic<unsigned> dropped;
+
+   static LARGE_INTEGER freq;
+   static LARGE_INTEGER base;
+
+   static FILE *file;
+   static bool first_event;
+   static std::atomic<bool> running;
+   static std::unique_ptr<Thread> writer;
+
+   int64_t now()
+   {
+      LARGE_INTEGER current;
+      QueryPerformanceCounter(&current);
+      return ((current.QuadPart - base.QuadPart) * 1000000) / freq.QuadPart;
+   }
+
+   static void push(char phase, const char *name, int arg)
+   {
+      uint32_t pos = head.load(std::memory_order_relaxed);
+      Event *event;
+
+      for (;;)
+      {
+         event = &ring[pos & EventsMask];
+         int32_t diff = static_cast<int32_t>(event->seq.load(std::memory_order_acquire) - pos);
+         if (diff == 0)
+         {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+               break;
+         }
+         else if (diff < 0) // Full, writer is behind.
+         {
+            dropped++;
+            return;
+         }
+         else
+            pos = head.load(std::memory_order_relaxed);
+      }
+
+      event->name = name;
+      event->timestamp = now();
+      event->tid = GetCurrentThreadId();
+      event->arg = arg;
+      event->phase = phase;
+      event->seq.store(pos + 1, std::memory_order_release);
+   }
+
+   static bool pop(Event &out)
+   {
+      Event &event = ring[tail & EventsMask];
+      int32_t diff = static_cast<int32_t>(event.seq.load(std::memory_order_acquire) - (tail + 1));
+      if (diff < 0)
+         return false;
+
+      out.name = event.name;
+      out.timestamp = event.timestamp;
+      out.tid = event.tid;
+      out.arg = event.arg;
+      out.phase = event.phase;
+
+      event.seq.store(tail + Events, std::memory_order_release);
+      tail++;
+      return true;
+   }
+
+   static void flush()
+   {
+      Event event;
+      while (pop(event))
+      {
+         std::fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%lu",
+               first_event ? "" : ",",
+               event.name, event.phase,
+               static_cast<long long>(event.timestamp),
+               static_cast<unsigned long>(event.tid));
+
+         if (event.arg >= 0)
+            std::fprintf(file, ",\"args\":{\"index\":%d}", event.arg);
+         std::fputs("}", file);
+
+         first_event = false;
+      }
+   }
+
+   static void writer_loop()
+   {
+      while (running)
+      {
+         flush();
+         Sleep(10);
+      }
+      flush();
+   }
+
+   void init()
+   {
+      const char *path = std::getenv("RARCH_D3D9_TRACE");
+      if (!path || active)
+         return;
+
+      file = std::fopen(path, "w");
+      if (!file)
+      {
+         std::cerr << "[Trace]: Failed to open " << path << std::endl;
+         return;
+      }
+
+      std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+      first_event = true;
+
+      for (unsigned i = 0; i < Events; i++)
+         ring[i].seq = i;
+      head = 0;
+      tail = 0;
+      dropped = 0;
+
+      QueryPerformanceFrequency(&freq);
+      QueryPerformanceCounter(&base);
+
+      running = true;
+      writer = std::unique_ptr<Thread>(new Thread(writer_loop));
+      active = true;
+
+      std::cerr << "[Trace]: Writing trace to " << path << std::endl;
+   }
+
+   void deinit()
+   {
+      if (!active)
+         return;
+
+      active = false;
+      running = false;
+      writer.reset();
+
+      std::fputs("\n]}\n", file);
+      std::fclose(file);
+      file = nullptr;
+
+      if (dropped)
+         std::cerr << "[Trace]: Dropped " << dropped << " events." << std::endl;
+   }
+
+   void begin(const char *name, int arg)
+   {
+      if (enabled())
+         push('B', name, arg);
+   }
+
+   void end(const char *name, int arg)
+   {
+      if (enabled())
+         push('E', name, arg);
+   }
+
+   Scope::Scope(const char *name, int arg, bool gpu)
+      : name(name), arg(arg), traced(enabled()), gpu(gpu && traced)
+   {
+      if (!traced)
+         return;
+
+      if (this->gpu)
+      {
+         wchar_t buf[64];
+         if (arg >= 0)
+            snwprintf(buf, 64, L"%S %d", name, arg);
+         else
+            snwprintf(buf, 64, L"%S", name);
+         D3DPERF_BeginEvent(D3DCOLOR_XRGB(0x40, 0x80, 0xff), buf);
+      }
+
+      push('B', name, arg);
+   }
+
+   Scope::~Scope()
+   {
+      if (!traced)
+         return;
+
+      push('E', name, arg);
+      if (gpu)
+         D3DPERF_EndEvent();
+   }
+}
+
@@ -0,0 +1,51 @@
+#ifndef TRACE_HPP__
+#define TRACE_HPP__
+
+#include <atomic>
+#include <stdint.h>
+
+// Optional frame timeline tracing.
+// If RARCH_D3D9_TRACE is set in the environment, begin/end events
+// are written to that path in Chrome trace_event JSON format
+// (load it in chrome://tracing).
+//
+// Events go into a fixed-size lock-free ring, which is drained
+// to disk by a background thread.
+namespace Trace
+{
+   extern std::atomic<bool> active;
+
+   void init();
+   void deinit();
+
+   inline bool enabled() { return active.load(std::memory_order_relaxed); }
+
+   // name must be a string literal (or otherwise outlive the trace).
+   // arg is attached to the event if non-negative, e.g. the pass index.
+   void begin(const char *name, int arg = -1);
+   void end(const char *name, int arg = -1);
+
+   // Current time in microseconds, same time base as the trace.
+   int64_t now();
+
+   class Scope
+   {
+      public:
+         // If gpu is set, the scope is also wrapped in
+         // D3DPERF_BeginEvent/EndEvent so GPU captures line up.
+         Scope(const char *name, int arg = -1, bool gpu = false);
+         ~Scope();
+
+         Scope(const Scope&) = delete;
+         void operator=(const Scope&) = delete;
+
+      private:
+         const char *name;
+         int arg;
+         bool traced;
+         bool gpu;
+   };
+}
+
+#endif
+